@@ -0,0 +1,261 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Save a mesh at each of the U3D quality presets with the native writer (and
+ * with IDTFConverter if available) and compare the save times, file sizes and
+ * positional errors. The positional error of native files is measured by
+ * reading the vertex positions back out of each saved file and is shown
+ * alongside the bound given by r3dio::u3dPositionError.
+ *
+ * Usage: U3DBenchmark meshfile [outdir] [maxbytes]
+ * The saved files are removed afterwards unless outdir is given.
+ */
+
+#include <r3dio/IOHelpers.h>
+#include <r3dio/U3DExporter.h>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <vector>
+using r3dio::U3DQuality;
+namespace BFS = boost::filesystem;
+
+namespace {
+
+const uint32_t CLOD_BASE_MESH_CONTINUATION = 0xFFFFFF3B;
+
+// Little endian reading of a U3D file's bytes with bounds checking.
+class Reader
+{
+public:
+    Reader( const std::vector<unsigned char> &d, size_t pos, size_t end) : _d(d), _pos(pos), _end(end), _ok(true) {}
+
+    bool ok() const { return _ok;}
+
+    uint32_t u32()
+    {
+        uint32_t v = 0;
+        for ( int i = 0; i < 4 && _have(1); ++i)
+            v |= uint32_t( _d[_pos++]) << (8*i);
+        return v;
+    }   // end u32
+
+    uint16_t u16()
+    {
+        uint16_t v = 0;
+        for ( int i = 0; i < 2 && _have(1); ++i)
+            v = uint16_t( v | (_d[_pos++] << (8*i)));
+        return v;
+    }   // end u16
+
+    float f32()
+    {
+        const uint32_t b = u32();
+        float v;
+        std::memcpy( &v, &b, 4);
+        return v;
+    }   // end f32
+
+    void skip( size_t n) { if ( _have(n)) _pos += n;}
+
+private:
+    const std::vector<unsigned char> &_d;
+    size_t _pos;
+    const size_t _end;
+    bool _ok;
+
+    bool _have( size_t n)
+    {
+        _ok = _ok && _pos + n <= _end;
+        return _ok;
+    }   // end _have
+};  // end class
+
+
+// Read the vertex positions from the CLOD base mesh continuation block of the given U3D file.
+bool readPositions( const std::string &fname, std::vector<r3d::Vec3f> &pos)
+{
+    std::ifstream ifs( fname, std::ios::binary);
+    const std::vector<unsigned char> d( (std::istreambuf_iterator<char>( ifs)), std::istreambuf_iterator<char>());
+    size_t p = 0;
+    while ( p + 12 <= d.size())
+    {
+        Reader hdr( d, p, d.size());
+        const uint32_t type = hdr.u32();
+        const size_t dsize = hdr.u32();
+        const size_t msize = hdr.u32();
+        if ( type == CLOD_BASE_MESH_CONTINUATION)
+        {
+            Reader r( d, p + 12, std::min( d.size(), p + 12 + dsize));
+            r.skip( r.u16());   // Mesh name
+            r.u32();            // Chain index
+            r.u32();            // Face count
+            const uint32_t npos = r.u32();
+            r.skip( 4*4);       // Normal, diffuse, specular and texture coordinate counts
+            pos.resize( npos);
+            for ( r3d::Vec3f &v : pos)
+            {
+                const float x = r.f32();
+                const float y = r.f32();
+                const float z = r.f32();
+                v = r3d::Vec3f( x, y, z);
+            }   // end for
+            return r.ok();
+        }   // end if
+        p += 12 + ((dsize + 3) & ~size_t(3)) + ((msize + 3) & ~size_t(3));
+    }   // end while
+    return false;
+}   // end readPositions
+
+
+// Returns the maximum over the given positions of the distance to the nearest vertex of
+// the mesh. Vertices are searched for within rad along x first (all are searched if none
+// are found). This is a lower bound on the true displacement if vertices are closer
+// together than the quantization step.
+double measureError( const r3d::Mesh &mesh, const std::vector<r3d::Vec3f> &pos, double rad)
+{
+    std::vector<r3d::Vec3f> vs;
+    for ( int vid : mesh.vtxIds())
+        vs.push_back( mesh.vtx(vid));
+    const auto xless = []( const r3d::Vec3f &a, const r3d::Vec3f &b){ return a[0] < b[0];};
+    std::sort( vs.begin(), vs.end(), xless);
+
+    double maxErr = 0;
+    for ( const r3d::Vec3f &p : pos)
+    {
+        const float r = float( rad) + 1e-6f * std::max( 1.0f, std::fabs( p[0]));  // Allow for rounding
+        auto b = std::lower_bound( vs.begin(), vs.end(), r3d::Vec3f( p[0] - r, 0, 0), xless);
+        auto e = std::upper_bound( vs.begin(), vs.end(), r3d::Vec3f( p[0] + r, 0, 0), xless);
+        if ( b == e)
+        {
+            b = vs.begin();
+            e = vs.end();
+        }   // end if
+        double minErr = HUGE_VAL;
+        for ( auto it = b; it != e; ++it)
+            minErr = std::min( minErr, double( (*it - p).norm()));
+        maxErr = std::max( maxErr, minErr);
+    }   // end for
+    return maxErr;
+}   // end measureError
+
+
+const char *presetName( U3DQuality::Preset p)
+{
+    switch ( p)
+    {
+        case U3DQuality::DRAFT: return "draft";
+        case U3DQuality::BALANCED: return "balanced";
+        default: return "archival";
+    }   // end switch
+}   // end presetName
+
+}   // end namespace
+
+
+int main( int argc, char **argv)
+{
+    if ( argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " meshfile [outdir] [maxbytes]" << std::endl;
+        return EXIT_FAILURE;
+    }   // end if
+
+    const r3d::Mesh::Ptr mesh = r3dio::loadMesh( argv[1]);
+    if ( !mesh)
+    {
+        std::cerr << "[ERROR] U3DBenchmark: Unable to load " << argv[1] << std::endl;
+        return EXIT_FAILURE;
+    }   // end if
+
+    const bool keep = argc > 2;
+    const BFS::path dir = keep ? BFS::path( argv[2]) : BFS::temp_directory_path() / BFS::unique_path( "r3dio-u3dbench-%%%%-%%%%");
+    const size_t maxBytes = argc > 3 ? size_t( std::strtoull( argv[3], nullptr, 10)) : 0;
+    boost::system::error_code ec;
+    BFS::create_directories( dir, ec);
+
+    // IDTFConverter is also benchmarked if available since only it compresses the geometry
+    // according to the quality (the native writer just snaps the values to the quantization).
+    std::shared_ptr<r3dio::Config> cfg = std::make_shared<r3dio::Config>( *r3dio::Config::current());
+    cfg->setU3DCacheDirectory( "");     // Always save
+    const bool withIDTF = !cfg->resolvedIDTFConverter().empty();
+
+    std::cout << std::left << std::setw(8) << "writer" << std::setw(10) << "preset" << std::right
+              << std::setw(10) << "seconds" << std::setw(12) << "bytes"
+              << std::setw(14) << "est. error" << std::setw(14) << "meas. error" << std::endl;
+
+    bool ok = true;
+    for ( bool native : {true, false})
+    {
+        if ( !native && !withIDTF)
+            continue;
+        for ( U3DQuality::Preset p : {U3DQuality::DRAFT, U3DQuality::BALANCED, U3DQuality::ARCHIVAL})
+        {
+            U3DQuality q = U3DQuality::preset(p);
+            q.maxBytes = maxBytes;
+            const double estErr = r3dio::u3dPositionError( *mesh, q);
+            const std::string wname = native ? "native" : "idtf";
+            const std::string fname = (dir / (wname + "_" + presetName(p) + ".u3d")).string();
+
+            r3dio::U3DExporter exporter( true, false, rimg::Colour::white(), cfg);
+            exporter.setUseNative( native);
+            exporter.setQuality( q);
+            const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            const bool saved = exporter.save( *mesh, fname);
+            const double secs = std::chrono::duration<double>( std::chrono::steady_clock::now() - t0).count();
+
+            // Only the native writer's uncompressed positions can be read back
+            std::vector<r3d::Vec3f> pos;
+            if ( !saved || (native && !readPositions( fname, pos)))
+            {
+                std::cerr << "[ERROR] U3DBenchmark: Unable to save and reload " << fname << std::endl;
+                ok = false;
+                continue;
+            }   // end if
+
+            std::cout << std::left << std::setw(8) << wname << std::setw(10) << presetName(p) << std::right
+                      << std::setw(10) << std::fixed << std::setprecision(3) << secs
+                      << std::setw(12) << BFS::file_size( fname, ec)
+                      << std::setw(14) << std::scientific << std::setprecision(3) << estErr;
+            if ( native)
+                std::cout << std::setw(14) << measureError( *mesh, pos, estErr) << std::endl;
+            else
+                std::cout << std::setw(14) << "n/a" << std::endl;
+        }   // end for
+    }   // end for
+
+    std::cout << "\nNative file sizes don't vary with the geometry quality (positions and texture"
+              << "\ncoordinates are stored uncompressed); only the texture quality and maxbytes apply."
+              << std::endl;
+    if ( !withIDTF)
+        std::cout << "IDTFConverter isn't available so wasn't benchmarked." << std::endl;
+
+    if ( !keep)
+        BFS::remove_all( dir, ec);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}   // end main
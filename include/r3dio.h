@@ -19,16 +19,25 @@
 #define R3DIO_H
 
 #include "r3dio/AssetImporter.h"
+#include "r3dio/Config.h"
+#include "r3dio/Context.h"
 #include "r3dio/IDTFExporter.h"
 #include "r3dio/IOFormats.h"
 #include "r3dio/IOHelpers.h"
 #include "r3dio/LatexWriter.h"
 #include "r3dio/MeshExporter.h"
 #include "r3dio/MeshImporter.h"
+#include "r3dio/MeshLayout.h"
+#include "r3dio/MeshRasterizer.h"
 #include "r3dio/OBJExporter.h"
+#include "r3dio/PDFBatch.h"
 #include "r3dio/PDFGenerator.h"
+#include "r3dio/PDFWriter.h"
 #include "r3dio/PLYExporter.h"
+#include "r3dio/ScratchSpace.h"
 #include "r3dio/TGAImage.h"
+#include "r3dio/Trace.h"
 #include "r3dio/U3DExporter.h"
+#include "r3dio/U3DWriter.h"
 
 #endif
@@ -0,0 +1,114 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Settings shared by the import/export stack: the paths of the external programs
+ * (pdflatex and IDTFConverter) and the cache directories.
+ *
+ * A Config is never modified once shared. The process wide configuration is replaced
+ * as a whole (see setCurrent and update) and objects using it take a snapshot when they
+ * are constructed, so changing settings never affects work already underway.
+ *
+ * Thread safety: all static functions of Config, and the const functions of a shared
+ * Config, may be called from any number of threads at once. Distinct importer, exporter,
+ * LatexWriter, PDFWriter and PDFGenerator objects may likewise be used concurrently
+ * (including to the same directory) since intermediate files are written under names
+ * unique to each call. A single object must not be used by more than one thread at a time.
+ */
+
+#ifndef R3DIO_CONFIG_H
+#define R3DIO_CONFIG_H
+
+#ifdef _WIN32
+#pragma warning( disable : 4251)
+#endif
+
+#include "r3dio_Export.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace r3dio {
+
+class r3dio_EXPORT Config
+{
+public:
+    using Ptr = std::shared_ptr<const Config>;
+
+    // Returns the current process wide configuration.
+    static Ptr current();
+
+    // Replace the current configuration (null restores the defaults).
+    static void setCurrent( const Ptr&);
+
+    // Replace the current configuration with a copy of it modified by fn. Concurrent
+    // calls are serialised so that no modification is lost.
+    static void update( const std::function<void( Config&)> &fn);
+
+    // Default configuration with programs expected on the PATH and no caching.
+    Config();
+    Config( const Config&);
+    Config &operator=( const Config&) = delete;
+
+    // Name or path of pdflatex. Defaults to "pdflatex".
+    void setPDFLatex( const std::string&);
+    const std::string &pdflatex() const { return _pdflatex;}
+
+    // Name or path of IDTFConverter. Defaults to "IDTFConverter".
+    void setIDTFConverter( const std::string&);
+    const std::string &idtfConverter() const { return _idtfConverter;}
+
+    // Full paths of the programs (empty if not found). The PATH is searched
+    // on first call only (for each Config object).
+    const std::string &resolvedPDFLatex() const;
+    const std::string &resolvedIDTFConverter() const;
+
+    // Cache of U3D files (see U3DExporter::setCacheDirectory).
+    void setU3DCacheDirectory( const std::string &d) { _u3dCacheDir = d;}
+    const std::string &u3dCacheDirectory() const { return _u3dCacheDir;}
+
+    // Cache of LaTeX formats (see LatexWriter::setFormatCacheDirectory).
+    void setFormatCacheDirectory( const std::string &d) { _fmtCacheDir = d;}
+    const std::string &formatCacheDirectory() const { return _fmtCacheDir;}
+
+    // Cache of compiled drawing layers (see LatexWriter::setLayerCacheDirectory).
+    void setLayerCacheDirectory( const std::string &d) { _layerCacheDir = d;}
+    const std::string &layerCacheDirectory() const { return _layerCacheDir;}
+
+    // Cache and resolution of prepared images (see LatexWriter::setImageDPI).
+    void setImageCacheDirectory( const std::string &d) { _imgCacheDir = d;}
+    const std::string &imageCacheDirectory() const { return _imgCacheDir;}
+    void setImageDPI( float dpi) { _imgDPI = dpi;}
+    float imageDPI() const { return _imgDPI;}
+
+private:
+    std::string _pdflatex;
+    std::string _idtfConverter;
+    std::string _u3dCacheDir;
+    std::string _fmtCacheDir;
+    std::string _layerCacheDir;
+    std::string _imgCacheDir;
+    float _imgDPI;
+
+    mutable std::once_flag _pdflatexOnce, _idtfOnce;
+    mutable std::string _rpdflatex, _ridtf;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -0,0 +1,146 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Execution resources shared by the import/export stack: a work stealing pool of
+ * threads, a budget for large temporary allocations (mostly texture buffers) and the
+ * directory intermediate files are written to. Pass the same Context to the importers,
+ * exporters and writers used by a host application so that their internal parallelism
+ * draws from one pool and never oversubscribes the machine however many conversions
+ * are running at once. Objects not given a Context use Context::global().
+ *
+ * All functions are thread safe.
+ */
+
+#ifndef R3DIO_CONTEXT_H
+#define R3DIO_CONTEXT_H
+
+#ifdef _WIN32
+#pragma warning( disable : 4251)
+#endif
+
+#include "r3dio_Export.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace r3dio {
+
+class r3dio_EXPORT Context
+{
+public:
+    using Ptr = std::shared_ptr<Context>;
+
+    // Create a context with a pool of nthreads worker threads (the number of hardware threads
+    // if <= 0), a memory budget of memBytes (unlimited if zero) and intermediate files written
+    // within scratchDir (the root of r3dio::ScratchSpace if empty).
+    static Ptr create( int nthreads=0, size_t memBytes=0, const std::string &scratchDir="");
+
+    // Returns the context used by objects not given one (created on first use with the defaults).
+    static Ptr global();
+
+    ~Context();
+
+    // Returns the number of worker threads in the pool.
+    size_t threads() const;
+
+    // Queue the given callable returning a future for its result. Tasks queued from within
+    // a worker are pushed onto that worker's own queue and may be stolen by idle workers.
+    template <typename F>
+    std::future<decltype(std::declval<F>()())> submit( F &&f)
+    {
+        using R = decltype(std::declval<F>()());
+        auto task = std::make_shared<std::packaged_task<R()> >( std::forward<F>(f));
+        std::future<R> fut = task->get_future();
+        _push( [task](){ (*task)();});
+        return fut;
+    }   // end submit
+
+    // Get the result of the given future, running other queued tasks while waiting for it
+    // so that waiting from within a task can't starve the pool. Other tasks aren't run if
+    // the calling thread holds a MemoryReservation; don't wait on a task that has yet to
+    // start while holding one since every worker may be blocked waiting for the memory.
+    template <typename T>
+    T get( std::future<T> &f)
+    {
+        while ( f.wait_for( std::chrono::seconds(0)) != std::future_status::ready)
+            if ( !_runOne())
+                f.wait_for( std::chrono::milliseconds(1));
+        return f.get();
+    }   // end get
+
+    // Call fn(i) for every i in [0,n) using at most maxTasks concurrent tasks (as many as there
+    // are workers if zero). The calling thread takes part and runs other queued tasks while
+    // waiting so parallelFor may be called from within tasks. Only tasks already running fn
+    // are waited for so it's safe to call while holding a MemoryReservation (in which case
+    // other queued tasks aren't run). Exceptions are rethrown.
+    void parallelFor( size_t n, const std::function<void( size_t)> &fn, size_t maxTasks=0);
+
+    // Returns the memory budget in bytes (zero for unlimited) and the amount currently acquired.
+    size_t memoryBudget() const { return _memBudget;}
+    size_t memoryUsed() const;
+
+    // Block until the given number of bytes are within the budget and acquire them. Requests
+    // larger than the whole budget are reduced to the budget. Pair with releaseMemory or
+    // use a MemoryReservation.
+    void acquireMemory( size_t bytes);
+    void releaseMemory( size_t bytes);
+
+    // Acquires memory from a context for its lifetime. While a thread holds a reservation
+    // it doesn't run other queued tasks when waiting in get or parallelFor.
+    class r3dio_EXPORT MemoryReservation
+    {
+    public:
+        MemoryReservation( Context &ctx, size_t bytes);
+        ~MemoryReservation();
+    private:
+        Context &_ctx;
+        const size_t _bytes;
+        MemoryReservation( const MemoryReservation&) = delete;
+        void operator=( const MemoryReservation&) = delete;
+    };  // end class
+
+    // Returns the directory intermediate files are written within (empty if using ScratchSpace).
+    const std::string &scratchDirectory() const { return _scratchDir;}
+
+    // Create a new uniquely named directory for intermediate files and return its path (empty on
+    // failure). Remove it using ScratchSpace::remove when finished with.
+    std::string makeScratchDirectory() const;
+
+private:
+    struct Pool;
+    Pool *_pool;
+    const size_t _memBudget;
+    size_t _memUsed;
+    mutable std::mutex _memMutex;
+    std::condition_variable _memCV;
+    const std::string _scratchDir;
+
+    Context( int, size_t, const std::string&);
+    void _push( std::function<void()>&&);
+    bool _runOne();
+    Context( const Context&) = delete;
+    void operator=( const Context&) = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
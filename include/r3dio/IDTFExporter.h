@@ -17,6 +17,8 @@
 
 /**
  * Export mesh to Intermediate Data Text Format (IDTF). Precursor to U3D format.
+ * Each material is written with its own shader and texture (saved as <stem>_M<k>.tga)
+ * and faces not associated with any material are given an untextured shader.
  */
 
 #ifndef R3DIO_IDTF_EXPORTER_H
@@ -39,6 +41,14 @@ public:
     IDTFExporter( bool delFiles=false, bool media9=false, const rimg::Colour &ems=rimg::Colour::white());
     ~IDTFExporter() override;
 
+    // Set whether per corner vertex normals are written (true by default). IDTFConverter
+    // ignores normals when run with normals exclusion enabled (-en 1) so they needn't be
+    // written in that case which roughly halves the size of the IDTF file.
+    void setWriteNormals( bool v) { _writeNormals = v;}
+
+    // Set the factor in (0,1] by which textures are downsampled before being saved (1 by default).
+    void setTextureScale( double v) { _txScale = v;}
+
 protected:
     virtual bool doSave( const r3d::Mesh&, const std::string& filename);
 
@@ -46,6 +56,8 @@ private:
     const bool _delOnDtor;
     const bool _media9;
     const rimg::Colour _ems;
+    bool _writeNormals;
+    double _txScale;
     std::string _idtffile;
     std::vector<std::string> _tgafiles;
     void _reset();
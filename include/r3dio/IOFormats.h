@@ -26,13 +26,104 @@
 #pragma warning( disable : 4251)
 #endif
 
-#include "r3dio_Export.h"
+#include "Context.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
 namespace r3dio {
 
+// Shared between the requester of a load/save and the load/save itself so that it can be
+// stopped. Cancelling is thread safe and takes effect when the load/save next checks it.
+class r3dio_EXPORT CancelToken
+{
+public:
+    using Ptr = std::shared_ptr<CancelToken>;
+    static Ptr create() { return Ptr( new CancelToken);}
+
+    void cancel() { _cancelled = true;}
+    bool cancelled() const { return _cancelled;}
+
+private:
+    std::atomic<bool> _cancelled;
+    CancelToken() : _cancelled(false) {}
+};  // end class
+
+
+// Progress reporting and stopping of loads/saves (see IOFormats::setControl).
+struct r3dio_EXPORT IOControl
+{
+    using Clock = std::chrono::steady_clock;
+
+    IOControl() : deadline( Clock::time_point::max()) {}
+
+    // If set, called on the loading/saving thread with the fraction done in [0,1]
+    // and the name of the current stage (e.g. "Writing faces").
+    std::function<void( float, const std::string&)> progress;
+
+    CancelToken::Ptr cancel;    // If set, the load/save stops soon after this is cancelled
+    Clock::time_point deadline; // The load/save stops if still running at this time (never by default)
+
+    // Returns true iff cancelled or past the deadline.
+    bool stopped() const { return (cancel && cancel->cancelled()) || Clock::now() >= deadline;}
+};  // end struct
+
+
+// Statistics of a load/save (see IOFormats::stats). Stage times are wall clock seconds
+// except where a stage's work is done by concurrent tasks (textures in some formats)
+// in which case the time is summed over the tasks. Stages not taking place stay zero.
+struct r3dio_EXPORT IOStats
+{
+    using Clock = std::chrono::steady_clock;
+
+    IOStats() { reset();}
+
+    void reset() { *this = IOStats( 0);}
+
+    // Add the stage times of the given stats to these (e.g. from an intermediate exporter).
+    void addTimes( const IOStats&);
+
+    double totalSeconds;    // The whole load/save
+    double parseSeconds;    // Reading and parsing the file into an intermediate form (e.g. Assimp's)
+    double convertSeconds;  // Converting between the intermediate form and r3d::Mesh
+    double textureSeconds;  // Decoding/encoding (and reading/writing) texture images
+    double processSeconds;  // Waiting on external programs (e.g. IDTFConverter)
+    double writeSeconds;    // Writing the file
+
+    size_t bytesRead;       // The file loaded and its textures
+    size_t bytesWritten;    // The file saved and its textures
+
+    size_t vertices;        // Vertices of the loaded/saved mesh
+    size_t faces;           // Faces of the loaded/saved mesh
+    size_t materials;       // Materials of the loaded/saved mesh
+    size_t textures;        // Texture images read/written
+    size_t duplicateFaces;  // Faces not loaded because they duplicate others
+    size_t nonTriangles;    // Polygons not loaded because they aren't triangles
+    size_t degenerateFaces; // Faces not loaded because their vertices aren't all different
+
+    // Adds the wall time over its lifetime to the given stage time.
+    class Timer
+    {
+    public:
+        explicit Timer( double &secs) : _secs(secs), _t0( Clock::now()) {}
+        ~Timer() { _secs += std::chrono::duration<double>( Clock::now() - _t0).count();}
+    private:
+        double &_secs;
+        const Clock::time_point _t0;
+        Timer( const Timer&) = delete;
+        void operator=( const Timer&) = delete;
+    };  // end class
+
+private:
+    explicit IOStats( int) : totalSeconds(0), parseSeconds(0), convertSeconds(0), textureSeconds(0),
+        processSeconds(0), writeSeconds(0), bytesRead(0), bytesWritten(0), vertices(0), faces(0),
+        materials(0), textures(0), duplicateFaces(0), nonTriangles(0), degenerateFaces(0) {}
+};  // end struct
+
+
 class r3dio_EXPORT IOFormats
 {
 public:
@@ -56,11 +147,59 @@ public:
     // Returns true iff addSupported was called from a derived type.
     bool isSupported() const { return !getExtensions().empty();}
 
+    // Set the context whose threads, memory budget and scratch directory are used
+    // when loading/saving. If not set (or set null), Context::global() is used.
+    void setContext( const Context::Ptr &ctx) { _ctx = ctx;}
+    Context::Ptr context() const { return _ctx ? _ctx : Context::global();}
+
+    // Set how subsequent loads/saves report progress and when they stop early. Stopping is
+    // checked between stages and periodically within the loops over a mesh's elements (and
+    // while waiting on external programs). A stopped load/save fails with its error set.
+    void setControl( const IOControl &ctrl) { _ctrl = ctrl;}
+    const IOControl &control() const { return _ctrl;}
+
+    // Statistics of the last load/save (reset at the start of each). For loadAsync/saveAsync
+    // these are only complete once the returned future is ready.
+    const IOStats &stats() const { return _stats;}
+
 protected:
     bool addSupported( const std::string& ext, const std::string& desc);
     virtual void setErr( const std::string& errMsg);
 
+    // Report the fraction done in [0,1] of the current load/save and the name of its current
+    // stage. Returns false (setting the error) if the load/save should stop. Call only from
+    // the thread doing the load/save (use control().stopped() from other threads).
+    bool progress( float fraction, const std::string &stage);
+
+    // For loops over n elements within a stage covering [f0,f1] of the whole: reports progress
+    // for every 4096th element i, otherwise just returns true. The stage is a C string so that
+    // no std::string is made for the elements in between.
+    bool progress( size_t i, size_t n, float f0, float f1, const char *stage)
+    {
+        return (i & 0xfff) != 0 || progress( f0 + (f1-f0) * float(i) / float(n), stage);
+    }   // end progress
+
+    // For derived types to record statistics into.
+    IOStats &editStats() { return _stats;}
+
+    // Sets the control of an IOFormats for its lifetime then restores the previous one
+    // (so that the control given to loadAsync/saveAsync only applies to that call).
+    class ScopedControl
+    {
+    public:
+        ScopedControl( IOFormats &io, const IOControl &ctrl) : _io(io), _prev(io._ctrl) { _io._ctrl = ctrl;}
+        ~ScopedControl() { _io._ctrl = _prev;}
+    private:
+        IOFormats &_io;
+        const IOControl _prev;
+        ScopedControl( const ScopedControl&) = delete;
+        void operator=( const ScopedControl&) = delete;
+    };  // end class
+
 private:
+    Context::Ptr _ctx;
+    IOControl _ctrl;
+    IOStats _stats;
     std::string _err;
     std::vector<std::string> _exts;
     std::unordered_map<std::string, std::string> _exts2desc;
@@ -18,20 +18,64 @@
 #ifndef R3DIO_IO_HELPERS_H
 #define R3DIO_IO_HELPERS_H
 
-#include "r3dio_Export.h"
+#include "Context.h"
 #include <r3d/Mesh.h>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <vector>
 
 namespace r3dio {
 
 // Load a triangulated mesh from 3DS, 3MF, DAE, OBJ, OFF, PLY, STL, or X3D file formats.
 r3dio_EXPORT r3d::Mesh::Ptr loadMesh( const std::string &fname);
 
+// Options for loadMeshes.
+struct r3dio_EXPORT LoadOptions
+{
+    LoadOptions() : parallelism(0), readAhead(4) {}
+
+    size_t parallelism; // Maximum number of files loaded at once (threads of the context if zero)
+    size_t readAhead;   // Number of files beyond those being loaded to ask the OS to prefetch
+    Context::Ptr ctx;   // The context to load with (Context::global() if null)
+
+    // If set, called as each file finishes loading (on the loading thread) with the file's
+    // index, its name and the loaded mesh (null on failure).
+    std::function<void( size_t, const std::string&, r3d::Mesh::Ptr)> onLoaded;
+};  // end struct
+
+// Load the given files (as loadMesh) concurrently returning a future for each in the same
+// order. Files are loaded in order by up to LoadOptions::parallelism tasks of the context,
+// each reusing a single importer. Returns immediately.
+r3dio_EXPORT std::vector<std::future<r3d::Mesh::Ptr> > loadMeshes( const std::vector<std::string>&,
+                                                                   const LoadOptions& = LoadOptions());
+
 // Save a triangulated mesh with format determined from the given filename's extension.
 // The extension should be one of the available formats listed n the below specific saveAs...
 // functions. If any other extension is used, the generic AssetExporter tries to save in
 // the given format, but if a suitable exporter isn't found, false is returned.
 r3dio_EXPORT bool saveMesh( const r3d::Mesh&, const std::string &filename);
 
+// Save the mesh to each of the given files (as saveMesh) concurrently using the tasks of the
+// given context (Context::global() if null). The mesh's elements are sorted and mapped once
+// and each texture is encoded once per image format for all of the PLY, OBJ and AssetExporter
+// formats. Returns true only if every file was saved.
+r3dio_EXPORT bool saveMesh( const r3d::Mesh&, const std::vector<std::string> &filenames,
+                                              const Context::Ptr &ctx=nullptr);
+r3dio_EXPORT bool saveMesh( const r3d::Mesh&, std::initializer_list<std::string> filenames,
+                                              const Context::Ptr &ctx=nullptr);
+
+// Make the file at src available at dst (which must not already exist) as cheaply as the
+// filesystem allows by trying (in order) a hard link, a copy-on-write clone (reflink), a
+// symbolic link (if allowSymlink is true), and finally copying. Returns false on failure.
+r3dio_EXPORT bool stageFile( const std::string &src, const std::string &dst, bool allowSymlink=true);
+
+// Create dst (which must not already exist) as an independent copy of the file at src using
+// a copy-on-write clone (reflink) if the filesystem supports it, otherwise copying the data.
+// Unlike stageFile, dst never shares an inode with src so later rewriting of either file in
+// place doesn't affect the other. Returns false on failure.
+r3dio_EXPORT bool copyFile( const std::string &src, const std::string &dst);
+
 /*** SPECIFIC SAVE FORMATS FOLLOW ***/
 
 // Save mesh in PLY format; file extension set/replaced as "ply".
@@ -18,7 +18,8 @@
 #ifndef R3DIO_LATEX_WRITER_H
 #define R3DIO_LATEX_WRITER_H
 
-#include "r3dio_Export.h"
+#include "Config.h"
+#include "Context.h"
 #include <rimg/Colour.h>
 #include <r3d/CameraParams.h>
 #include <r3d/Mesh.h>
@@ -40,20 +41,82 @@ public:
     // can be safely embedded within a Latex .tex file.
     static std::string sanit( const std::string&);
 
+    // Set a directory in which to cache LaTeX format files (empty by default for no caching).
+    // When set, the constant part of the preamble (including headers from addHeader) is
+    // dumped once into a format file keyed by its contents (requires the mylatexformat
+    // package) and pdflatex is started from this instead of loading the packages every time.
+    // Since media9 and hyperref can't be dumped, they are then loaded after the headers so
+    // headers mustn't use their macros (e.g. \hypersetup) when format caching is enabled.
+    // Without format caching, the headers come after all of the packages.
+    static void setFormatCacheDirectory( const std::string &dir);
+    static std::string formatCacheDirectory();
+
+    // Set a directory in which to cache compiled drawing layers (see beginLayer). If not set
+    // (the default), layers are compiled into the working directory of each writer.
+    static void setLayerCacheDirectory( const std::string &dir);
+    static std::string layerCacheDirectory();
+
+    // Set the resolution (dots per inch) at which images given to addImage are embedded.
+    // If positive, images are resampled down to fit their boxes at this resolution and
+    // stored as PNG (if they have transparency or few colours) or JPEG otherwise. Prepared
+    // images are cached in the image cache directory (or each writer's working directory if
+    // not set) keyed by the source image's contents and target size. The default of zero
+    // embeds images unchanged.
+    static void setImageDPI( float dpi);
+    static float imageDPI();
+    static void setImageCacheDirectory( const std::string &dir);
+    static std::string imageCacheDirectory();
+
+    // The static settings above are held in the current r3dio::Config and
+    // only affect writers constructed after they are changed.
+
     // Open page for writing with given with and height in millimetres.
+    // The working directory is created in r3dio::ScratchSpace and is removed
+    // in the background.
     // Set removeWorkingDir to false to retain the working directory and
     // its file contents after this object is destroyed.
-    LatexWriter( float wmm, float hmm, bool removeWorkingDir=true);
+    // Settings are taken from cfg (or Config::current if null). The working directory is made
+    // by ctx (or Context::global() if null) whose threads and memory budget are also used.
+    LatexWriter( float wmm, float hmm, bool removeWorkingDir=true, const Config::Ptr &cfg=nullptr,
+                 const Context::Ptr &ctx=nullptr);
 
     ~LatexWriter();
 
-    // Generate PDF from whatever content has been set so far and set
+    // Generate PDF (all pages) from whatever content has been set so far and set
     // return the location of the generated PDF or an empty string on failure.
     std::string makePDF() const;
 
+    // Write the tex file (as used by makePDF) without generating the PDF and return its path
+    // or an empty string on failure. If format caching is enabled, fmtfile is set to the format
+    // to start pdflatex from (see PDFGenerator::setFormat), otherwise it is set empty.
+    std::string writeTex( std::string &fmtfile) const;
+
+    // Start a new page with the given width and height in millimetres (same size as
+    // the current page if either is not positive). All subsequent drawing and content
+    // is added to the new page. Colours and copied in files are shared by all pages.
+    void newPage( float wmm=0, float hmm=0);
+
+    // Returns the number of pages (including the current one).
+    size_t numPages() const;
+
+    // Calls to fillRectangle, drawRectangle and drawLine made between beginLayer and endLayer
+    // are drawn on a layer underneath the rest of the page's content. Each layer is compiled
+    // once to a PDF cached by the hash of its content and is included as a single image rather
+    // than being evaluated by TikZ again. Starting a new page or layer ends any open layer.
+    void beginLayer();
+    void endLayer();
+
     // Returns the working directory for this writer.
     std::string workingDirectory() const;
 
+    // Returns the configuration this writer takes its settings from.
+    Config::Ptr config() const;
+
+    // Set whether to generate the PDF natively using r3dio::PDFWriter instead of pdflatex
+    // (false by default). The native writer is also used if pdflatex isn't available. It
+    // is never used if raw LaTeX has been added via addRaw or addHeader.
+    void setUseNative( bool);
+
     // Add raw tex to the header (useful for adding other packages).
     void addHeader( const std::string&);
     // Synonymous for addHeader.
@@ -66,6 +129,7 @@ public:
     void addText( const Box&, const std::string&, bool centre=false);
 
     // Copy in the given filepath to the working directory with name fname.
+    // The file is linked rather than copied where possible (see r3dio::stageFile).
     bool copyInFile( const std::string &filepath, const std::string &fname);
 
     // Draw outline and filled rectangles in the main document body.
@@ -84,6 +148,14 @@ public:
                               const std::string &bgImgPath="",
                               const std::string &caption="");
 
+    // Add a U3D mesh as above but with the background image rendered from the given mesh
+    // (as seen from the given camera) by r3dio::MeshRasterizer at dpi dots per inch.
+    void addMesh( const Box&, const std::string &u3dPath,
+                              const r3d::CameraParams&,
+                              const r3d::Mesh&,
+                              const std::string &caption="",
+                              float dpi=150);
+
 private:
     LatexWriter( const LatexWriter&) = delete;
     void operator=( const LatexWriter&) = delete;
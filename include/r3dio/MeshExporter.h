@@ -23,6 +23,8 @@
 #define R3DIO_MESH_EXPORTER_H
 
 #include "IOFormats.h"
+#include "MeshLayout.h"
+#include <future>
 #include <r3d/Mesh.h>
 
 namespace r3dio {
@@ -36,8 +38,29 @@ public:
     // Returns true on success. The filename extension must be supported.
     bool save( const r3d::Mesh&, const std::string& filename);
 
+    // Save as above in a task of this exporter's context returning immediately. The given
+    // control (see IOFormats::setControl) applies to this save only; the control previously
+    // set is restored once it's finished. Neither the mesh nor this exporter may be
+    // used (or changed or destroyed) until the returned future is ready. If waiting from
+    // within a task of the same context, use Context::get to avoid starving the pool.
+    std::future<bool> saveAsync( const r3d::Mesh&, const std::string& filename, const IOControl& = IOControl());
+
+    // Set the prepared layout of the mesh to save so that saving the same mesh with several
+    // exporters sorts and maps its elements and encodes its textures only once. The layout
+    // must be of the mesh given to save (which is not checked). Set null to not use one.
+    void setLayout( const MeshLayout::Ptr &lay) { _layout = lay;}
+
 protected:
     virtual bool doSave( const r3d::Mesh&, const std::string& filename) = 0;
+
+    // Returns the layout set with setLayout, or a new one made from the given mesh if not set.
+    MeshLayout::Ptr layout( const r3d::Mesh&) const;
+
+    // Returns the layout set with setLayout (may be null).
+    const MeshLayout::Ptr &presetLayout() const { return _layout;}
+
+private:
+    MeshLayout::Ptr _layout;
 };  // end class
 
 }   // end namespace
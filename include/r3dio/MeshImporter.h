@@ -24,6 +24,7 @@
 
 #include "IOFormats.h"
 #include <r3d/Mesh.h>
+#include <future>
 
 namespace r3dio {
 
@@ -36,6 +37,13 @@ public:
     // On error, null object returned. The filename extension must be supported.
     r3d::Mesh::Ptr load( const std::string& filename);
 
+    // Load as above in a task of this importer's context returning immediately. The given
+    // control (see IOFormats::setControl) applies to this load only; the control previously
+    // set is restored once it's finished. This importer must not be used or destroyed
+    // until the returned future is ready. If waiting from within a task of the same context,
+    // use Context::get to avoid starving the pool.
+    std::future<r3d::Mesh::Ptr> loadAsync( const std::string& filename, const IOControl& = IOControl());
+
 protected:
     virtual r3d::Mesh::Ptr doLoad( const std::string& filename) = 0;
 };  // end class
@@ -0,0 +1,81 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Preparation of a mesh common to the exporters: vertex, face and material IDs in
+ * ascending order (for consistent output), the mapping of vertex IDs to their output
+ * indices, and texture images encoded in a given file format. Making one MeshLayout
+ * and giving it to several exporters (see MeshExporter::setLayout) means that saving
+ * the same mesh in many formats does this work only once. Thread safe once constructed.
+ */
+
+#ifndef R3DIO_MESH_LAYOUT_H
+#define R3DIO_MESH_LAYOUT_H
+
+#ifdef _WIN32
+#pragma warning( disable : 4251)
+#endif
+
+#include "r3dio_Export.h"
+#include <r3d/Mesh.h>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace r3dio {
+
+class r3dio_EXPORT MeshLayout
+{
+public:
+    using Ptr = std::shared_ptr<const MeshLayout>;
+    static Ptr create( const r3d::Mesh&);
+
+    // The mesh this layout is of (which must outlive the layout and not be changed).
+    const r3d::Mesh &mesh() const { return _mesh;}
+
+    const std::vector<int> &vertexIds() const { return _vids;}      // Ascending
+    const std::vector<int> &faceIds() const { return _fids;}        // Ascending
+    const std::vector<int> &materialIds() const { return _mids;}    // Ascending
+
+    // Returns the position of the given vertex ID in vertexIds().
+    int vertexIndex( int vid) const { return _vidx.at(vid);}
+
+    // Write the texture of the given material to fname in the format given by its extension.
+    // Each texture is encoded at most once per format however many times it's written. The
+    // file is written under a unique name first and renamed so it's never seen partially
+    // written. Returns false if the material has no texture or on failure to encode/write.
+    bool writeTexture( int matId, const std::string &fname) const;
+
+private:
+    const r3d::Mesh &_mesh;
+    std::vector<int> _vids, _fids, _mids;
+    std::unordered_map<int,int> _vidx;
+    mutable std::mutex _mutex;  // Guards _encoded
+    using Encoded = std::shared_ptr<const std::vector<uchar> >;   // Null if encoding failed
+    mutable std::unordered_map<std::string, std::shared_future<Encoded> > _encoded;
+
+    explicit MeshLayout( const r3d::Mesh&);
+    MeshLayout( const MeshLayout&) = delete;
+    void operator=( const MeshLayout&) = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -0,0 +1,78 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#ifndef R3DIO_MESH_RASTERIZER_H
+#define R3DIO_MESH_RASTERIZER_H
+
+/**
+ * Software (CPU only) renderer of textured meshes for generating preview images where
+ * there's no graphics hardware. The image is divided into square tiles which triangles
+ * are binned into, and tiles are rasterized in parallel each with their own depth buffer.
+ * Texture coordinates are interpolated perspective correctly and faces are flat shaded
+ * with a light at the camera.
+ */
+
+#include "Context.h"
+#include <rimg/Colour.h>
+#include <r3d/CameraParams.h>
+#include <r3d/Mesh.h>
+#include <opencv2/opencv.hpp>
+
+namespace r3dio {
+
+class r3dio_EXPORT MeshRasterizer
+{
+public:
+    // Render images of width x height pixels using at most nthreads threads of the
+    // context (as many as the context has if <= 0).
+    MeshRasterizer( int width, int height, int nthreads=0);
+
+    // Set the context to render with (Context::global() if not set).
+    void setContext( const Context::Ptr &ctx) { _ctx = ctx;}
+
+    // Set the background colour (white by default).
+    void setBackground( const rimg::Colour &c) { _bg = c;}
+
+    // Render at ss times the resolution in each dimension before downsampling to smooth
+    // edges (default 1 for no supersampling).
+    void setSupersampling( int ss) { _ss = std::max( 1, ss);}
+
+    // Set whether faces are shaded according to their angle to the camera (default true).
+    // If false, faces are drawn with their texture or untextured colour only.
+    void setShading( bool v) { _shade = v;}
+
+    // Set the colour of faces without a material (light grey by default).
+    void setUntexturedColour( const rimg::Colour &c) { _ucol = cv::Vec3b( uchar(c.iblue()), uchar(c.igreen()), uchar(c.ired()));}
+
+    // Render the mesh as seen from the given camera returning a CV_8UC3 (BGR) image.
+    // The field of view of perspective cameras is vertical. Faces are drawn from both sides.
+    cv::Mat render( const r3d::Mesh&, const r3d::CameraParams&) const;
+
+    // Convenience function to render with default settings.
+    static cv::Mat render( const r3d::Mesh&, const r3d::CameraParams&, int width, int height);
+
+private:
+    int _w, _h, _nthreads, _ss;
+    Context::Ptr _ctx;
+    bool _shade;
+    rimg::Colour _bg;
+    cv::Vec3b _ucol;    // BGR
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -0,0 +1,94 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Generate many PDFs concurrently using a bounded pool of pdflatex processes.
+ * Jobs are queued with add and are run in order of being added by the next
+ * available worker. Each job returns a future giving the outcome of the job.
+ * The destructor waits for all queued jobs to finish. Jobs can be added from
+ * any thread.
+ */
+
+#ifndef R3DIO_PDF_BATCH_H
+#define R3DIO_PDF_BATCH_H
+
+#ifdef _WIN32
+#pragma warning( disable : 4251)
+#endif
+
+#include "LatexWriter.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace r3dio {
+
+class r3dio_EXPORT PDFBatch
+{
+public:
+    struct Result
+    {
+        std::string pdffile;    // Location of the generated PDF (empty on failure)
+        int exitCode;           // Exit code of the final pdflatex pass (-1 if not run)
+        double seconds;         // Time taken to run pdflatex
+        bool success;
+    };  // end struct
+
+    // Run at most nworkers concurrent pdflatex processes (hardware concurrency if zero).
+    // Set remGen as for PDFGenerator to remove the files generated by pdflatex.
+    explicit PDFBatch( size_t nworkers=0, bool remGen=true);
+    ~PDFBatch();
+
+    size_t workers() const { return _threads.size();}
+
+    // Queue generation of a PDF from the given tex file optionally starting
+    // pdflatex from the given format file (see PDFGenerator::setFormat).
+    // pdflatex is taken from Config::current at the time of adding.
+    std::future<Result> add( const std::string &texfile, const std::string &fmtfile="");
+
+    // As above but taking pdflatex from cfg (or Config::current if null).
+    std::future<Result> add( const std::string &texfile, const std::string &fmtfile, const Config::Ptr &cfg);
+
+    // Write out the tex file for the given writer (in the calling thread) and queue
+    // generation of its PDF using the writer's Config. The writer must not be destroyed
+    // before the job is finished.
+    std::future<Result> add( const LatexWriter&);
+
+    // Block until all queued jobs are finished.
+    void wait();
+
+private:
+    const bool _remGen;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::packaged_task<Result()> > _queue;
+    size_t _pending;    // Queued or running
+    bool _quit;
+    std::vector<std::thread> _threads;
+
+    void _run();
+    std::future<Result> _add( std::packaged_task<Result()>&&);
+    PDFBatch( const PDFBatch&) = delete;
+    void operator=( const PDFBatch&) = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
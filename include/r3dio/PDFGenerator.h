@@ -22,7 +22,7 @@
 #pragma warning( disable : 4251)
 #endif
 
-#include "r3dio_Export.h"
+#include "Config.h"
 #include <iostream>
 #include <string>
 
@@ -32,30 +32,49 @@ namespace r3dio {
 class r3dio_EXPORT PDFGenerator
 {
 public:
-    // Return the path of the 'pdflatex' program.
-    static const std::string& programPath();
+    // Return the path of the 'pdflatex' program (from Config::current).
+    static std::string programPath();
 
-    // Set the path of the 'pdflatex' program.
+    // Set the path of the 'pdflatex' program in the current Config returning true if available.
     static bool setProgramPath( const std::string &pdflatex);
 
     // Returns true iff the 'pdflatex' program is available.
     static bool isAvailable();
 
+    // Returns the full path of the 'pdflatex' program (empty if not available). The PATH
+    // is searched only on the first call after the program path is (re)set.
+    static std::string resolvedProgramPath();
+
+    // Create the LaTeX format file fmtfile from the preamble of texfile (everything up to
+    // \endofdump) using the mylatexformat package. Returns false if the format couldn't be made.
+    // The program path is taken from cfg (or Config::current if null).
+    static bool makeFormat( const std::string &texfile, const std::string &fmtfile, const Config::Ptr &cfg=nullptr);
+
     // Set remGen to true to remove files generated by pdflatex whether it
     // succeeds or fails, but never if pdflatex fails within a debug build.
-    explicit PDFGenerator( bool remGen=true);
+    // The program path is taken from cfg (or Config::current if null).
+    explicit PDFGenerator( bool remGen=true, const Config::Ptr &cfg=nullptr);
     virtual ~PDFGenerator(){}
 
-    // Run pdflatex against texfile - returns false if pdflatex fails.
+    // Run pdflatex against texfile - returns false if pdflatex fails. Further passes
+    // are run (up to three in total) only while the log asks for a rerun.
     // On returning true, file created is texfile with extension replaced with .pdf.
     // Set removeTexfileOnSuccess to delete texfile on success (unless debug build is
     // active in which case the input texfile is never deleted).
     bool operator()( const std::string& texfile, bool removeTexfileOnSuccess=false);
 
+    // Set the format file (see makeFormat) to start pdflatex with (none by default).
+    // The texfile must then have \endofdump at the end of the dumped part of its preamble.
+    void setFormat( const std::string &fmtfile) { _fmt = fmtfile;}
+
+    // Returns the exit code of the last pdflatex pass run by operator() (-1 if not run).
+    int exitCode() const { return _exitCode;}
+
 private:
     const bool _remGen;
-    // The path of the pdflatex program. Defaults to "pdflatex" ("pdflatex.exe" on Windows).
-    static std::string s_pdflatex;
+    std::string _fmt;
+    int _exitCode;
+    const Config::Ptr _cfg;
 };  // end class
 
 }   // end namespace
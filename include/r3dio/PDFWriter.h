@@ -0,0 +1,84 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Native writer of PDF documents (not needing LaTeX) supporting the drawing API
+ * of r3dio::LatexWriter. Text is set in Helvetica, JPEG images are embedded as is
+ * and other images are embedded losslessly. U3D models are embedded as interactive
+ * 3D annotations having the same views as LatexWriter gives them. Dimensions are
+ * in millimetres with positions given from the top left corner of the page.
+ */
+
+#ifndef R3DIO_PDF_WRITER_H
+#define R3DIO_PDF_WRITER_H
+
+#include "LatexWriter.h"
+
+namespace r3dio {
+
+class r3dio_EXPORT PDFWriter
+{
+public:
+    // Open first page with the given width and height in millimetres.
+    PDFWriter( float wmm, float hmm);
+    ~PDFWriter();
+
+    // Start a new page (same size as the current page if either dimension is not positive).
+    void newPage( float wmm=0, float hmm=0);
+
+    // Returns the number of pages (including the current one).
+    size_t numPages() const;
+
+    // Set the directory that relative image and model paths are relative to
+    // (the current working directory by default). Paths are resolved on save.
+    void setBaseDirectory( const std::string&);
+
+    // Add text at the given position wrapping lines at the width of the box.
+    void addText( const Box&, const std::string&, bool centre=false);
+
+    // Draw outline and filled rectangles.
+    void fillRectangle( const Box&, const rimg::Colour&);
+    void drawRectangle( const Box&, const rimg::Colour&);
+
+    // Draw a line between p and q in the given colour.
+    void drawLine( const Point &p, const Point &q, const rimg::Colour&);
+
+    // Add an image at the given position with optional caption.
+    void addImage( const Box&, const std::string &imgPath, const std::string &caption="");
+
+    // Add a U3D mesh at the given position with optional background image and caption.
+    void addMesh( const Box&, const std::string &u3dPath,
+                              const r3d::CameraParams&,
+                              const std::string &bgImgPath="",
+                              const std::string &caption="");
+
+    // Write the document returning false on failure (see err).
+    bool save( const std::string &pdffile) const;
+
+    // Returns the reason for the last failure to save.
+    const std::string &err() const;
+
+private:
+    PDFWriter( const PDFWriter&) = delete;
+    void operator=( const PDFWriter&) = delete;
+    struct Pimpl;
+    Pimpl *_pimpl;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -0,0 +1,66 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Location of intermediate files (IDTF files, TGA textures and LaTeX working directories).
+ * By default, intermediates are written within the system's temporary directory but
+ * a RAM backed filesystem (/dev/shm) or any caller provided directory can be used instead.
+ * Intermediates are removed on a background thread so that callers needn't wait for
+ * potentially slow deletes (e.g. on network mounted filesystems). Pending removals are
+ * completed before program exit. All functions are thread safe.
+ */
+
+#ifndef R3DIO_SCRATCH_SPACE_H
+#define R3DIO_SCRATCH_SPACE_H
+
+#include "r3dio_Export.h"
+#include <string>
+
+namespace r3dio {
+
+class r3dio_EXPORT ScratchSpace
+{
+public:
+    // Use the given directory (created if necessary) as the root for intermediate files.
+    // Pass an empty string to revert to the system's temporary directory (the default).
+    static void setDirectory( const std::string&);
+
+    // Use the RAM backed /dev/shm as the root for intermediate files. Returns false
+    // (leaving the root unchanged) if /dev/shm is not available on this system.
+    static bool useRAM();
+
+    // Returns the root directory for intermediate files.
+    static std::string directory();
+
+    // Create a new uniquely named directory within the root and return its path.
+    // Returns an empty string if the directory could not be created.
+    static std::string makeDirectory();
+
+    // Remove the given file or directory (recursively) on a background thread. The path is
+    // renamed before returning so it can be reused straight away by the caller.
+    static void remove( const std::string&);
+
+    // Block until all previously requested removals have completed.
+    static void wait();
+
+private:
+    ScratchSpace() = delete;
+};  // end class
+
+}   // end namespace
+
+#endif
@@ -18,16 +18,21 @@
 #ifndef R3DIO_IMAGE_IO_H
 #define R3DIO_IMAGE_IO_H
 
-#include "r3dio_Export.h"
+#include "Context.h"
 #include <opencv2/opencv.hpp>
 #include <string>
 
 
 namespace r3dio {
 
-r3dio_EXPORT bool saveTGA( const cv::Mat&, const std::string& fname);
+// Save 8-bit 1, 3 or 4 channel image as TGA. Set rle true to run length encode the
+// image (TGA types 10/11). Rows are encoded independently and nthreads sets the number
+// of threads of ctx (or Context::global() if null) to encode with (nthreads <= 0 uses
+// all of the context's threads).
+r3dio_EXPORT bool saveTGA( const cv::Mat&, const std::string& fname, bool rle=false, int nthreads=1, Context *ctx=nullptr);
 
-// Load TGA from file - returns an empty matrix on failure.
+// Load uncompressed or run length encoded TGA from file - returns an empty matrix on failure.
+// Colour mapped images are not supported. The file is memory mapped where possible.
 r3dio_EXPORT cv::Mat loadTGA( const std::string& fname);
 
 }   // end namespace
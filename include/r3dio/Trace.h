@@ -0,0 +1,79 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Optional recording of timed spans (e.g. loading, texture encoding, waiting on pdflatex) from
+ * all threads for viewing as a timeline in chrome://tracing or Perfetto. Recording is compiled
+ * in only if R3DIO_ENABLE_TRACE is defined (see the CMake option of the same name), otherwise
+ * R3DIO_TRACE expands to nothing and writeJSON does nothing. Each thread appends to its own
+ * buffer without locking; buffers are kept (and grow) for the life of the program.
+ */
+
+#ifndef R3DIO_TRACE_H
+#define R3DIO_TRACE_H
+
+#include "r3dio_Export.h"
+#include <chrono>
+#include <string>
+
+namespace r3dio {
+
+class r3dio_EXPORT Trace
+{
+public:
+    // Returns true iff recording was compiled in.
+    static bool enabled();
+
+    // Returns the number of spans recorded so far.
+    static size_t numSpans();
+
+    // Write all spans recorded so far as a Chrome trace event JSON file. Spans still
+    // open are not included. Safe to call while other threads record spans. Returns
+    // false if recording isn't compiled in or the file couldn't be written.
+    static bool writeJSON( const std::string &fname);
+
+#ifdef R3DIO_ENABLE_TRACE
+    // Records the time over its lifetime on the current thread as a span with the given name
+    // (which must remain valid for the life of the program, e.g. a string literal).
+    class r3dio_EXPORT Span
+    {
+    public:
+        explicit Span( const char *name) : _name(name), _t0( std::chrono::steady_clock::now()) {}
+        ~Span();
+    private:
+        const char *_name;
+        const std::chrono::steady_clock::time_point _t0;
+        Span( const Span&) = delete;
+        void operator=( const Span&) = delete;
+    };  // end class
+#endif
+
+private:
+    Trace() = delete;
+};  // end class
+
+}   // end namespace
+
+#ifdef R3DIO_ENABLE_TRACE
+#define R3DIO_TRACE_CAT2( a, b) a##b
+#define R3DIO_TRACE_CAT( a, b) R3DIO_TRACE_CAT2( a, b)
+#define R3DIO_TRACE( name) const r3dio::Trace::Span R3DIO_TRACE_CAT( r3dioTraceSpan, __LINE__)( name)
+#else
+#define R3DIO_TRACE( name) ((void)0)
+#endif
+
+#endif
@@ -19,9 +19,11 @@
  * Export r3d::Mesh objects to U3D format via creation
  * of IDTF files (see r3dio::IDTFExporter).
  *
- * The IDTFConverter that can convert .idtf files to .u3d files must be
+ * The IDTFConverter that can convert .idtf files to .u3d files should be
  * available on the PATH. IDTFConverter can be found at
  * https://www2.iaas.msu.ru/tmp/u3d/ (thanks to Michail Vidiassov).
+ * If IDTFConverter is not available (or if setUseNative(true) is called),
+ * the U3D file is written in process by r3dio::U3DWriter instead.
  *
  * Richard Palmer
  * August 2017
@@ -30,26 +32,53 @@
 #ifndef r3dio_U3D_EXPORTER_H
 #define r3dio_U3D_EXPORTER_H
 
-#include "MeshExporter.h"
-#include <rimg/Colour.h>
+#include "U3DWriter.h"
+#include "Config.h"
 
 namespace r3dio {
 
 class r3dio_EXPORT U3DExporter : public MeshExporter
 {
 public:
-    // Defines name of the IDTFConverter program which must be on the path.
-    // Defaults to "IDTFConverter" ("IDTFConverter.exe" on Windows).
-    static std::string IDTFConverter;   
+    // Set the name or path of the IDTFConverter program in the current Config.
+    // Defaults to "IDTFConverter" which must then be on the PATH.
+    static void setIDTFConverter( const std::string&);
+    static std::string idtfConverter();
 
-    // Returns true iff IDTFConverter is on the PATH.
+    // Returns true iff IDTFConverter is available (according to Config::current).
     static bool isAvailable();
 
-    // U3D conversion produces an IDTF file and a tga texture.
-    // Normally, both are destroyed immediately after saving the
-    // U3D model. Set delOnDestroy to false to retain these files.
+    // U3D conversion produces an IDTF file and tga textures.
+    // Normally, these are written to r3dio::ScratchSpace and are destroyed
+    // (in the background) after saving the U3D model. Set delOnDestroy to
+    // false to retain these files alongside the saved U3D file instead.
     // Setting media9 true will transform coordinates as (a,b,c) --> (a,-c,b).
-    U3DExporter( bool delOnDestroy=true, bool media9=false, const rimg::Colour &ems=rimg::Colour::white());
+    // The IDTFConverter and cache directory are taken from cfg (or Config::current if null).
+    U3DExporter( bool delOnDestroy=true, bool media9=false, const rimg::Colour &ems=rimg::Colour::white(),
+                 const Config::Ptr &cfg=nullptr);
+
+    // Set whether to always use the native U3DWriter instead of IDTFConverter.
+    // The native writer is always used if IDTFConverter isn't available.
+    void setUseNative( bool v) { _useNative = v;}
+    bool useNative() const { return _useNative || _cfg->resolvedIDTFConverter().empty();}
+
+    // Set the quality factors used for conversion (maximum quality by default).
+    // Use U3DQuality::preset to start from one of the presets. If the quality
+    // has a byte budget, textures are downsampled to fit before being saved.
+    void setQuality( const U3DQuality &q) { _quality = q;}
+    void setQuality( U3DQuality::Preset p) { _quality = U3DQuality::preset(p);}
+    const U3DQuality &quality() const { return _quality;}
+
+    // Set a directory in which to cache produced U3D files (empty by default for no caching).
+    // Cached files are keyed by a hash of the mesh geometry, texture coordinates and textures
+    // together with the export parameters (media9, emissive colour, quality and whether the
+    // native writer is used). If a matching file is present when saving, it is cloned (or
+    // copied if cloning isn't supported) to the save filename instead of being produced again.
+    // Cache entries are never hard linked so the saved file is independent of the cache.
+    // The directory is created on first use if it doesn't already exist. Sets the
+    // directory in the current Config so only affects exporters constructed afterwards.
+    static void setCacheDirectory( const std::string&);
+    static std::string cacheDirectory();
 
 protected:
     virtual bool doSave( const r3d::Mesh&, const std::string& filename);
@@ -58,6 +87,10 @@ private:
     const bool _delOnDestroy;
     const bool _media9;
     const rimg::Colour _ems;
+    bool _useNative;
+    U3DQuality _quality;
+    const Config::Ptr _cfg;
+    bool _save( const r3d::Mesh&, const std::string&);
 };  // end class
 
 }   // end namespace
@@ -0,0 +1,100 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Native (in process) writer of r3d::Mesh objects to U3D (ECMA-363) format.
+ *
+ * The mesh is written in its entirety as a CLOD base mesh (there are no progressive
+ * resolution updates) using the no compression profile. Each material is given its
+ * own shader and texture (stored as PNG or JPEG), and faces not associated with any
+ * material are given an untextured shader. All shaders use a single flat material
+ * having the emissive colour given on construction (in the same way as IDTFExporter).
+ */
+
+#ifndef R3DIO_U3D_WRITER_H
+#define R3DIO_U3D_WRITER_H
+
+#include "MeshExporter.h"
+#include <rimg/Colour.h>
+
+namespace r3dio {
+
+// Quality factors as used by IDTFConverter's -pq, -tcq, -gq and -tq parameters.
+// The position, texture coordinate and geometry (normal) qualities are in [0,1000]
+// and determine the quantization of these values with 1000 being lossless.
+// Texture quality is in [0,100] and sets the JPEG quality of saved textures
+// with 100 saving textures losslessly. If maxBytes is nonzero, textures are
+// downsampled so that the U3D file is estimated to be no larger than this.
+// Start from a preset and set individual members to override, e.g.
+// U3DQuality q = U3DQuality::preset( U3DQuality::BALANCED); q.texture = 90;
+struct r3dio_EXPORT U3DQuality
+{
+    enum Preset
+    {
+        DRAFT,      // Small and fast to load; visible quantization and texture artefacts.
+        BALANCED,   // Visually lossless at typical viewing distances.
+        ARCHIVAL    // Lossless (the default).
+    };  // end enum
+
+    static U3DQuality preset( Preset);
+
+    U3DQuality( int pq=1000, int tcq=1000, int gq=1000, int tq=100, size_t maxb=0)
+        : position(pq), texCoord(tcq), geometry(gq), texture(tq), maxBytes(maxb) {}
+
+    int position;
+    int texCoord;
+    int geometry;
+    int texture;
+    size_t maxBytes;
+};  // end struct
+
+
+// Returns the factor in (0,1] by which the mesh's textures should be scaled for the
+// U3D file to be within q.maxBytes. Returns 1 if q.maxBytes is zero or if there is
+// enough room. The estimate is approximate (especially for compressed textures).
+r3dio_EXPORT double u3dTextureScale( const r3d::Mesh&, const U3DQuality&);
+
+// Returns the texture downsampled by the given scale factor (or as is if scale >= 1).
+r3dio_EXPORT cv::Mat scaleTexture( const cv::Mat&, double scale);
+
+// Returns an estimate (the upper bound) of the maximum displacement of any vertex caused
+// by position quantization at the given quality; half a quantization step along each axis.
+// This is zero if the position quality is 1000 (lossless).
+r3dio_EXPORT double u3dPositionError( const r3d::Mesh&, const U3DQuality&);
+
+
+class r3dio_EXPORT U3DWriter : public MeshExporter
+{
+public:
+    // Setting media9 true will transform coordinates as (a,b,c) --> (a,-c,b).
+    U3DWriter( bool media9=false, const rimg::Colour &ems=rimg::Colour::white(), const U3DQuality &q=U3DQuality());
+
+    void setQuality( const U3DQuality &q) { _quality = q;}
+    const U3DQuality &quality() const { return _quality;}
+
+protected:
+    bool doSave( const r3d::Mesh&, const std::string& filename) override;
+
+private:
+    const bool _media9;
+    const rimg::Colour _ems;
+    U3DQuality _quality;
+};  // end class
+
+}   // end namespace
+
+#endif
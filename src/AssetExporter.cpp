@@ -16,12 +16,20 @@
  ************************************************************************/
 
 #include <AssetExporter.h>
+#include <Trace.h>
 #include <assimp/Exporter.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <assimp/ProgressHandler.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <cassert>
+#include <cstdint>
 using r3dio::AssetExporter;
 using r3d::Vec3f;
 using r3d::Vec2f;
@@ -72,7 +80,9 @@ std::string saveImage( aiMaterial* mat,
 */
 
 
-std::string saveMaterialTexture( aiMaterial* mat, const r3d::Mesh& model, int matId, const std::string& fname)
+// Set the material properties for the given material and return the path of the texture image
+// that the material references. An empty path is returned if the material has no texture.
+std::string setMaterialProperties( aiMaterial* mat, const r3d::Mesh& model, int matId, const std::string& fname)
 {
     const Path filepath(fname);
     const Path fstem = filepath.stem();
@@ -90,75 +100,140 @@ std::string saveMaterialTexture( aiMaterial* mat, const r3d::Mesh& model, int ma
     const aiString matName( oss.str());
     mat->AddProperty( &matName, AI_MATKEY_NAME);  // newmtl
 
-    const cv::Mat& txmap = model.texture(matId);
+    if ( model.texture(matId).empty())
+        return "";
 
-    const Path imgroot = ppath / fstem;
-    std::string err;
+    // Materials need their own images if there's more than one of them
+    const Path imgroot = model.numMats() > 1 ? ppath / oss.str() : ppath / fstem;
+    const Path imgpath( imgroot.string() + ".png");
+    const aiString tfile( imgpath.filename().string());
+    mat->AddProperty( &tfile, AI_MATKEY_TEXTURE( aiTextureType_AMBIENT, 0));
+    mat->AddProperty( &tfile, AI_MATKEY_TEXTURE( aiTextureType_SPECULAR, 0));
+    mat->AddProperty( &tfile, AI_MATKEY_TEXTURE( aiTextureType_DIFFUSE, 0));
+    return imgpath.string();
+}   // end setMaterialProperties
 
-    if ( !txmap.empty())
+
+// Save the material's texture to imgpath (if not already present) returning any error string.
+// The image is written under a unique name first and then renamed so that concurrent
+// exports never see (or leave) a partially written image.
+std::string saveMaterialTexture( const r3d::Mesh& model, int matId, const std::string& imgpath, const r3dio::MeshLayout* lay)
+{
+    R3DIO_TRACE( "AssetExporter: save texture");
+    std::string err;
+    if ( lay)   // Encoded once by the layout however many exporters share it
     {
-        Path imgpath( imgroot.string() + ".png");
-        const aiString tfile( imgpath.filename().string());
-        mat->AddProperty( &tfile, AI_MATKEY_TEXTURE( aiTextureType_AMBIENT, 0));
-        mat->AddProperty( &tfile, AI_MATKEY_TEXTURE( aiTextureType_SPECULAR, 0));
-        mat->AddProperty( &tfile, AI_MATKEY_TEXTURE( aiTextureType_DIFFUSE, 0));
-        if ( !boost::filesystem::exists(imgpath))   // Save if not already present
-        {
-            if ( !cv::imwrite( imgpath.string(), txmap))
-                err = "Cannot save texture to " + imgpath.string();
-        }   // end if
+        if ( !boost::filesystem::exists(imgpath) && !lay->writeTexture( matId, imgpath))
+            err = "Cannot save texture to " + imgpath;
+    }   // end if
+    else if ( !boost::filesystem::exists(imgpath))   // Save if not already present
+    {
+        const Path ipath( imgpath);
+        const Path tpath = ipath.parent_path() / boost::filesystem::unique_path( "%%%%-%%%%-%%%%-%%%%" + ipath.extension().string());
+        boost::system::error_code ec;
+        if ( !cv::imwrite( tpath.string(), model.texture(matId)))
+            err = "Cannot save texture to " + imgpath;
+        else
+            boost::filesystem::rename( tpath, ipath, ec);
+        if ( ec)
+            err = "Cannot save texture to " + imgpath;
+        if ( !err.empty())
+            boost::filesystem::remove( tpath, ec);
     }   // end if
-    
     return err;
 }   // end saveMaterialTexture
 
 
-// Set the mesh points, texture coords, and face (polygon) info.
-void setMaterial( aiMesh* mesh, const r3d::Mesh& model, int matId, IntSet& remfids)
+// Allocate the face array for the given mesh with all of the face vertex indices drawn from a single
+// contiguous block. The block is owned by the first face so that it is released by Assimp's own
+// destructors, but only after releaseFaceIndices has been called on the mesh (see below).
+uint* allocFaces( aiMesh* mesh, size_t nFaces)
+{
+    mesh->mNumFaces = uint(nFaces);
+    mesh->mFaces = new aiFace[mesh->mNumFaces];
+    uint* indices = nFaces > 0 ? new uint[3*nFaces] : nullptr;
+    for ( size_t i = 0; i < nFaces; ++i)
+    {
+        aiFace& face = mesh->mFaces[i];
+        face.mNumIndices = 3;
+        face.mIndices = &indices[3*i];
+    }   // end for
+    return indices;
+}   // end allocFaces
+
+
+// Every aiFace deletes its own index array on destruction, so detach all faces but the
+// first (which owns the contiguous block) before the mesh is deleted to avoid double frees.
+void releaseFaceIndices( aiMesh* mesh)
 {
+    for ( uint i = 1; i < mesh->mNumFaces; ++i)
+    {
+        mesh->mFaces[i].mIndices = nullptr;
+        mesh->mFaces[i].mNumIndices = 0;
+    }   // end for
+}   // end releaseFaceIndices
+
+
+// Copy the collected vertices (and texture coordinates if given) into the mesh.
+void setVertices( aiMesh* mesh, const std::vector<aiVector3D>& vtxs, const std::vector<aiVector3D>* uvs)
+{
+    mesh->mNumVertices = uint(vtxs.size());
+    mesh->mVertices = new aiVector3D[mesh->mNumVertices];
+    std::copy( vtxs.begin(), vtxs.end(), mesh->mVertices);
+    if ( uvs)
+    {
+        assert( uvs->size() == vtxs.size());
+        mesh->mNumUVComponents[0] = 2;
+        mesh->mTextureCoords[0] = new aiVector3D[mesh->mNumVertices];
+        std::copy( uvs->begin(), uvs->end(), mesh->mTextureCoords[0]);
+    }   // end if
+}   // end setVertices
+
+
+// Set the mesh points, texture coords, and face (polygon) info. Vertices are shared between
+// faces and are only duplicated where the same mesh vertex has different texture coordinates
+// across adjacent faces (i.e. along UV seams).
+void setMaterial( aiMesh* mesh, const r3d::Mesh& model, int matId)
+{
+    R3DIO_TRACE( "AssetExporter: setMaterial");
     const IntSet& fidSet = model.materialFaceIds( matId);
     // Face IDs are sorted into ascending order for consistency when writing
     std::vector<int> fids( fidSet.begin(), fidSet.end());
     std::sort( fids.begin(), fids.end());
 
     const size_t nFaces = fids.size();
-    mesh->mNumFaces = uint(nFaces);
-    mesh->mFaces = new aiFace[mesh->mNumFaces];
-    mesh->mNumVertices = 3 * mesh->mNumFaces;
-    mesh->mVertices = new aiVector3D[mesh->mNumVertices];
+    uint* indices = allocFaces( mesh, nFaces);
 
-    mesh->mNumUVComponents[0] = mesh->mNumVertices;
-    mesh->mTextureCoords[0] = new aiVector3D[mesh->mNumUVComponents[0]];
+    std::unordered_map<uint64_t, uint> vmap;    // (Mesh vertex ID, UV ID) --> AssImp vertex ID
+    vmap.reserve( nFaces);
+    std::vector<aiVector3D> vtxs;
+    std::vector<aiVector3D> uvs;
+    vtxs.reserve( nFaces);
+    uvs.reserve( nFaces);
 
-    uint j = 0; // AssImp vertex ID
     for ( size_t i = 0; i < nFaces; ++i)
     {
         const int fid = fids[i];
-        remfids.erase(fid);
         const int* uvids = model.faceUVs(fid);
-        const int* vtxs = model.fvidxs(fid);
+        const int* fvids = model.fvidxs(fid);
 
-        aiFace& face = mesh->mFaces[i];
-        face.mNumIndices = 3;
-        face.mIndices = new unsigned int[face.mNumIndices];
-
-        for ( size_t k = 0; k < face.mNumIndices; ++k)    // 3 vertices of triangle
+        for ( size_t k = 0; k < 3; ++k)    // 3 vertices of triangle
         {
-            const Vec3f& v = model.vtx(vtxs[k]);
-            aiVector3D& vertex = mesh->mVertices[j];
-            vertex[0] = v[0];   // x
-            vertex[1] = v[1];   // y
-            vertex[2] = v[2];   // z
-
-            const Vec2f& uv = model.uv( matId, uvids[k]);
-            aiVector3D& texture = mesh->mTextureCoords[0][j];
-            texture[0] = uv[0]; // u
-            texture[1] = uv[1]; // v
-            texture[2] = 0;     // not used
-
-            face.mIndices[k] = j++;
+            const uint64_t key = (uint64_t(uint(fvids[k])) << 32) | uint(uvids[k]);
+            auto it = vmap.find(key);
+            if ( it == vmap.end())
+            {
+                it = vmap.emplace( key, uint(vtxs.size())).first;
+                const Vec3f& v = model.vtx(fvids[k]);
+                vtxs.emplace_back( v[0], v[1], v[2]);
+                const Vec2f& uv = model.uv( matId, uvids[k]);
+                uvs.emplace_back( uv[0], uv[1], 0);    // Third component not used
+            }   // end if
+            indices[3*i + k] = it->second;
         }   // end for
     }   // end for
+
+    setVertices( mesh, vtxs, &uvs);
 }   // end setMaterial
 
 
@@ -169,38 +244,34 @@ void setNonMaterialMesh( aiMesh* mesh, const r3d::Mesh& model, const IntSet& rem
     std::vector<int> rfids( remfids.begin(), remfids.end());
     std::sort( rfids.begin(), rfids.end());
 
-    mesh->mNumFaces = uint(nFaces);
-    mesh->mFaces = new aiFace[mesh->mNumFaces];
-    mesh->mNumVertices = 3 * mesh->mNumFaces;
-    mesh->mVertices = new aiVector3D[mesh->mNumVertices];
+    uint* indices = allocFaces( mesh, nFaces);
 
-    mesh->mNumUVComponents[0] = 0;
-    mesh->mTextureCoords[0] = new aiVector3D[mesh->mNumUVComponents[0]];
+    std::unordered_map<int, uint> vmap;    // Mesh vertex ID --> AssImp vertex ID
+    vmap.reserve( nFaces);
+    std::vector<aiVector3D> vtxs;
+    vtxs.reserve( nFaces);
 
-    uint j = 0; // AssImp vertex ID
     for ( size_t i = 0; i < nFaces; ++i)
     {
         const int fid = rfids[i];
         assert( model.faceMaterialId( fid) == -1);  // Should be true since face not associated with Material.
         assert( model.faceUVs( fid) == nullptr);    // Should return null since not associated with a Material.
 
-        const int *vtxs = model.fvidxs(fid);
-
-        aiFace& face = mesh->mFaces[i];
-        face.mNumIndices = 3;
-        face.mIndices = new unsigned int[face.mNumIndices];
-
-        for ( size_t k = 0; k < face.mNumIndices; ++k)
+        const int *fvids = model.fvidxs(fid);
+        for ( size_t k = 0; k < 3; ++k)
         {
-            const Vec3f& v = model.vtx(vtxs[k]);
-            aiVector3D& vertex = mesh->mVertices[j];
-            vertex[0] = v[0];   // x
-            vertex[1] = v[1];   // y
-            vertex[2] = v[2];   // z
-
-            face.mIndices[k] = j++;
+            auto it = vmap.find( fvids[k]);
+            if ( it == vmap.end())
+            {
+                it = vmap.emplace( fvids[k], uint(vtxs.size())).first;
+                const Vec3f& v = model.vtx(fvids[k]);
+                vtxs.emplace_back( v[0], v[1], v[2]);
+            }   // end if
+            indices[3*i + k] = it->second;
         }   // end for
     }   // end for
+
+    setVertices( mesh, vtxs, nullptr);  // No texture coordinates
 }   // end setNonMaterialMesh
 
 
@@ -212,6 +283,32 @@ struct AiMesh
 };  // end struct
 
 
+// Build the meshes for the given materials concurrently. The materials partition the faces
+// so each mesh is independent and there's no shared state to write to. Meshes not yet started
+// when ctrl is stopped are left empty.
+void setMaterials( r3dio::Context &ctx, std::vector<AiMesh>& meshes, const r3d::Mesh& model, const std::vector<int>& matIds,
+                   const r3dio::IOControl &ctrl)
+{
+    ctx.parallelFor( matIds.size(), [&]( size_t i)
+    {
+        if ( !ctrl.stopped())
+            setMaterial( meshes[i]._mesh, model, matIds[i]);
+    });
+}   // end setMaterials
+
+
+// Passes on Assimp's progress through writing a file (if it reports it).
+class WriteProgress : public Assimp::ProgressHandler
+{
+public:
+    explicit WriteProgress( const std::function<bool( float)> &fn) : _fn(fn) {}
+    bool Update( float f) override { return _fn( std::max( f, 0.0f));}
+
+private:
+    const std::function<bool( float)> &_fn;
+};  // end class
+
+
 // Since the Assimp library in the version used here doesn't do model export well,
 // we have to guess the internals of the aiScene object and trust that we're not
 // doubly allocating memory here (which could result in leaks). Testing deleting
@@ -297,26 +394,53 @@ bool AssetExporter::enableFormat( const std::string& ext)
 // protected
 bool AssetExporter::doSave( const r3d::Mesh& mesh, const std::string& fname)
 {
-    IntSet remfids = mesh.faces();   // Copy out. Used to track parsing of all polygons.
-    std::vector<AiMesh> meshes;
-
-    // Set a mesh for each material (having texture coordinates associated with polygons).
-    const IntSet& matIds = mesh.materialIds();
-    for ( int matId : matIds)
+    const IntSet& matIdSet = mesh.materialIds();
+    const std::vector<int> matIds( matIdSet.begin(), matIdSet.end());
+    std::vector<AiMesh> meshes( matIds.size());
+
+    // Set the material properties and start saving the textures so that writing the
+    // images overlaps with setting the meshes. Only save each referenced image once.
+    std::unordered_set<std::string> imgpaths;
+    std::vector<std::future<std::string> > txSaves;
+    std::vector<double> txSecs( matIds.size(), 0.0);    // Time taken by each texture save task
+    const r3dio::Context::Ptr ctx = context();
+    const r3dio::MeshLayout *lay = presetLayout().get();
+    for ( size_t i = 0; i < matIds.size(); ++i)
     {
-        meshes.resize( meshes.size()+1);
-        AiMesh &aim = meshes.back();
-        setMaterial( aim._mesh, mesh, matId, remfids);
-        std::string txSaveErr = saveMaterialTexture( aim._mat, mesh, matId, fname);
-        if (!txSaveErr.empty())
+        const int matId = matIds[i];
+        const std::string imgpath = setMaterialProperties( meshes[i]._mat, mesh, matId, fname);
+        if ( !imgpath.empty() && imgpaths.insert(imgpath).second)
         {
-            setErr( "AssetExporter::write( " + fname + "): " + txSaveErr);
-            return false;
+            r3dio::Context &c = *ctx;  // Outlives the task since all are waited for below
+            double &secs = txSecs[i];
+            txSaves.push_back( ctx->submit( [&mesh, &c, &secs, lay, matId, imgpath]()
+            {
+                const r3dio::IOStats::Timer timer( secs);
+                // Encoding needs about as much again as the texture itself
+                const cv::Mat tx = mesh.texture(matId);
+                const r3dio::Context::MemoryReservation mem( c, tx.total() * tx.elemSize());
+                return saveMaterialTexture( mesh, matId, imgpath, lay);
+            }));
         }   // end if
-        //std::cout << "Saved textures for material " << matId << std::endl;
     }   // end for
 
+    // Set a mesh for each material (having texture coordinates associated with polygons).
+    r3dio::IOStats &st = editStats();
+    const r3dio::IOStats::Clock::time_point t0 = r3dio::IOStats::Clock::now();
+    bool going = progress( 0.1f, "Setting materials");
+    if ( going)
+        setMaterials( *ctx, meshes, mesh, matIds, control());
+
     // Polygons not attached to a material need to be included in the scene as a mesh without texture coordinates.
+    IntSet remfids;
+    going = going && progress( 0.5f, "Setting untextured faces");
+    if ( going)
+    {
+        for ( int fid : mesh.faces())
+            if ( mesh.faceMaterialId(fid) < 0)
+                remfids.insert(fid);
+    }   // end if
+
     if ( !remfids.empty())
     {
         //std::cout << "Creating non-material mesh" << std::endl;
@@ -327,20 +451,60 @@ bool AssetExporter::doSave( const r3d::Mesh& mesh, const std::string& fname)
 
     //std::cout << "Creating scene from " << meshes.size() << " meshes" << std::endl;
     aiScene* scene = createSceneFromMeshes( meshes);
+    st.convertSeconds += std::chrono::duration<double>( r3dio::IOStats::Clock::now() - t0).count();
+
+    std::string txSaveErr;
+    for ( std::future<std::string>& txSave : txSaves)
+    {
+        const std::string err = ctx->get( txSave);
+        if ( txSaveErr.empty())
+            txSaveErr = err;
+    }   // end for
+
+    for ( double secs : txSecs)
+        st.textureSeconds += secs;
+    for ( const std::string &imgpath : imgpaths)
+    {
+        boost::system::error_code ec;
+        const boost::uintmax_t nbytes = boost::filesystem::file_size( imgpath, ec);
+        st.bytesWritten += ec ? 0 : size_t(nbytes);
+        st.textures += ec ? 0 : 1;
+    }   // end for
 
     bool savedOkay = false;
-    std::string fext = getExtension(fname);
-    //std::cout << "Saving scene using Assimp::Exporter to " << fname << " with " << fext << " format" << std::endl;
-    Assimp::Exporter exporter;
-    if ( exporter.Export( scene, fext, fname) == AI_SUCCESS)
-        savedOkay = true;
-    else
-        setErr( "AssetExporter::write( " + fname + "): " + "Cannot save model! Assimp::Exporter error: " + exporter.GetErrorString());
+    going = going && progress( 0.7f, "Writing file");   // Error set if stopped
+    if ( going && !txSaveErr.empty())
+        setErr( "AssetExporter::write( " + fname + "): " + txSaveErr);
+    else if ( going)
+    {
+        std::string fext = getExtension(fname);
+        //std::cout << "Saving scene using Assimp::Exporter to " << fname << " with " << fext << " format" << std::endl;
+        const r3dio::IOControl &ctrl = control();
+        const std::function<bool( float)> writeFn = [&ctrl]( float f)
+        {
+            if ( ctrl.progress)
+                ctrl.progress( 0.7f + 0.3f * std::min( f, 1.0f), "Writing file");
+            return !ctrl.stopped();
+        };  // end writeFn
+        WriteProgress writeProgress( writeFn);
+        Assimp::Exporter exporter;
+        exporter.SetProgressHandler( &writeProgress);   // Not owned (reset below before it goes)
+        bool exported;
+        {
+            R3DIO_TRACE( "Assimp::Exporter::Export");
+            const r3dio::IOStats::Timer timer( st.writeSeconds);
+            exported = exporter.Export( scene, fext, fname) == AI_SUCCESS;
+        }
+        exporter.SetProgressHandler( nullptr);
+        if ( exported)
+            savedOkay = true;
+        else
+            setErr( "AssetExporter::write( " + fname + "): " + "Cannot save model! Assimp::Exporter error: " + exporter.GetErrorString());
+    }   // end else
 
     //std::cout << "Deleting scene, savedokay = " << std::boolalpha << savedOkay << std::endl;
+    for ( uint i = 0; i < scene->mNumMeshes; ++i)
+        releaseFaceIndices( scene->mMeshes[i]);
     delete scene;
     return savedOkay;
 }   // end doSave
-
-
-
@@ -16,13 +16,17 @@
  ************************************************************************/
 
 #include <AssetImporter.h>
+#include <Trace.h>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include <assimp/importerdesc.h>
+#include <assimp/ProgressHandler.hpp>
 #include <cassert>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/operations.hpp>
 #include <boost/regex.hpp>
@@ -37,7 +41,40 @@ namespace {
 
 using uint = unsigned int;
 
-bool loadImages( const BFS::path& ppath, const std::vector<std::string> &imgfls, std::vector<cv::Mat>& imgs)
+// Reports the fraction done and the current stage returning false if loading should stop.
+using ProgressFn = std::function<bool( float, const std::string&)>;
+
+// Fraction of the load taken by Assimp reading the file (the rest is creating the mesh).
+const float READ_FRACTION = 0.6f;
+
+
+// Passes on Assimp's progress through reading and post processing a file.
+class ReadProgress : public Assimp::ProgressHandler
+{
+public:
+    explicit ReadProgress( const ProgressFn &fn) : _fn(fn), _stage("Reading file") {}
+
+    bool Update( float f) override { return _fn( READ_FRACTION * std::max( f, 0.0f), _stage);}
+
+    void UpdateFileRead( int step, int nsteps) override
+    {
+        _stage = "Reading file";
+        Assimp::ProgressHandler::UpdateFileRead( step, nsteps);
+    }   // end UpdateFileRead
+
+    void UpdatePostProcess( int step, int nsteps) override
+    {
+        _stage = "Post processing";
+        Assimp::ProgressHandler::UpdatePostProcess( step, nsteps);
+    }   // end UpdatePostProcess
+
+private:
+    const ProgressFn &_fn;
+    std::string _stage;
+};  // end class
+
+
+bool loadImages( const BFS::path& ppath, const std::vector<std::string> &imgfls, std::vector<cv::Mat>& imgs, r3dio::IOStats &st)
 {
     for ( const std::string& imgfl : imgfls)
     {
@@ -50,7 +87,13 @@ bool loadImages( const BFS::path& ppath, const std::vector<std::string> &imgfls,
             break;
         }   // end if
         else
+        {
             imgs.push_back(m);
+            boost::system::error_code ec;
+            const boost::uintmax_t nbytes = BFS::file_size( imgPath, ec);
+            st.bytesRead += ec ? 0 : size_t(nbytes);
+            st.textures++;
+        }   // end else
     }   // end for
     return !imgs.empty();
 }   // end loadImages
@@ -70,21 +113,23 @@ struct MaterialTextures
 
     // Load the ambient, diffuse, and specular texture maps returning
     // the number of each type loaded. Returns -1 on error loading.
-    bool loadAmbient() { return loadImages( _ppath, _ambient, _amats);}
-    bool loadDiffuse() { return loadImages( _ppath, _diffuse, _dmats);}
-    bool loadSpecular() { return loadImages( _ppath, _specular, _smats);}
+    bool loadAmbient( r3dio::IOStats &st) { return loadImages( _ppath, _ambient, _amats, st);}
+    bool loadDiffuse( r3dio::IOStats &st) { return loadImages( _ppath, _diffuse, _dmats, st);}
+    bool loadSpecular( r3dio::IOStats &st) { return loadImages( _ppath, _specular, _smats, st);}
 
     // Returns true iff there are textures to load.
     bool hasTexture() const { return !_ambient.empty() || !_diffuse.empty() || !_specular.empty();}
 
-    cv::Mat load()
+    cv::Mat load( r3dio::IOStats &st)
     {
+        R3DIO_TRACE( "AssetImporter: load texture");
+        const r3dio::IOStats::Timer timer( st.textureSeconds);
         cv::Mat tx;
-        if ( loadDiffuse())
+        if ( loadDiffuse( st))
             tx = _dmats[0];
-        else if ( loadAmbient())
+        else if ( loadAmbient( st))
             tx = _amats[0];
-        else if ( loadSpecular())
+        else if ( loadSpecular( st))
             tx = _smats[0];
         return tx;
     }   // end load
@@ -115,17 +160,25 @@ private:
 };  // end struct
 
 
-size_t setObjectFaces( const aiMesh* mesh, std::vector<int>& fids, size_t& nonTriangles, Mesh::Ptr model)
+// Progress is reported through [f0,f1] of the whole. Returns false (with the faces only partially set)
+// if stopped by prog, otherwise dupFaces and degenFaces are set to the numbers of duplicate and
+// degenerate faces not added.
+bool setObjectFaces( const aiMesh* mesh, std::vector<int>& fids, size_t& nonTriangles, size_t& dupFaces,
+                     size_t& degenFaces, Mesh::Ptr model, const ProgressFn &prog, float f0, float f1)
 {
     IntSet faceSet;
     const uint nfaces = mesh->mNumFaces;
     fids.resize( nfaces);
 
-    size_t dupFaces = 0; // Count duplicate faces not added
+    dupFaces = 0; // Count duplicate faces not added
+    degenFaces = 0; // Count faces not added because their vertices aren't all different
     nonTriangles = 0; // Count number of faces that aren't triangles
     const aiFace* aifaces = mesh->mFaces;
     for ( uint i = 0; i < nfaces; ++i)
     {
+        if ( (i & 0xfff) == 0 && !prog( f0 + (f1-f0) * float(i) / nfaces, "Creating faces"))
+            return false;
+
         const aiFace& aiface = aifaces[i];
         if ( aiface.mNumIndices != 3)   // Not a triangle?
         {
@@ -138,13 +191,13 @@ size_t setObjectFaces( const aiMesh* mesh, std::vector<int>& fids, size_t& nonTr
         const aiVector3D& av1 = mesh->mVertices[aiface.mIndices[1]];
         const aiVector3D& av2 = mesh->mVertices[aiface.mIndices[2]];
 
-        // All three vertices must be unique to make a triangle, or it's not necessary (and is counted as a duplicate).
+        // All three vertices must be unique to make a triangle, or it's not necessary (and is counted as degenerate).
         // This shouldn't ever happen if AssImp is doing its job properly.
         if ( av0 == av1 || av1 == av2 || av2 == av0)
         {
             std::cerr << "[ERROR] r3dio::AssetImporter::setObjectFaces(): Triple of aiVector3D vertices are not all different!" << std::endl;
             fids[i] = -1;
-            dupFaces++;
+            degenFaces++;
             continue;
         }   // end if
 
@@ -158,6 +211,8 @@ size_t setObjectFaces( const aiMesh* mesh, std::vector<int>& fids, size_t& nonTr
             fids[i] = -1;
             if ( faceSet.count(fid))
                 dupFaces++;
+            else
+                degenFaces++;
         }   // end if
         else
         {
@@ -166,7 +221,7 @@ size_t setObjectFaces( const aiMesh* mesh, std::vector<int>& fids, size_t& nonTr
         }   // end else
     }   // end for
 
-    return dupFaces;
+    return true;
 }   // end setObjectFaces
 
 
@@ -191,8 +246,10 @@ void setObjectTextureCoordinates( const aiMesh* mesh, int matId, const std::vect
 }   // end setObjectTextureCoordinates
 
 
-Mesh::Ptr createMesh( Assimp::Importer* importer, const BFS::path& ppath, bool loadTextures, bool failOnNonTriangles)
+Mesh::Ptr createMesh( Assimp::Importer* importer, const BFS::path& ppath, bool loadTextures, bool failOnNonTriangles,
+                      const ProgressFn &prog, r3dio::IOStats &st)
 {
+    R3DIO_TRACE( "AssetImporter: createMesh");
     const aiScene* scene = importer->GetScene();
     const uint nmeshes = scene->mNumMeshes;
     //const uint nmaterials = scene->mNumMaterials;
@@ -207,12 +264,28 @@ Mesh::Ptr createMesh( Assimp::Importer* importer, const BFS::path& ppath, bool l
     {
         fidxs->clear();
         const aiMesh* mesh = scene->mMeshes[i];
+        const float f0 = READ_FRACTION + (1.0f - READ_FRACTION) * float(i) / nmeshes;
+        const float f1 = READ_FRACTION + (1.0f - READ_FRACTION) * float(i+1) / nmeshes;
 
         //std::cerr << "=====================[ MESH " << std::setw(2) << i << " ]=====================" << std::endl;
         if ( mesh->HasFaces() && mesh->HasPositions())
         {
             size_t nonTriangles = 0;
-            const size_t dupTriangles = setObjectFaces( mesh, *fidxs, nonTriangles, model);
+            size_t dupTriangles = 0;
+            size_t degenTriangles = 0;
+            bool facesSet;
+            {
+                const r3dio::IOStats::Timer timer( st.convertSeconds);
+                facesSet = setObjectFaces( mesh, *fidxs, nonTriangles, dupTriangles, degenTriangles, model, prog, f0, f1);
+            }
+            if ( !facesSet)
+            {
+                model = nullptr;
+                break;
+            }   // end if
+            st.nonTriangles += nonTriangles;
+            st.duplicateFaces += dupTriangles;
+            st.degenerateFaces += degenTriangles;
             if ( nonTriangles > 0)
             {
                 if ( failOnNonTriangles)
@@ -236,6 +309,12 @@ Mesh::Ptr createMesh( Assimp::Importer* importer, const BFS::path& ppath, bool l
                           << dupTriangles << " / " << mesh->mNumFaces << " duplicate facets." << std::endl;
             }   // end if
 
+            if ( degenTriangles > 0)
+            {
+                std::cerr << "[INFO] r3dio::AssetImporter::createMesh(): Ignored "
+                          << degenTriangles << " / " << mesh->mNumFaces << " degenerate facets." << std::endl;
+            }   // end if
+
             if ( !loadTextures)
                 continue;
 
@@ -243,13 +322,21 @@ Mesh::Ptr createMesh( Assimp::Importer* importer, const BFS::path& ppath, bool l
             // several meshes. Each mesh may or may not have texture coordinates.
             if ( mesh->HasTextureCoords(0))
             {
+                if ( !prog( f1, "Loading textures"))
+                {
+                    model = nullptr;
+                    break;
+                }   // end if
                 MaterialTextures mat( scene->mMaterials[mesh->mMaterialIndex], ppath);
                 if ( mat.hasTexture())
                 {
-                    cv::Mat tx = mat.load();
+                    cv::Mat tx = mat.load( st);
                     const int matId = model->addMaterial( tx);
                     if ( matId >= 0)
+                    {
+                        const r3dio::IOStats::Timer timer( st.convertSeconds);
                         setObjectTextureCoordinates( mesh, matId, *fidxs, model);
+                    }   // end if
                     else
                     {
                         std::cerr << "[WARNING] r3dio::AssetImporter::createMesh(): "
@@ -365,24 +452,42 @@ bool AssetImporter::enableFormat( const std::string& ext)
 
 Mesh::Ptr AssetImporter::doLoad( const std::string& fname)
 {
+    R3DIO_TRACE( "AssetImporter::doLoad");
     Assimp::Importer* importer = new Assimp::Importer;
     importer->SetPropertyInteger( AI_CONFIG_PP_SBP_REMOVE, aiPrimitiveType_POINT | aiPrimitiveType_LINE);
 
+    bool stopped = false;
+    const ProgressFn prog = [this, &stopped]( float f, const std::string &stage)
+    {
+        stopped = stopped || !progress( f, stage);
+        return !stopped;
+    };  // end prog
+    ReadProgress readProgress( prog);
+    importer->SetProgressHandler( &readProgress);   // Not owned (reset below before it goes)
+
     // Read the file into the common AssImp format.
-    importer->ReadFile( fname,// aiProcess_Triangulate |
-                             aiProcess_JoinIdenticalVertices |
-                             aiProcess_RemoveRedundantMaterials
-                             //aiProcess_FindDegenerates |
-                             //aiProcess_FindInvalidData |
-                             //aiProcess_OptimizeMeshes |
-                             // aiProcess_SortByPType |
-                             // aiProcess_OptimizeGraph |
-                             // aiProcess_FixInfacingNormals |
-                             // aiProcess_FindInstances
-                             );
+    IOStats &st = editStats();
+    {
+        R3DIO_TRACE( "Assimp::Importer::ReadFile");
+        const IOStats::Timer timer( st.parseSeconds);
+        importer->ReadFile( fname,// aiProcess_Triangulate |
+                                 aiProcess_JoinIdenticalVertices |
+                                 aiProcess_RemoveRedundantMaterials
+                                 //aiProcess_FindDegenerates |
+                                 //aiProcess_FindInvalidData |
+                                 //aiProcess_OptimizeMeshes |
+                                 // aiProcess_SortByPType |
+                                 // aiProcess_OptimizeGraph |
+                                 // aiProcess_FixInfacingNormals |
+                                 // aiProcess_FindInstances
+                                 );
+    }
+    importer->SetProgressHandler( nullptr);
 
     Mesh::Ptr mesh = nullptr;
-    if ( !importer->GetScene())
+    if ( stopped || !prog( READ_FRACTION, "Creating mesh"))
+        importer->FreeScene();  // Error already set
+    else if ( !importer->GetScene())
     {
         std::cerr << "[WARNING] r3dio::AssetImporter::doLoad: FAILED: " << importer->GetErrorString() << std::endl;
         setErr( "Unable to read 3D scene into importer from " + fname);
@@ -392,8 +497,10 @@ Mesh::Ptr AssetImporter::doLoad( const std::string& fname)
 #ifndef NDEBUG
         std::cerr << "Creating mesh " << fname << "...\n";
 #endif
-        mesh = createMesh( importer, BFS::path( fname).parent_path(), _loadTextures, _failOnNonTriangles);
-        if (mesh == nullptr)
+        mesh = createMesh( importer, BFS::path( fname).parent_path(), _loadTextures, _failOnNonTriangles, prog, st);
+        if ( stopped)
+            mesh = nullptr; // Error already set
+        else if (mesh == nullptr)
         {
             std::cerr << "[WARNING] r3dio::AssetImporter::doLoad: Unable to import mesh!" << std::endl;
             setErr( "Unable to translate imported mesh into standard format!");
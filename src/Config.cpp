@@ -0,0 +1,103 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <Config.h>
+#include <boost/filesystem/operations.hpp>
+#include <boost/process/search_path.hpp>
+using r3dio::Config;
+namespace BFS = boost::filesystem;
+
+namespace {
+
+std::mutex s_mutex;     // Guards s_current
+Config::Ptr s_current;
+
+// Returns the full path of the given program or an empty string if not found.
+std::string resolve( const std::string &prog)
+{
+    boost::system::error_code ec;
+    if ( BFS::exists( prog, ec))
+        return prog;
+    return boost::process::search_path( prog).string();
+}   // end resolve
+
+}   // end namespace
+
+
+// public static
+Config::Ptr Config::current()
+{
+    std::lock_guard<std::mutex> lock( s_mutex);
+    if ( !s_current)
+        s_current = std::make_shared<const Config>();
+    return s_current;
+}   // end current
+
+
+// public static
+void Config::setCurrent( const Ptr &cfg)
+{
+    std::lock_guard<std::mutex> lock( s_mutex);
+    s_current = cfg ? cfg : std::make_shared<const Config>();
+}   // end setCurrent
+
+
+// public static
+void Config::update( const std::function<void( Config&)> &fn)
+{
+    std::lock_guard<std::mutex> lock( s_mutex);
+    std::shared_ptr<Config> cfg = s_current ? std::make_shared<Config>( *s_current) : std::make_shared<Config>();
+    fn( *cfg);
+    s_current = cfg;
+}   // end update
+
+
+Config::Config() : _pdflatex( "pdflatex"), _idtfConverter( "IDTFConverter"), _imgDPI(0) {}
+
+
+// Only the settings are copied (programs are resolved again by the copy).
+Config::Config( const Config &c)
+    : _pdflatex( c._pdflatex), _idtfConverter( c._idtfConverter),
+      _u3dCacheDir( c._u3dCacheDir), _fmtCacheDir( c._fmtCacheDir),
+      _layerCacheDir( c._layerCacheDir), _imgCacheDir( c._imgCacheDir), _imgDPI( c._imgDPI)
+{}   // end ctor
+
+
+void Config::setPDFLatex( const std::string &p)
+{
+    _pdflatex = p.empty() ? Config()._pdflatex : BFS::path(p).string();  // Ensure conversion to path
+}   // end setPDFLatex
+
+
+void Config::setIDTFConverter( const std::string &p)
+{
+    _idtfConverter = p.empty() ? Config()._idtfConverter : BFS::path(p).string();
+}   // end setIDTFConverter
+
+
+const std::string &Config::resolvedPDFLatex() const
+{
+    std::call_once( _pdflatexOnce, [this](){ _rpdflatex = resolve( _pdflatex);});
+    return _rpdflatex;
+}   // end resolvedPDFLatex
+
+
+const std::string &Config::resolvedIDTFConverter() const
+{
+    std::call_once( _idtfOnce, [this](){ _ridtf = resolve( _idtfConverter);});
+    return _ridtf;
+}   // end resolvedIDTFConverter
@@ -0,0 +1,329 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <Context.h>
+#include <ScratchSpace.h>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+using r3dio::Context;
+namespace BFS = boost::filesystem;
+
+namespace {
+using Task = std::function<void()>;
+
+thread_local const void *s_pool = nullptr;  // Pool of the current worker thread (if any)
+thread_local size_t s_index = 0;            // Index of the current worker thread in its pool
+thread_local size_t s_reserved = 0;         // Number of MemoryReservations held by the current thread
+}   // end namespace
+
+
+// Each worker has its own queue which it pushes to and pops from the back of. Idle workers
+// steal from the front of the other queues. Tasks pushed from outside the pool go into an
+// extra (injection) queue at the end which all workers take from.
+struct Context::Pool
+{
+    explicit Pool( size_t n) : _queued(0), _quit(false)
+    {
+        for ( size_t i = 0; i <= n; ++i)
+            _queues.emplace_back( new Queue);
+        for ( size_t i = 0; i < n; ++i)
+            _threads.emplace_back( &Pool::_run, this, i);
+    }   // end ctor
+
+    ~Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock( _sleepMutex);
+            _quit = true;
+        }
+        _cv.notify_all();
+        for ( std::thread &t : _threads)
+            t.join();
+    }   // end dtor
+
+    size_t size() const { return _threads.size();}
+
+    // Index of the queue the calling thread should use.
+    size_t queueIndex() const { return s_pool == this ? s_index : _threads.size();}
+
+    void push( Task &&t)
+    {
+        Queue &q = *_queues[queueIndex()];
+        {
+            std::lock_guard<std::mutex> lock( q.mutex);
+            q.tasks.push_back( std::move(t));
+        }
+        {
+            std::lock_guard<std::mutex> lock( _sleepMutex);
+            _queued++;
+        }
+        _cv.notify_one();
+    }   // end push
+
+    // Run one queued task (preferring queue i) returning false if there were none.
+    bool runOne( size_t i)
+    {
+        Task t;
+        if ( !_take( i, t))
+            return false;
+        t();
+        return true;
+    }   // end runOne
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };  // end struct
+
+    std::vector<std::unique_ptr<Queue> > _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _sleepMutex;
+    std::condition_variable _cv;
+    size_t _queued;     // Total across all queues
+    bool _quit;
+
+    bool _take( size_t i, Task &t)
+    {
+        const size_t n = _queues.size();
+        bool found = false;
+        if ( i < n-1)   // Own queue newest first (likely still in cache)
+        {
+            Queue &q = *_queues[i];
+            std::lock_guard<std::mutex> lock( q.mutex);
+            if ( !q.tasks.empty())
+            {
+                t = std::move( q.tasks.back());
+                q.tasks.pop_back();
+                found = true;
+            }   // end if
+        }   // end if
+
+        for ( size_t k = 1; !found && k <= n; ++k)   // Steal oldest first from the others
+        {
+            Queue &q = *_queues[(i + k) % n];
+            std::lock_guard<std::mutex> lock( q.mutex);
+            if ( !q.tasks.empty())
+            {
+                t = std::move( q.tasks.front());
+                q.tasks.pop_front();
+                found = true;
+            }   // end if
+        }   // end for
+
+        if ( found)
+        {
+            std::lock_guard<std::mutex> lock( _sleepMutex);
+            _queued--;
+        }   // end if
+        return found;
+    }   // end _take
+
+    void _run( size_t i)
+    {
+        s_pool = this;
+        s_index = i;
+        while ( true)
+        {
+            if ( runOne( i))
+                continue;
+            std::unique_lock<std::mutex> lock( _sleepMutex);
+            _cv.wait( lock, [this](){ return _quit || _queued > 0;});
+            if ( _quit && _queued == 0)
+                break;  // Only quit once all queued tasks are done
+        }   // end while
+    }   // end _run
+};  // end struct
+
+
+// public static
+Context::Ptr Context::create( int nthreads, size_t memBytes, const std::string &scratchDir)
+{
+    return Ptr( new Context( nthreads, memBytes, scratchDir));
+}   // end create
+
+
+// public static
+Context::Ptr Context::global()
+{
+    static const Ptr ctx = create();
+    return ctx;
+}   // end global
+
+
+// private
+Context::Context( int nthreads, size_t memBytes, const std::string &scratchDir)
+    : _pool(nullptr), _memBudget( memBytes), _memUsed(0), _scratchDir( scratchDir)
+{
+    if ( nthreads <= 0)
+        nthreads = int( std::max( 1u, std::thread::hardware_concurrency()));
+    _pool = new Pool( size_t(nthreads));
+}   // end ctor
+
+
+Context::~Context() { delete _pool;}
+
+
+size_t Context::threads() const { return _pool->size();}
+
+
+// private
+void Context::_push( std::function<void()> &&t) { _pool->push( std::move(t));}
+
+
+// private
+bool Context::_runOne()
+{
+    // A thread holding a reservation mustn't run other tasks since they may block acquiring
+    // memory that can't be released until the task (on this thread's stack) returns.
+    return s_reserved == 0 && _pool->runOne( _pool->queueIndex());
+}   // end _runOne
+
+
+void Context::parallelFor( size_t n, const std::function<void( size_t)> &fn, size_t maxTasks)
+{
+    if ( n == 0)
+        return;
+    const size_t ntasks = std::min( n, std::max<size_t>( 1, maxTasks == 0 ? _pool->size() : maxTasks));
+
+    struct State
+    {
+        std::atomic<size_t> next;
+        size_t running;     // Tasks currently taking or running indices
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::exception_ptr err;
+    };  // end struct
+    const std::shared_ptr<State> st = std::make_shared<State>();
+    st->next = 0;
+    st->running = 0;
+
+    // Tasks that only start once every index has been taken do nothing, so only tasks that
+    // are running need waiting for and the caller never depends on queued tasks starting
+    // (which they may not if the workers are all blocked e.g. acquiring memory).
+    const auto work = [st, n, &fn]()
+    {
+        {
+            std::lock_guard<std::mutex> lock( st->mutex);
+            st->running++;
+        }
+        try
+        {
+            for ( size_t i = st->next++; i < n; i = st->next++)
+                fn(i);
+        }   // end try
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock( st->mutex);
+            if ( !st->err)
+                st->err = std::current_exception();
+            st->next = n;   // Stop the other tasks early
+        }   // end catch
+        std::lock_guard<std::mutex> lock( st->mutex);
+        if ( --st->running == 0)
+            st->cv.notify_all();
+    };  // end work
+
+    for ( size_t i = 1; i < ntasks; ++i)
+        _pool->push( work);
+    work();     // Returns once every index has been taken
+
+    // Help out with queued tasks until the running ones are done (unless holding a reservation).
+    while ( true)
+    {
+        {
+            std::lock_guard<std::mutex> lock( st->mutex);
+            if ( st->running == 0)
+                break;
+        }
+        if ( !_runOne())
+        {
+            std::unique_lock<std::mutex> lock( st->mutex);
+            st->cv.wait_for( lock, std::chrono::milliseconds(1), [&](){ return st->running == 0;});
+        }   // end if
+    }   // end while
+
+    if ( st->err)
+        std::rethrow_exception( st->err);
+}   // end parallelFor
+
+
+size_t Context::memoryUsed() const
+{
+    std::lock_guard<std::mutex> lock( _memMutex);
+    return _memUsed;
+}   // end memoryUsed
+
+
+void Context::acquireMemory( size_t bytes)
+{
+    std::unique_lock<std::mutex> lock( _memMutex);
+    if ( _memBudget > 0)
+    {
+        bytes = std::min( bytes, _memBudget);
+        _memCV.wait( lock, [&](){ return _memUsed + bytes <= _memBudget;});
+    }   // end if
+    _memUsed += bytes;
+}   // end acquireMemory
+
+
+void Context::releaseMemory( size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock( _memMutex);
+        if ( _memBudget > 0)
+            bytes = std::min( bytes, _memBudget);
+        _memUsed -= std::min( bytes, _memUsed);
+    }
+    _memCV.notify_all();
+}   // end releaseMemory
+
+
+Context::MemoryReservation::MemoryReservation( Context &ctx, size_t bytes) : _ctx(ctx), _bytes(bytes)
+{
+    _ctx.acquireMemory( _bytes);
+    s_reserved++;
+}   // end ctor
+
+
+Context::MemoryReservation::~MemoryReservation()
+{
+    s_reserved--;
+    _ctx.releaseMemory( _bytes);
+}   // end dtor
+
+
+std::string Context::makeScratchDirectory() const
+{
+    if ( _scratchDir.empty())
+        return ScratchSpace::makeDirectory();
+
+    const BFS::path dir = BFS::path( _scratchDir) / BFS::unique_path( "r3dio-%%%%-%%%%-%%%%-%%%%");
+    boost::system::error_code ec;
+    if ( !BFS::create_directories( dir, ec))
+    {
+        std::cerr << "[ERROR] r3dio::Context::makeScratchDirectory: Unable to create '" << dir.string() << "'!" << std::endl;
+        return "";
+    }   // end if
+    return dir.string();
+}   // end makeScratchDirectory
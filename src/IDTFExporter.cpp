@@ -16,14 +16,19 @@
  ************************************************************************/
 
 #include <IDTFExporter.h>
+#include <Trace.h>
+#include <ScratchSpace.h>
 #include <TGAImage.h>
+#include <U3DWriter.h>   // scaleTexture
+#include <algorithm>
 #include <cassert>
 #include <iostream>
-#include <iomanip>
-#include <fstream>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
 #include <boost/filesystem/operations.hpp>
 using r3dio::IDTFExporter;
+using r3dio::ScratchSpace;
 using r3d::Mesh;
 using r3d::Vec3f;
 using r3d::Vec2f;
@@ -32,7 +37,7 @@ using rimg::Colour;
 
 // public
 IDTFExporter::IDTFExporter( bool delOnDtor, bool m9, const Colour &ems)
-    : r3dio::MeshExporter(), _delOnDtor(delOnDtor), _media9(m9), _ems(ems)
+    : r3dio::MeshExporter(), _delOnDtor(delOnDtor), _media9(m9), _ems(ems), _writeNormals(true), _txScale(1)
 {
     addSupported( "idtf", "Intermediate Data Text Format");
 }   // end ctor
@@ -42,22 +47,15 @@ IDTFExporter::IDTFExporter( bool delOnDtor, bool m9, const Colour &ems)
 IDTFExporter::~IDTFExporter() { _reset();}
 
 
-// Remove saved files.
+// Remove saved files (in the background).
 void IDTFExporter::_reset()
 {
     if ( _delOnDtor)
     {
-        using namespace boost::filesystem;
-        path ffile( _idtffile);
-        if ( exists( ffile) && is_regular_file( ffile))
-            remove( ffile);
-
+        if ( !_idtffile.empty())
+            ScratchSpace::remove( _idtffile);
         for ( const std::string& tgafile : _tgafiles)
-        {
-            path ifile( tgafile);
-            if ( exists( ifile) && is_regular_file(ifile))
-                remove( ifile);
-        }   // end for
+            ScratchSpace::remove( tgafile);
     }   // end _delOnDtor
 
     _idtffile = "";
@@ -67,6 +65,77 @@ void IDTFExporter::_reset()
 
 namespace {
 
+// Formats the IDTF text into a large buffer which is only written to file when full (or on
+// an explicit flush) so the file isn't flushed every line and the streams machinery is avoided.
+class Writer
+{
+public:
+    explicit Writer( FILE *f) : _f(f), _ok( f != nullptr) { _buf.reserve( CAPACITY);}
+
+    Writer& operator<<( const char *s) { return _put( s, std::strlen(s));}
+    Writer& operator<<( const std::string &s) { return _put( s.data(), s.size());}
+    Writer& operator<<( char c) { _buf.push_back(c); return _check();}
+    Writer& operator<<( int v) { return v < 0 ? (*this << '-') << (unsigned long long)(-(long long)v) : *this << (unsigned long long)(v);}
+    Writer& operator<<( unsigned v) { return *this << (unsigned long long)(v);}
+    Writer& operator<<( unsigned long v) { return *this << (unsigned long long)(v);}
+
+    Writer& operator<<( unsigned long long v)
+    {
+        char b[24];
+        char *e = b + sizeof(b);
+        char *p = e;
+        do { *--p = char('0' + v % 10); v /= 10; } while ( v > 0);
+        return _put( p, size_t(e - p));
+    }   // end operator<<
+
+    // Same formatting as a default std::ostream (six significant figures).
+    Writer& operator<<( double v)
+    {
+        char b[32];
+        const int n = std::snprintf( b, sizeof(b), "%g", v);
+        return _put( b, size_t(n));
+    }   // end operator<<
+
+    Writer& operator<<( float v) { return *this << double(v);}
+
+    // Same formatting as a std::ostream with std::fixed set (six decimal places).
+    Writer& fixed( double v)
+    {
+        char b[48];
+        const int n = std::snprintf( b, sizeof(b), "%f", v);
+        return _put( b, size_t(n));
+    }   // end fixed
+
+    // Write the buffered text to the file returning true iff all writes so far succeeded.
+    bool flush()
+    {
+        if ( _ok && !_buf.empty())
+            _ok = std::fwrite( _buf.data(), 1, _buf.size(), _f) == _buf.size();
+        _buf.clear();
+        return _ok;
+    }   // end flush
+
+private:
+    static const size_t CAPACITY = 1 << 22;
+    FILE *_f;
+    bool _ok;
+    std::string _buf;
+
+    Writer& _put( const char *s, size_t n)
+    {
+        _buf.append( s, n);
+        return _check();
+    }   // end _put
+
+    Writer& _check()
+    {
+        if ( _buf.size() >= CAPACITY)
+            flush();
+        return *this;
+    }   // end _check
+};  // end class
+
+
 struct TB {
     TB(int ntabs=0) : n(ntabs) {}
     int n;
@@ -77,22 +146,21 @@ struct NL {
     int n;
 };  // end struct
 
-std::ostream& operator<<( std::ostream& os, const TB& t)
+Writer& operator<<( Writer& os, const TB& t)
 {
-    for ( int i = 0; i < t.n; ++i)
-        os << "\t";
-    return os;
+    static const std::string TABS( 16, '\t');
+    return os << TABS.substr( 0, size_t(t.n));
 }   // end operator<<
 
-std::ostream& operator<<( std::ostream& os, const NL& nl)
+Writer& operator<<( Writer& os, const NL& nl)
 {
     for ( int i = 0; i < nl.n; ++i)
-        os << std::endl;
+        os << '\n';
     return os;
 }   // end operator<<
 
 
-void nodeGroup( std::ostream& os)
+void nodeGroup( Writer& os)
 {
     TB t(1), tt(2), ttt(3), tttt(4);
     NL n(1);
@@ -114,7 +182,7 @@ void nodeGroup( std::ostream& os)
 }   // end nodeGroup
 
 
-void nodeModel( std::ostream& os)
+void nodeModel( Writer& os)
 {
     TB t(1), tt(2), ttt(3), tttt(4);
     NL n(1);
@@ -137,7 +205,7 @@ void nodeModel( std::ostream& os)
 }   // end nodeModel
 
 /*
-void nodeLight( std::ostream& os, int lightID, const Vec3f& pos=Vec3f(0,0,0))
+void nodeLight( Writer& os, int lightID, const Vec3f& pos=Vec3f(0,0,0))
 {
     TB t(1), tt(2), ttt(3), tttt(4);
     NL n(1);
@@ -160,7 +228,7 @@ void nodeLight( std::ostream& os, int lightID, const Vec3f& pos=Vec3f(0,0,0))
 }   // end nodeLight
 
 
-void resourceLight( std::ostream& os, int lightID)
+void resourceLight( Writer& os, int lightID)
 {
     TB t(1), tt(2), ttt(3), tttt(4);
     NL n(1);
@@ -178,51 +246,61 @@ void resourceLight( std::ostream& os, int lightID)
 */
 
 
-void resourceListShader( std::ostream& os, bool hasTX)
+// One shader per shading. The first nTX shaders each have a texture (Shader k uses Texture k)
+// and the remaining shaders (if any) are untextured.
+void resourceListShader( Writer& os, size_t nShaders, size_t nTX)
 {
     TB t(1), tt(2), ttt(3), tttt(4);
     NL n(1);
     os << "RESOURCE_LIST \"SHADER\" {" << n;
-    os << t << "RESOURCE_COUNT 1" << n;
-    os << t << "RESOURCE 0 {" << n;
-    os << tt << "RESOURCE_NAME \"Shader0\"" << n;
-    os << tt << "SHADER_MATERIAL_NAME \"Material0\"" << n;  // All shaders reference same material
-    os << tt << "SHADER_ACTIVE_TEXTURE_COUNT " << ( hasTX ? 1 : 0) << n;
-    if ( hasTX)
+    os << t << "RESOURCE_COUNT " << nShaders << n;
+    for ( size_t i = 0; i < nShaders; ++i)
     {
-        os << tt << "SHADER_TEXTURE_LAYER_LIST {" << n;
-        os << ttt << "TEXTURE_LAYER 0 {" << n;
-        os << tttt << "TEXTURE_NAME \"Texture0\"" << n;
-        os << ttt << "}" << n;  // end TEXTURE_LAYER 0
-        os << tt << "}" << n;  // end SHADER_TEXTURE_LAYER_LIST
-    }   // end if
-    os << t << "}" << n;  // end RESOURCE
+        const bool hasTX = i < nTX;
+        os << t << "RESOURCE " << i << " {" << n;
+        os << tt << "RESOURCE_NAME \"Shader" << i << "\"" << n;
+        os << tt << "SHADER_MATERIAL_NAME \"Material0\"" << n;  // All shaders reference same material
+        os << tt << "SHADER_ACTIVE_TEXTURE_COUNT " << ( hasTX ? 1 : 0) << n;
+        if ( hasTX)
+        {
+            os << tt << "SHADER_TEXTURE_LAYER_LIST {" << n;
+            os << ttt << "TEXTURE_LAYER 0 {" << n;
+            os << tttt << "TEXTURE_NAME \"Texture" << i << "\"" << n;
+            os << ttt << "}" << n;  // end TEXTURE_LAYER 0
+            os << tt << "}" << n;  // end SHADER_TEXTURE_LAYER_LIST
+        }   // end if
+        os << t << "}" << n;  // end RESOURCE
+    }   // end for
     os << "}" << n << n; // end RESOURCE_LIST "SHADER"
 }   // end resourceListShader
 
 
-void modifierShading( std::ostream& os)
+// Shading k of the mesh uses shader k.
+void modifierShading( Writer& os, size_t nShaders)
 {
     TB t(1), tt(2), ttt(3), tttt(4), ttttt(5);
     NL n(1);
     os << "MODIFIER \"SHADING\" {" << n;
     os << t << "MODIFIER_NAME \"Mesh0\"" << n;
     os << t << "PARAMETERS {" << n;
-    os << tt << "SHADER_LIST_COUNT 1" << n;
+    os << tt << "SHADER_LIST_COUNT " << nShaders << n;
     os << tt << "SHADING_GROUP {" << n;
-    os << ttt << "SHADER_LIST 0 {" << n;
-    os << tttt << "SHADER_COUNT 1" << n;
-    os << tttt << "SHADER_NAME_LIST {" << n;
-    os << ttttt << "SHADER 0 NAME: \"Shader0\"" << n;
-    os << tttt << "}" << n; // end SHADER_NAME_LIST
-    os << ttt << "}" << n; // end SHADER_LIST
+    for ( size_t i = 0; i < nShaders; ++i)
+    {
+        os << ttt << "SHADER_LIST " << i << " {" << n;
+        os << tttt << "SHADER_COUNT 1" << n;
+        os << tttt << "SHADER_NAME_LIST {" << n;
+        os << ttttt << "SHADER 0 NAME: \"Shader" << i << "\"" << n;
+        os << tttt << "}" << n; // end SHADER_NAME_LIST
+        os << ttt << "}" << n; // end SHADER_LIST
+    }   // end for
     os << tt << "}" << n; // end SHADING_GROUP
     os << t << "}" << n; // end PARAMETERS
     os << "}" << n; // end MODIFIER "SHADING"
 }   // end modifierShading
 
 
-void resourceListMaterial( std::ostream& os, const Colour &ems)
+void resourceListMaterial( Writer& os, const Colour &ems)
 {
     TB t(1), tt(2);
     NL n(1);
@@ -241,52 +319,67 @@ void resourceListMaterial( std::ostream& os, const Colour &ems)
 }   // end resourceListMaterial
 
 
-void resourceListTexture( std::ostream& os, const std::string& tgafname)
+void resourceListTexture( Writer& os, const std::vector<std::string>& tgafnames)
 {
     TB t(1), tt(2);
     NL n(1);
     os << "RESOURCE_LIST \"TEXTURE\" {" << n;
-	os << t << "RESOURCE_COUNT 1" << n;
-    os << t << "RESOURCE 0 {" << n;
-    os << tt << "RESOURCE_NAME \"Texture0\"" << n;
-    os << tt << "TEXTURE_PATH \"" << tgafname << "\"" << n;
-    os << t << "}" << n;    // end RESOURCE
-	os << "}" << n << n; // end RESOURCE_LIST "TEXTURE"
+    os << t << "RESOURCE_COUNT " << tgafnames.size() << n;
+    for ( size_t i = 0; i < tgafnames.size(); ++i)
+    {
+        os << t << "RESOURCE " << i << " {" << n;
+        os << tt << "RESOURCE_NAME \"Texture" << i << "\"" << n;
+        os << tt << "TEXTURE_PATH \"" << tgafnames[i] << "\"" << n;
+        os << t << "}" << n;    // end RESOURCE
+    }   // end for
+    os << "}" << n << n; // end RESOURCE_LIST "TEXTURE"
 }   // end resourceListTexture
 
 
+// There is one shading per material (in ascending order of material ID) followed by an
+// untextured shading for the faces not associated with any material (if there are any).
 struct ModelResource
 {
-    ModelResource( const Mesh &mesh, bool media9) : _mesh(mesh), _media9(media9)
+    ModelResource( const Mesh &mesh, bool media9, bool writeNormals)
+        : _mesh(mesh), _media9(media9), _writeNormals(writeNormals), _untextured(false)
     {
-        const int matID = mesh.hasMaterials() ? *mesh.materialIds().begin() : -1;
-        // Get repeatable sequence of face IDs and the unique set of texture coords for the material
-        const IntSet* fids;
-        if ( matID < 0)
-            fids = &mesh.faces();
-        else
-            fids = &mesh.materialFaceIds(matID);
+        // Get repeatable sequence of face IDs and the unique set of texture coords over all materials
+        const IntSet& mids = mesh.materialIds();
+        _matIds.assign( mids.begin(), mids.end());
+        std::sort( _matIds.begin(), _matIds.end());
+        for ( size_t s = 0; s < _matIds.size(); ++s)
+        {
+            const IntSet& mfids = mesh.materialFaceIds( _matIds[s]);
+            if ( mfids.empty())
+                std::cerr << "[ERROR] r3dio::ModelResource: no facets found for material " << _matIds[s] << std::endl;
+            _addFaces( std::vector<int>( mfids.begin(), mfids.end()), int(s));
+        }   // end for
 
-        if ( fids->empty())
-            std::cerr << "[ERROR] r3dio::ModelResource: no facets found for material " << matID << std::endl;
+        std::vector<int> rfids;
+        for ( int fid : mesh.faces())
+            if ( mesh.faceMaterialId(fid) < 0)
+                rfids.push_back(fid);
+        if ( !rfids.empty())
+        {
+            _untextured = true;
+            _addFaces( std::move(rfids), int(_matIds.size()));
+        }   // end if
 
-        _fidv.resize( fids->size());
-        int k = 0;
         int vid;
-        for ( int fid : *fids)
+        for ( int fid : _fidv)
         {
-            _fidv[k++] = fid;
-            if ( mesh.faceMaterialId(fid) >= 0)
+            const int matID = mesh.faceMaterialId(fid);
+            if ( matID >= 0)
             {
                 const int* uvids = mesh.faceUVs(fid);
                 for ( int i = 0; i < 3; ++i)
                 {
                     // Only want to store unique UV offsets.
-                    const int key = uvids[i];
+                    const int64_t key = _uvKey( matID, uvids[i]);
                     if ( _uvmap.count(key) == 0)
                     {
                         _uvmap[key] = (int)_uvlist.size();  // Map the array index
-                        _uvlist.push_back( &mesh.uv( matID, key));
+                        _uvlist.push_back( &mesh.uv( matID, uvids[i]));
                     }   // end if
                 }   // end for
             }   // end if
@@ -304,18 +397,26 @@ struct ModelResource
         }   // end for
     }   // end ctor
 
-    void writeMesh( std::ostream& os) const
+    // Material IDs in order of the textured shadings.
+    const std::vector<int>& materialIds() const { return _matIds;}
+
+    // The number of shadings (and shaders).
+    size_t numShadings() const { return _matIds.size() + (_untextured ? 1 : 0);}
+
+    void writeMesh( Writer& os) const
     {
         _writeHeader(os);
         _writeShadingDescriptionList(os);
         _writeFacePositionList(os);
-        _writeFaceNormalList(os);
+        if ( _writeNormals)
+            _writeFaceNormalList(os);
         _writeFaceShadingList(os);
-        const bool hasTX = _mesh.numMats() > 0;
+        const bool hasTX = !_matIds.empty();
         if ( hasTX)
             _writeFaceTextureCoordList(os);
         _writePositionList(os);
-        _writeNormalList(os);
+        if ( _writeNormals)
+            _writeNormalList(os);
         if ( hasTX)
             _writeTextureCoordList(os);
     }   // end writeMesh
@@ -323,44 +424,60 @@ struct ModelResource
 private:
     const Mesh &_mesh;
     const bool _media9;
-    std::vector<int> _fidv;          // Predictable seq. of face IDs
-    std::vector<int> _vidv;          // Predictable seq. of vertex IDs
+    const bool _writeNormals;
+    bool _untextured;                   // True iff there's a final untextured shading
+    std::vector<int> _matIds;           // Material ID of each textured shading
+    std::vector<int> _fidv;             // Predictable seq. of face IDs (ordered by shading)
+    std::vector<int> _shdv;             // Shading ID of each face in _fidv
+    std::vector<int> _vidv;             // Predictable seq. of vertex IDs
     std::unordered_map<int,int> _vmap;    // Mesh vertexID --> MODEL_POSITION_LIST index
-    std::unordered_map<int, int> _uvmap;  // Mesh uvID --> _uvlist index
+    std::unordered_map<int64_t, int> _uvmap;  // Material and uvID key --> _uvlist index
     std::vector<const Vec2f*> _uvlist;  // List of texture UVs to output in MODEL_TEXTURE_COORD_LIST
 
+    static int64_t _uvKey( int matID, int uvID) { return (int64_t(matID) << 32) | uint32_t(uvID);}
 
-    void _writeHeader( std::ostream& os) const
+    void _addFaces( std::vector<int>&& fids, int shadingID)
+    {
+        std::sort( fids.begin(), fids.end());
+        _fidv.insert( _fidv.end(), fids.begin(), fids.end());
+        _shdv.resize( _fidv.size(), shadingID);
+    }   // end _addFaces
+
+
+    void _writeHeader( Writer& os) const
     {
         TB ttt(3);
         NL n(1);
         os << ttt << "FACE_COUNT " << _fidv.size() << n;
         os << ttt << "MODEL_POSITION_COUNT " << _vidv.size() << n;
-        os << ttt << "MODEL_NORMAL_COUNT " << (_fidv.size() * 3) << n;
+        os << ttt << "MODEL_NORMAL_COUNT " << (_writeNormals ? _fidv.size() * 3 : 0) << n;
         os << ttt << "MODEL_DIFFUSE_COLOR_COUNT 0" << n;
         os << ttt << "MODEL_SPECULAR_COLOR_COUNT 0" << n;
         os << ttt << "MODEL_TEXTURE_COORD_COUNT " << _uvmap.size() << n;
         os << ttt << "MODEL_BONE_COUNT 0" << n; // No skeleton
-        os << ttt << "MODEL_SHADING_COUNT 1" << n;
+        os << ttt << "MODEL_SHADING_COUNT " << numShadings() << n;
     }   // end _writeHeader
 
 
-    void _writeShadingDescriptionList( std::ostream& os) const
+    void _writeShadingDescriptionList( Writer& os) const
     {
-        const bool hasTX = _mesh.numMats() > 0;
         TB ttt(3), tttt(4), ttttt(5), tttttt(6);
         NL n(1);
         os << ttt << "MODEL_SHADING_DESCRIPTION_LIST {" << n;
-        os << tttt << "SHADING_DESCRIPTION 0 {" << n;
-        os << ttttt << "TEXTURE_LAYER_COUNT " << (hasTX ? 1 : 0) << n;    // No multi-texturing!
-        if ( hasTX)
+        for ( size_t i = 0; i < numShadings(); ++i)
         {
-            os << ttttt << "TEXTURE_COORD_DIMENSION_LIST {" << n;
-            os << tttttt << "TEXTURE_LAYER 0 DIMENSION: 2" << n;    // 2D texture map
-            os << ttttt << "}" << n; // end TEXTURE_COORD_DIMENSION_LIST
-        }   // end if
-        os << ttttt << "SHADER_ID 0" << n;
-        os << tttt << "}" << n; // end SHADING_DESCRIPTION
+            const bool hasTX = i < _matIds.size();
+            os << tttt << "SHADING_DESCRIPTION " << i << " {" << n;
+            os << ttttt << "TEXTURE_LAYER_COUNT " << (hasTX ? 1 : 0) << n;    // No multi-texturing!
+            if ( hasTX)
+            {
+                os << ttttt << "TEXTURE_COORD_DIMENSION_LIST {" << n;
+                os << tttttt << "TEXTURE_LAYER 0 DIMENSION: 2" << n;    // 2D texture map
+                os << ttttt << "}" << n; // end TEXTURE_COORD_DIMENSION_LIST
+            }   // end if
+            os << ttttt << "SHADER_ID " << i << n;
+            os << tttt << "}" << n; // end SHADING_DESCRIPTION
+        }   // end for
         os << ttt << "}" << n;  // end MODEL_SHADING_DESCRIPTION_LIST
     }   // end _writeShadingDescriptionList
 
@@ -368,7 +485,7 @@ private:
     // For each face, record the vertex IDs it's composed of - these must be the
     // index of the vertices as given in MODEL_POSITION_LIST, so map using vmap.
     // Collect all face indices into a repeatable list for subsequent nodes (texture)
-    void _writeFacePositionList( std::ostream& os) const
+    void _writeFacePositionList( Writer& os) const
     {
         os << TB(3) << "MESH_FACE_POSITION_LIST {" << NL(1);
         TB ttt(3), tttt(4);
@@ -382,7 +499,7 @@ private:
     }   // end _writeFacePositionList
 
 
-    void _writeFaceNormalList( std::ostream& os) const
+    void _writeFaceNormalList( Writer& os) const
     {
         os << TB(3) << "MESH_FACE_NORMAL_LIST {" << NL(1);
         TB ttt(3), tttt(4);
@@ -395,27 +512,29 @@ private:
 
 
     // For each face, record the shader ID (as stored in this file)
-    void _writeFaceShadingList( std::ostream& os) const
+    void _writeFaceShadingList( Writer& os) const
     {
         TB ttt(3), tttt(4);
         NL n(1);
         os << ttt << "MESH_FACE_SHADING_LIST {" << n;
-        for ( size_t j = 0; j < _fidv.size(); ++j)
-            os << tttt << 0 << n;
+        for ( int shadingID : _shdv)
+            os << tttt << shadingID << n;
         os << ttt << "}" << n;  // end MESH_FACE_SHADING_LIST
     }   // end _writeFaceShadingList
 
 
     int _getUVListIndex( int faceId, int uvOrderIndex/*[0,2]*/) const
     {
-        assert( _mesh.faceMaterialId(faceId) >= 0);
+        const int matID = _mesh.faceMaterialId(faceId);
+        assert( matID >= 0);
         const int uvid = _mesh.faceUVs(faceId)[uvOrderIndex];
-        return _uvmap.at( uvid);
+        return _uvmap.at( _uvKey( matID, uvid));
     }   // end _getUVListIndex
 
 
-    // Write out texture coordinates if Mesh has materials.
-    void _writeFaceTextureCoordList( std::ostream& os) const
+    // Write out texture coordinates if Mesh has materials. Faces with the
+    // untextured shading have no texture layers so their entries are empty.
+    void _writeFaceTextureCoordList( Writer& os) const
     {
         TB ttt(3), tttt(4), ttttt(5);
         NL n(1);
@@ -424,11 +543,14 @@ private:
         for ( int i = 0; i < nf; ++i)
         {
             const int fid = _fidv[i];
-            const int uv0 = _getUVListIndex( fid, 0);
-            const int uv1 = _getUVListIndex( fid, 1);
-            const int uv2 = _getUVListIndex( fid, 2);
             os << tttt << "FACE " << i << " {" << n;
-            os << ttttt << "TEXTURE_LAYER 0 TEX_COORD: " << uv0 << " " << uv1 << " " << uv2 << n;
+            if ( size_t(_shdv[i]) < _matIds.size())
+            {
+                const int uv0 = _getUVListIndex( fid, 0);
+                const int uv1 = _getUVListIndex( fid, 1);
+                const int uv2 = _getUVListIndex( fid, 2);
+                os << ttttt << "TEXTURE_LAYER 0 TEX_COORD: " << uv0 << " " << uv1 << " " << uv2 << n;
+            }   // end if
             os << tttt << "}" << n; // end FACE i
         }   // end for
         os << ttt << "}" << n;  // end MESH_FACE_TEXTURE_COORD_LIST
@@ -436,7 +558,7 @@ private:
 
 
     // Output mesh positions (mapping the vertex ID to the position of the vertex in this list)
-    void _writePositionList( std::ostream& os) const
+    void _writePositionList( Writer& os) const
     {
         TB ttt(3), tttt(4);
         NL n(1);
@@ -465,86 +587,88 @@ private:
 
 
     // vertex normals not used
-    void _writeNormalList( std::ostream& os) const
+    void _writeNormalList( Writer& os) const
     {
-        static const Vec3f NRM(0,0,0);
-        TB ttt(3), tttt(4);
+        static const std::string LINE = "\t\t\t\t0 0 0\n";
+        TB ttt(3);
         NL n(1);
         os << ttt << "MODEL_NORMAL_LIST {" << n;
-        //os << std::fixed << std::setprecision(6);
-        for ( size_t j = 0; j < _fidv.size(); ++j)
-        {
-            os << tttt << NRM[0] << " " << NRM[1] << " " << NRM[2] << n;
-            os << tttt << NRM[0] << " " << NRM[1] << " " << NRM[2] << n;
-            os << tttt << NRM[0] << " " << NRM[1] << " " << NRM[2] << n;
-        }   // end for
+        for ( size_t j = 0; j < 3*_fidv.size(); ++j)
+            os << LINE;
         os << ttt << "}" << n;  // end MODEL_NORMAL_LIST
     }   // end _writeNormalList
 
 
-    void _writeTextureCoordList( std::ostream& os) const
+    void _writeTextureCoordList( Writer& os) const
     {
         TB ttt(3), tttt(4);
         NL n(1);
         os << ttt << "MODEL_TEXTURE_COORD_LIST {" << n;
-        //os << std::fixed << std::setprecision(6);
         for ( const Vec2f* uv : _uvlist)
-            os << tttt << std::fixed << (*uv)[0] << " " << (*uv)[1] << " " << 0.0 << " " << 0.0 << n;
+        {
+            os << tttt;
+            os.fixed( (*uv)[0]) << " ";
+            os.fixed( (*uv)[1]) << " 0 0" << n;
+        }   // end for
         os << ttt << "}" << n;  // end MODEL_TEXTURE_COORD_LIST
     }   // end _writeTextureCoordList
 };  // end struct
 
 
 // Write the mesh data in IDTF format. Only vertex, face, and texture mapping info are stored.
-std::string _writeFile( const Mesh &mesh, bool media9, const Colour &ems,
-                const std::string& filename, const std::string &tgafname)
+std::string _writeFile( const Mesh &mesh, bool media9, bool writeNormals, const Colour &ems,
+                const std::string& filename, const std::vector<std::string> &tgafnames)
 {
-    const int nTX = tgafname.empty() ? 0 : 1;
+    FILE *f = std::fopen( filename.c_str(), "w");
+    if ( !f)
+        return "Unable to open " + filename + " for writing!";
+
     std::string errMsg;
-    std::ofstream ofs;
     try
     {
-        ofs.open( filename.c_str(), std::ios::out);
-
+        Writer os( f);
         TB t(1), tt(2);
         NL n(1);
-        const std::string meshName("Model");
 
         // File header
-        ofs << "FILE_FORMAT \"IDTF\"" << n;
-        ofs << "FORMAT_VERSION 100" << n << n;
-
-        nodeGroup( ofs);
-        nodeModel( ofs);
-
-        //nodeLight( ofs, 1);
-        //resourceLight( ofs, 1);
-
-        ofs << "RESOURCE_LIST \"MODEL\" {" << n;
-        ofs << t << "RESOURCE_COUNT 1" << n;
-        ofs << t << "RESOURCE 0 {" << n;
-        ofs << tt << "RESOURCE_NAME \"Mesh0\"" << n;
-        ofs << tt << "MODEL_TYPE \"MESH\"" << n;
-        ofs << tt << "MESH {" << n;
-        const ModelResource modelResource( mesh, media9);
-        modelResource.writeMesh( ofs);
-        ofs << tt << "}" << n;    // end MESH
-        ofs << t << "}" << n;    // end RESOURCE
-        ofs << "}" << n << n;
-
-        resourceListShader( ofs, nTX > 0);
-        resourceListMaterial( ofs, ems);
-        if ( !tgafname.empty())
-            resourceListTexture( ofs, tgafname);
-        modifierShading( ofs);
-
-        ofs.close();
+        os << "FILE_FORMAT \"IDTF\"" << n;
+        os << "FORMAT_VERSION 100" << n << n;
+
+        nodeGroup( os);
+        nodeModel( os);
+
+        //nodeLight( os, 1);
+        //resourceLight( os, 1);
+
+        os << "RESOURCE_LIST \"MODEL\" {" << n;
+        os << t << "RESOURCE_COUNT 1" << n;
+        os << t << "RESOURCE 0 {" << n;
+        os << tt << "RESOURCE_NAME \"Mesh0\"" << n;
+        os << tt << "MODEL_TYPE \"MESH\"" << n;
+        os << tt << "MESH {" << n;
+        const ModelResource modelResource( mesh, media9, writeNormals);
+        modelResource.writeMesh( os);
+        os << tt << "}" << n;    // end MESH
+        os << t << "}" << n;    // end RESOURCE
+        os << "}" << n << n;
+
+        const size_t nShaders = modelResource.numShadings();
+        resourceListShader( os, nShaders, tgafnames.size());
+        resourceListMaterial( os, ems);
+        if ( !tgafnames.empty())
+            resourceListTexture( os, tgafnames);
+        modifierShading( os, nShaders);
+
+        if ( !os.flush())
+            errMsg = "Failed to write all of " + filename;
     }   // end try
     catch ( const std::exception &e)
     {
         errMsg = e.what();
     }   // end catch
 
+    if ( std::fclose(f) != 0 && errMsg.empty())
+        errMsg = "Failed to close " + filename;
     return errMsg;
 }   // end _writeFile
 
@@ -553,7 +677,7 @@ std::string _writeFile( const Mesh &mesh, bool media9, const Colour &ems,
 
 
 // protected
-bool IDTFExporter::doSave( const Mesh& inMesh, const std::string& filename)
+bool IDTFExporter::doSave( const Mesh& mesh, const std::string& filename)
 {
     _reset();
     // Set the texture map filename (if present) and save out as TGA adjacent to mesh.
@@ -562,41 +686,68 @@ bool IDTFExporter::doSave( const Mesh& inMesh, const std::string& filename)
     Path tpath = mpath.parent_path();  // Directory mesh is being saved in
     tpath /= mpath.stem();             // Use stem of save filename as basis for texture filename
 
-    const Mesh* mesh = nullptr;
-    Mesh::Ptr nMesh;
-    if ( inMesh.numMats() <= 1)
-        mesh = &inMesh;
-    else
+    // Each material is given its own texture and shader so the mesh needn't be copied to merge them.
+    // Texture k is that of the k-th material in ascending order of material ID (see ModelResource).
+    std::vector<int> mids( mesh.materialIds().begin(), mesh.materialIds().end());
+    std::sort( mids.begin(), mids.end());
+    std::vector<std::string> tgafnames;
+    for ( size_t k = 0; k < mids.size(); ++k)
     {
-        std::cerr << "[INFO] r3dio::IDTFExporter::doSave: Multi-materials merged for export" << std::endl;
-        nMesh = inMesh.deepCopy();
-        nMesh->mergeMaterials();
-        mesh = nMesh.get();
-    }   // end else
-
-    std::string tgafname;
-    if ( mesh->hasMaterials())
+        std::ostringstream oss;
+        oss << tpath.string() << "_M" << k << ".tga";
+        tgafnames.push_back( oss.str());
+        _tgafiles.push_back( tgafnames.back());    // Record to delete on destruction
+    }   // end for
+
+    // Textures need to be in TGA format for IDTF intermediate format. They're
+    // scaled and written concurrently using the threads of the context.
+    const r3dio::Context::Ptr ctx = context();
+    if ( !progress( 0.0f, "Writing textures"))
+        return false;
+    const r3dio::IOControl &ctrl = control();
+    r3dio::IOStats &st = editStats();
+    std::vector<int> status( mids.size(), 0);  // 1 if no texture, 2 if couldn't save
     {
-        // Texture needs to be in TGA format for IDTF intermediate format.
-        cv::Mat tx = mesh->texture( *mesh->materialIds().begin());
-        if ( tx.empty())
+        R3DIO_TRACE( "IDTFExporter: write textures");
+        const r3dio::IOStats::Timer timer( st.textureSeconds);
+        ctx->parallelFor( mids.size(), [&]( size_t k)
+        {
+            if ( ctrl.stopped())
+                return;
+            const cv::Mat tx0 = mesh.texture( mids[k]);
+            const r3dio::Context::MemoryReservation mem( *ctx, tx0.empty() ? 0 : tx0.total() * tx0.elemSize());
+            const cv::Mat tx = scaleTexture( tx0, _txScale);
+            if ( tx.empty())
+                status[k] = 1;
+            else if ( !saveTGA( tx, tgafnames[k]))
+                status[k] = 2;
+        });
+    }
+
+    for ( size_t k = 0; k < mids.size(); ++k)
+    {
+        if ( status[k] == 1)
         {
             std::ostringstream eoss;
-            eoss << "[ERROR] r3dio::IDTFExporter::doSave: Material has no texture!";
+            eoss << "[ERROR] r3dio::IDTFExporter::doSave: Material " << mids[k] << " has no texture!";
             setErr(eoss.str());
             return false;
-        }   // end else
-
-        std::ostringstream oss;
-        oss << tpath.string() << "_M0.tga";
-        tgafname = oss.str();
-        _tgafiles.push_back( tgafname);    // Record to delete on destruction
-        if ( !saveTGA( tx, tgafname))
+        }   // end if
+        if ( status[k] == 2)
             return false;
-    }   // end if
+    }   // end for
+    st.textures += mids.size();
+
+    if ( !progress( 0.6f, "Writing IDTF file"))   // Also catches stopping while writing textures
+        return false;
 
     _idtffile = filename;
-    const std::string errMsg = _writeFile( *mesh, _media9, _ems, filename, tgafname);
+    std::string errMsg;
+    {
+        R3DIO_TRACE( "IDTFExporter: write");
+        const r3dio::IOStats::Timer timer( st.writeSeconds);
+        errMsg = _writeFile( mesh, _media9, _writeNormals, _ems, filename, tgafnames);
+    }
     if ( !errMsg.empty())
         setErr( "Unable to write IDTF text file: " + errMsg);
     return errMsg.empty();
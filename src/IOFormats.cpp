@@ -16,11 +16,23 @@
  ************************************************************************/
 
 #include <IOFormats.h>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/operations.hpp>
 using r3dio::IOFormats;
+using r3dio::IOStats;
+
+
+void IOStats::addTimes( const IOStats &s)
+{
+    parseSeconds += s.parseSeconds;
+    convertSeconds += s.convertSeconds;
+    textureSeconds += s.textureSeconds;
+    processSeconds += s.processSeconds;
+    writeSeconds += s.writeSeconds;
+}   // end addTimes
 
 
 namespace {
@@ -76,6 +88,25 @@ void IOFormats::setErr( const std::string& errMsg)
 }   // end setErr
 
 
+// protected
+bool IOFormats::progress( float fraction, const std::string &stage)
+{
+    if ( _ctrl.cancel && _ctrl.cancel->cancelled())
+    {
+        setErr( "Cancelled during stage: " + stage);
+        return false;
+    }   // end if
+    if ( IOControl::Clock::now() >= _ctrl.deadline)
+    {
+        setErr( "Deadline passed during stage: " + stage);
+        return false;
+    }   // end if
+    if ( _ctrl.progress)
+        _ctrl.progress( std::min( std::max( fraction, 0.0f), 1.0f), stage);
+    return true;
+}   // end progress
+
+
 // protected
 bool IOFormats::addSupported( const std::string& ext, const std::string& desc)
 {
@@ -21,8 +21,108 @@
 #include <PLYExporter.h>
 #include <OBJExporter.h>
 #include <U3DExporter.h>
+#include <MeshLayout.h>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Set up an importer for the formats loadMesh handles.
+void enableLoadFormats( r3dio::AssetImporter &aimp)
+{
+    aimp.enableFormat("3ds");
+    aimp.enableFormat("3mf");
+    aimp.enableFormat("dae");
+    aimp.enableFormat("obj");
+    aimp.enableFormat("off");
+    aimp.enableFormat("ply");
+    aimp.enableFormat("stl");
+    aimp.enableFormat("x3d");
+}   // end enableLoadFormats
+
+
+// Ask the OS to start reading the given file into the page cache.
+void adviseWillNeed( const std::string &fname)
+{
+#ifdef __linux__
+    const int fd = ::open( fname.c_str(), O_RDONLY);
+    if ( fd >= 0)
+    {
+        ::posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close( fd);
+    }   // end if
+#endif
+}   // end adviseWillNeed
+
+
+// Shared by the tasks of a single call to loadMeshes.
+struct LoadState
+{
+    std::vector<std::string> files;
+    std::vector<std::promise<r3d::Mesh::Ptr> > results;
+    r3dio::LoadOptions opts;
+    std::atomic<size_t> next;       // Next file to load
+    std::atomic<size_t> advised;    // Files before this have been advised
+    std::mutex mutex;               // Guards advised being extended
+};  // end struct
+
+
+// Load files in turn from the shared state until there are none left.
+void loadLane( LoadState &st, r3dio::Context &ctx)
+{
+    r3dio::AssetImporter aimp(true, true);
+    enableLoadFormats( aimp);
+    // Non owning since tasks mustn't own the context they run in (which outlives them anyway)
+    aimp.setContext( r3dio::Context::Ptr( r3dio::Context::Ptr(), &ctx));
+    const size_t n = st.files.size();
+    for ( size_t i = st.next++; i < n; i = st.next++)
+    {
+        // Keep the read ahead window readAhead files beyond this one
+        const size_t upto = std::min( n, i + 1 + st.opts.readAhead);
+        if ( st.advised < upto)
+        {
+            std::lock_guard<std::mutex> lock( st.mutex);
+            for ( size_t j = std::max( st.advised.load(), i+1); j < upto; ++j)
+                adviseWillNeed( st.files[j]);
+            st.advised = std::max( st.advised.load(), upto);
+        }   // end if
+
+        const std::string &fname = st.files[i];
+        r3d::Mesh::Ptr mesh;
+        try
+        {
+            {
+                boost::system::error_code ec;
+                const uintmax_t fsize = boost::filesystem::file_size( fname, ec);
+                const r3dio::Context::MemoryReservation mem( ctx, ec ? 0 : size_t(fsize));
+                if ( !fname.empty())
+                    mesh = aimp.load( fname);
+            }   // Released before calling back
+            if ( st.opts.onLoaded)
+                st.opts.onLoaded( i, fname, mesh);
+        }   // end try
+        catch (...)
+        {
+            st.results[i].set_exception( std::current_exception());
+            continue;
+        }   // end catch
+        st.results[i].set_value( mesh);
+    }   // end for
+}   // end loadLane
+
+}   // end namespace
+
 
 r3d::Mesh::Ptr r3dio::loadMesh( const std::string &fname)
 {
@@ -30,49 +130,127 @@ r3d::Mesh::Ptr r3dio::loadMesh( const std::string &fname)
     if ( !fname.empty())
     {
         AssetImporter aimp(true, true);
-        aimp.enableFormat("3ds");
-        aimp.enableFormat("3mf");
-        aimp.enableFormat("dae");
-        aimp.enableFormat("obj");
-        aimp.enableFormat("off");
-        aimp.enableFormat("ply");
-        aimp.enableFormat("stl");
-        aimp.enableFormat("x3d");
+        enableLoadFormats( aimp);
         model = aimp.load( fname);
     }   // end if
     return model;
 }   // end loadMesh
 
 
-bool r3dio::saveMesh( const r3d::Mesh &mesh, const std::string &fn)
+std::vector<std::future<r3d::Mesh::Ptr> > r3dio::loadMeshes( const std::vector<std::string> &files, const LoadOptions &opts)
+{
+    const std::shared_ptr<LoadState> st = std::make_shared<LoadState>();
+    st->files = files;
+    st->results.resize( files.size());
+    st->opts = opts;
+    st->opts.ctx.reset();   // Tasks mustn't own the context they run in
+    st->next = 0;
+    st->advised = 0;
+
+    std::vector<std::future<r3d::Mesh::Ptr> > futs;
+    for ( std::promise<r3d::Mesh::Ptr> &p : st->results)
+        futs.push_back( p.get_future());
+
+    const Context::Ptr ctx = opts.ctx ? opts.ctx : Context::global();
+    const size_t nlanes = std::min( files.size(), opts.parallelism > 0 ? opts.parallelism : ctx->threads());
+
+    // Start reading the first files straight away
+    st->advised = std::min( files.size(), nlanes + opts.readAhead);
+    for ( size_t j = 0; j < st->advised; ++j)
+        adviseWillNeed( files[j]);
+
+    Context &c = *ctx;  // Outlives its queued tasks since a context finishes its queue before destruction
+    for ( size_t i = 0; i < nlanes; ++i)
+        ctx->submit( [st, &c](){ loadLane( *st, c);});
+    return futs;
+}   // end loadMeshes
+
+
+namespace {
+
+// Returns a new exporter for the format given by the extension of fn (null if unsupported)
+// setting fname to the file it should save to.
+std::shared_ptr<r3dio::MeshExporter> makeExporter( const r3d::Mesh &mesh, const std::string &fn, std::string &fname)
 {
     if ( !boost::filesystem::path(fn).has_extension())  // Check for filename extension
-        return false;
+        return nullptr;
 
     const boost::filesystem::path fpath( fn);
     std::string ext = boost::algorithm::to_lower_copy( fpath.extension().string());
     if ( ext == ".")    // Empty extension
-        return false;
+        return nullptr;
 
     ext = ext.substr(1);    // Remove the initial dot
+    fname = fn;
+    if ( ext == "ply" || ext == "obj" || ext == "u3d" || ext == "stl" || ext == "3ds")
+        fname = boost::filesystem::path(fn).replace_extension(ext).string();
+
     if ( ext == "ply")
-        return saveAsPLY( mesh, fn);
+        return std::make_shared<r3dio::PLYExporter>();
     else if ( ext == "obj")
-        return saveAsOBJ( mesh, fn, false);
+        return std::make_shared<r3dio::OBJExporter>( false);
     else if ( ext == "u3d")
-        return saveAsU3D( mesh, fn);
-    else if ( ext == "stl")
-        return saveAsSTL( mesh, fn);
-    else if ( ext == "3ds")
-        return saveAs3DS( mesh, fn);
-    else
+        return std::make_shared<r3dio::U3DExporter>();
+    else if ( ext == "3ds" && mesh.numFaces() > 65536)
     {
-        AssetExporter aexp; // Otherwise try to save in some other kind of format...
-        if ( aexp.enableFormat( ext))
-            return aexp.save( mesh, fn);
-    }   // end else
+        std::cerr << "[WARNING] r3dio::saveAs3DS: Mesh contains more than 65536 faces (limit for 3DS format)." << std::endl;
+        return nullptr;
+    }   // end else if
+
+    // Otherwise try to save in some other kind of format...
+    std::shared_ptr<r3dio::AssetExporter> aexp = std::make_shared<r3dio::AssetExporter>();
+    if ( aexp->enableFormat( ext))
+        return aexp;
+    return nullptr;   // Nothing worked!
+}   // end makeExporter
+
+}   // end namespace
 
-    return false;   // Nothing worked!
+
+bool r3dio::saveMesh( const r3d::Mesh &mesh, const std::string &fn)
+{
+    std::string fname;
+    const std::shared_ptr<MeshExporter> mexp = makeExporter( mesh, fn, fname);
+    return mexp && mexp->save( mesh, fname);
+}   // end saveMesh
+
+
+bool r3dio::saveMesh( const r3d::Mesh &mesh, const std::vector<std::string> &fns, const Context::Ptr &cx)
+{
+    const Context::Ptr ctx = cx ? cx : Context::global();
+    const MeshLayout::Ptr lay = MeshLayout::create( mesh);
+
+    // The exporters are kept here (not in the tasks) so that they and their
+    // references to the context are released on this thread once all are done.
+    std::vector<std::shared_ptr<MeshExporter> > mexps;
+    std::vector<std::future<bool> > saves;
+    bool ok = true;
+    for ( const std::string &fn : fns)
+    {
+        std::string fname;
+        const std::shared_ptr<MeshExporter> mexp = makeExporter( mesh, fn, fname);
+        if ( !mexp)
+        {
+            ok = false;
+            continue;
+        }   // end if
+
+        mexp->setLayout( lay);
+        mexp->setContext( ctx);
+        mexps.push_back( mexp);
+        MeshExporter *exp = mexp.get();
+        saves.push_back( ctx->submit( [&mesh, exp, fname](){ return exp->save( mesh, fname);}));
+    }   // end for
+
+    for ( std::future<bool> &save : saves)
+        ok = ctx->get( save) && ok;
+    return ok;
+}   // end saveMesh
+
+
+bool r3dio::saveMesh( const r3d::Mesh &mesh, std::initializer_list<std::string> fns, const Context::Ptr &ctx)
+{
+    return saveMesh( mesh, std::vector<std::string>( fns), ctx);
 }   // end saveMesh
 
 
@@ -118,3 +296,114 @@ bool r3dio::saveAs3DS( const r3d::Mesh &mesh, const std::string &fn)
     aexp.enableFormat("3ds");
     return aexp.save( mesh, fname);
 }   // end saveAs3DS
+
+
+namespace {
+
+#ifdef __linux__
+// Create dst as a copy of src. If clone is true, only a copy-on-write clone (reflink) is
+// tried (supported by e.g. btrfs and xfs), otherwise the data are copied within the kernel
+// (falling back to copying through a buffer). Returns false (leaving no dst) on failure.
+bool copyData( const std::string &src, const std::string &dst, bool clone)
+{
+    const int sfd = ::open( src.c_str(), O_RDONLY);
+    if ( sfd < 0)
+        return false;
+    struct stat st;
+    if ( ::fstat( sfd, &st) != 0)
+    {
+        ::close( sfd);
+        return false;
+    }   // end if
+    const int dfd = ::open( dst.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+    if ( dfd < 0)
+    {
+        ::close( sfd);
+        return false;
+    }   // end if
+
+    bool ok = false;
+    if ( clone)
+        ok = ::ioctl( dfd, FICLONE, sfd) == 0;
+    else
+    {
+        off_t written = 0;
+        ssize_t n = 1;
+        while ( written < st.st_size && n > 0)  // Fails between filesystems on older kernels
+            if ( (n = ::copy_file_range( sfd, nullptr, dfd, nullptr, size_t(st.st_size - written), 0)) > 0)
+                written += n;
+
+        // Copy the rest through a buffer (from where copy_file_range left the file offsets)
+        // giving up on the first failed write (e.g. if the destination is out of space).
+        std::vector<char> buf( written < st.st_size ? 1 << 20 : 0);
+        bool writeFailed = false;
+        while ( !writeFailed && written < st.st_size && (n = ::read( sfd, buf.data(), buf.size())) > 0)
+        {
+            for ( ssize_t w = 0, m = 0; w < n; w += m, written += m)
+            {
+                if ( (m = ::write( dfd, buf.data() + w, size_t(n - w))) <= 0)
+                {
+                    writeFailed = true;
+                    break;
+                }   // end if
+            }   // end for
+        }   // end while
+        ok = !writeFailed && written == st.st_size;
+    }   // end else
+
+    ::close( sfd);
+    if ( ::close( dfd) != 0)
+        ok = false;
+    if ( !ok)
+        ::unlink( dst.c_str());
+    return ok;
+}   // end copyData
+#endif
+
+}   // end namespace
+
+
+bool r3dio::stageFile( const std::string &src, const std::string &dst, bool allowSymlink)
+{
+    namespace BFS = boost::filesystem;
+    boost::system::error_code ec;
+    if ( !BFS::is_regular_file( src, ec) || BFS::exists( dst, ec))
+        return false;
+
+    BFS::create_hard_link( src, dst, ec);
+    if ( !ec)
+        return true;
+#ifdef __linux__
+    if ( copyData( src, dst, true))
+        return true;
+#endif
+    if ( allowSymlink)
+    {
+        ec.clear();
+        BFS::create_symlink( BFS::absolute( src), dst, ec);
+        if ( !ec)
+            return true;
+    }   // end if
+#ifdef __linux__
+    return copyData( src, dst, false);
+#else
+    ec.clear();
+    BFS::copy_file( src, dst, BFS::copy_option::fail_if_exists, ec);
+    return !ec;
+#endif
+}   // end stageFile
+
+
+bool r3dio::copyFile( const std::string &src, const std::string &dst)
+{
+    namespace BFS = boost::filesystem;
+    boost::system::error_code ec;
+    if ( !BFS::is_regular_file( src, ec) || BFS::exists( dst, ec))
+        return false;
+#ifdef __linux__
+    return copyData( src, dst, true) || copyData( src, dst, false);
+#else
+    BFS::copy_file( src, dst, BFS::copy_option::fail_if_exists, ec);
+    return !ec;
+#endif
+}   // end copyFile
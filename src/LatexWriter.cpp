@@ -17,13 +17,26 @@
 
 #include <LatexWriter.h>
 #include <PDFGenerator.h>
+#include <PDFWriter.h>
+#include <IOHelpers.h>
+#include <Trace.h>
+#include <MeshRasterizer.h>
+#include <ScratchSpace.h>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <iomanip>
 #include <fstream>
 #include <sstream>
 using r3d::Vec3f;
+using r3dio::Config;
+using r3dio::Context;
 using r3dio::LatexWriter;
+using r3dio::ScratchSpace;
 using Colour = rimg::Colour;
 using Cam = r3d::CameraParams;
 using r3dio::Box;
@@ -56,9 +69,9 @@ bool LatexWriter::testGeneratePDF()
 This is just a test.
 \end{document}
 )";
-    const BFS::path workdir = BFS::temp_directory_path() / BFS::unique_path();
+    const BFS::path workdir = ScratchSpace::makeDirectory();
     const BFS::path texpath = workdir / "test.tex";
-    if ( !BFS::create_directories( workdir))
+    if ( workdir.empty())
     {
         std::cerr << "[ERROR] r3dio::LatexWriter: Unable to create temporary directory!" << std::endl;
         return false;
@@ -77,12 +90,153 @@ This is just a test.
     }   // end catch
 
     const bool success = r3dio::PDFGenerator( false)( texpath.string());
-    BFS::remove_all( workdir);
+    ScratchSpace::remove( workdir.string());
     return success;
 }   // end testGeneratePDF
 
+// public static
+void LatexWriter::setFormatCacheDirectory( const std::string &dir)
+{
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setFormatCacheDirectory( dir);});
+}   // end setFormatCacheDirectory
+
+std::string LatexWriter::formatCacheDirectory() { return r3dio::Config::current()->formatCacheDirectory();}
+
+
+// public static
+void LatexWriter::setLayerCacheDirectory( const std::string &dir)
+{
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setLayerCacheDirectory( dir);});
+}   // end setLayerCacheDirectory
+
+std::string LatexWriter::layerCacheDirectory() { return r3dio::Config::current()->layerCacheDirectory();}
+
+
+// public static
+void LatexWriter::setImageDPI( float dpi)
+{
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setImageDPI( dpi);});
+}   // end setImageDPI
+
+float LatexWriter::imageDPI() { return r3dio::Config::current()->imageDPI();}
+
+
+// public static
+void LatexWriter::setImageCacheDirectory( const std::string &dir)
+{
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setImageCacheDirectory( dir);});
+}   // end setImageCacheDirectory
+
+std::string LatexWriter::imageCacheDirectory() { return r3dio::Config::current()->imageCacheDirectory();}
+
+
 namespace {
 
+// 64 bit FNV-1a hash of the given string.
+uint64_t fnv1a( const std::string &s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for ( unsigned char c : s)
+        h = (h ^ c) * 1099511628211ULL;
+    return h;
+}   // end fnv1a
+
+
+// Returns true iff the given 8 bit image has no more than maxCols distinct colours
+// in which case it's probably a graphic or screenshot and better stored losslessly.
+bool hasFewColours( const cv::Mat &img, size_t maxCols)
+{
+    std::unordered_set<uint32_t> cols;
+    const int nc = img.channels();
+    for ( int i = 0; i < img.rows; ++i)
+    {
+        const unsigned char *row = img.ptr<unsigned char>(i);
+        for ( int j = 0; j < img.cols; ++j)
+        {
+            uint32_t c = 0;
+            for ( int k = 0; k < nc; ++k)
+                c = (c << 8) | row[j*nc + k];
+            cols.insert(c);
+            if ( cols.size() > maxCols)
+                return false;
+        }   // end for
+    }   // end for
+    return true;
+}   // end hasFewColours
+
+
+// Resample the image at imgpath to dpi for a box of wmm x hmm and encode as JPEG
+// (photographic content) or PNG (alpha or few colours) in directory dir. Results
+// are named by the hash of the source file's contents and the target size so
+// are reused. Returns imgpath if the image can't be read or doesn't need changing.
+std::string prepareImage( r3dio::Context &ctx, const std::string &imgpath, float wmm, float hmm, float dpi, const BFS::path &dir)
+{
+    R3DIO_TRACE( "LatexWriter: prepare image");
+    std::ifstream ifs( imgpath, std::ios::binary);
+    if ( !ifs)
+        return imgpath;
+    const std::string bytes( (std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ifs.close();
+
+    const int tw = std::max( 1, int( wmm / 25.4f * dpi + 0.5f));
+    const int th = std::max( 1, int( hmm / 25.4f * dpi + 0.5f));
+
+    std::ostringstream key;
+    key << bytes << "\n" << tw << "x" << th;
+    std::ostringstream oss;
+    oss << "img-" << std::hex << std::setw(16) << std::setfill('0') << fnv1a( key.str());
+    const BFS::path stem = dir / oss.str();
+
+    boost::system::error_code ec;
+    for ( const char *ext : {".jpg", ".png"})
+        if ( BFS::exists( BFS::path(stem).replace_extension(ext), ec))
+            return BFS::path(stem).replace_extension(ext).string();
+
+    cv::Mat img = cv::imread( imgpath, cv::IMREAD_UNCHANGED);
+    if ( img.empty())
+        return imgpath;
+    const r3dio::Context::MemoryReservation mem( ctx, img.total() * img.elemSize());  // For the resampled copy
+    if ( img.depth() == CV_16U)
+        img.convertTo( img, CV_8U, 1.0/256);
+
+    const bool shrink = img.cols > tw || img.rows > th;
+    const std::string ext = BFS::path(imgpath).extension().string();
+    if ( !shrink && (boost::iequals( ext, ".jpg") || boost::iequals( ext, ".jpeg")))
+        return imgpath; // Already small enough and no point re-encoding lossy as lossy
+
+    if ( shrink)
+    {
+        // Keep the aspect ratio since LaTeX stretches the image to the box anyway
+        const double sc = std::min( double(tw) / img.cols, double(th) / img.rows);
+        cv::Mat smat;
+        cv::resize( img, smat, cv::Size( std::max( 1, int(img.cols * sc + 0.5)),
+                                         std::max( 1, int(img.rows * sc + 0.5))), 0, 0, cv::INTER_AREA);
+        img = smat;
+    }   // end if
+
+    const bool lossless = img.channels() == 4 || hasFewColours( img, 256);
+    const BFS::path fpath = BFS::path(stem).replace_extension( lossless ? ".png" : ".jpg");
+    const BFS::path tpath = dir / BFS::unique_path( "%%%%-%%%%-%%%%-%%%%").replace_extension( fpath.extension());
+    std::vector<int> params;
+    if ( lossless)
+        params = {cv::IMWRITE_PNG_COMPRESSION, 9};
+    else
+        params = {cv::IMWRITE_JPEG_QUALITY, 90};
+    if ( !cv::imwrite( tpath.string(), img, params))
+    {
+        BFS::remove( tpath, ec);
+        return imgpath;
+    }   // end if
+    BFS::rename( tpath, fpath, ec);
+    if ( ec)
+    {
+        BFS::remove( tpath, ec);
+        return imgpath;
+    }   // end if
+    return fpath.string();
+}   // end prepareImage
+
+
 void _writeVWSView( std::ostream &f, const std::string &vtitle, const Vec3f &c2c, float roo, const std::string &astr)
 {
     f << "VIEW=" << vtitle << "\n"
@@ -182,11 +336,11 @@ std::string LatexWriter::sanit( const std::string &s)
 
 struct LatexWriter::Pimpl
 {
-    Pimpl( float wmm, float hmm, bool doDelete)
-        : _wmm(wmm), _hmm(hmm), _doDelete(doDelete),
-          _workdir( BFS::temp_directory_path() / BFS::unique_path())
+    Pimpl( float wmm, float hmm, bool doDelete, const Config::Ptr &cfg, const Context::Ptr &ctx)
+        : _cfg( cfg ? cfg : Config::current()), _ctx( ctx ? ctx : Context::global()), _wmm(wmm), _hmm(hmm), _doDelete(doDelete), _native( wmm, hmm), _nativeOk(true), _useNative(false),
+          _workdir( _ctx->makeScratchDirectory()), _inLayer(false)
     {
-        if ( !BFS::create_directories( _workdir))
+        if ( _workdir.empty())
             std::cerr << "[ERROR] r3dio::LatexWriter: Unable to create working directory!" << std::endl;
         // Need to draw extent of page area first to make relative page measurement drawing work
         drawRectangle( Box(0,0,wmm,hmm), Colour::white());
@@ -194,12 +348,8 @@ struct LatexWriter::Pimpl
 
     ~Pimpl()
     {
-        if ( !_doDelete)
-            return;
-        boost::system::error_code ec;
-        BFS::remove_all( _workdir, ec);
-        if ( ec)
-            std::cerr << "[WARNING] r3dio::LatexWriter: Unable to remove working directory: " << ec.message() << std::endl;
+        if ( _doDelete)
+            ScratchSpace::remove( _workdir.string());
     }   // end dtor
 
 
@@ -217,50 +367,43 @@ struct LatexWriter::Pimpl
             return false;
         }   // end if
 
-        bool success = true;
-        try
-        {
-            BFS::copy_file( fpath, tofile, BFS::copy_option::fail_if_exists);
-        }   // end try
-        catch ( ...)
-        {
+        // Link rather than copy where possible
+        const bool success = r3dio::stageFile( fpath, tofile.string());
+        if ( !success)
             std::cerr << "[ERROR] r3dio::LatexWriter::copyInFile " << "Failed copy to '" << tofile << "'" << std::endl;
-            success = false;
-        }   // end catch
         return success;
     }   // end copyInFile
 
 
-    std::string makePDF() const
+    // Write the tex file returning its path (or an empty string on failure). Sets fmtfile
+    // to the format pdflatex should be started from (empty if format caching isn't enabled).
+    std::string writeTex( std::string &fmtfile) const
     {
-        std::string outfile;
         BFS::path texfile( _workdir / "scene.tex");
         std::ofstream fout;        // File stream
-        bool success = false;
         try
         {
+            // The constant part of the preamble (including any added headers) can be dumped
+            // to a cached format file which is much faster to start pdflatex from than loading
+            // the packages again. Packages that can't be dumped are then loaded after \endofdump
+            // (and so after the headers). Without a format the headers come last as they always
+            // have so that they may use any of the packages (e.g. \hypersetup).
+            const Page &p0 = _pages.empty() ? _curPage() : _pages.front();
+            const std::string dumped = _preamble( nullptr);
+            fmtfile = _formatFile( dumped);
+
             fout.open( texfile.string(), std::ios::out);
-            fout << "\\documentclass{article}\n"
-                << "\\listfiles\n" // So log shows packages used (useful for debugging)
-                << "\\usepackage[textwidth=" << _wmm << "mm,textheight=" << _hmm << "mm,"
-                    << "paperwidth=" << _wmm << "mm,paperheight=" << _hmm << "mm]{geometry}\n"
-                << "\\usepackage[absolute]{textpos}\n" // Absolute positioning
-                << "\\usepackage{graphicx}\n"
-                << "\\usepackage{verbatim}\n"
-                << "\\usepackage{xcolor}\n"
-                << "\\usepackage{float}\n"
-                << "\\usepackage[justification=centering]{caption}\n"
-                << "\\usepackage{tikz}\n"
-                << "\\usepackage{media9}\n"
-                << "\\usepackage{amsmath}\n"
-                << "\\usepackage[parfill]{parskip}\n"
-                << "\\usepackage[colorlinks=true,urlcolor=blue]{hyperref}\n"
-                << "\\DeclareGraphicsExtensions{.png,.jpg,.pdf,.eps}\n"
-                << "\\setlength{\\TPHorizModule}{1mm}\n"
-                << "\\setlength{\\TPVertModule}{\\TPHorizModule}\n"
-                << "\\setlength{\\parindent}{0pt}\n"
-                << _hout.str() << "\n";
-            
+            if ( fmtfile.empty())
+                fout << _preamble( &p0);
+            else
+            {
+                fout << dumped
+                     << "\\endofdump\n"
+                     << "\\geometry{" << _geometry( p0) << "}\n"
+                     << "\\usepackage{media9}\n"
+                     << "\\usepackage[colorlinks=true,urlcolor=blue]{hyperref}\n";
+            }   // end else
+
             // Write out the defined colours
             for ( const auto &p : _dcols)
             {
@@ -271,41 +414,116 @@ struct LatexWriter::Pimpl
             // Add in the main document content
             fout << "\n"
                 << "\\begin{document}\n"
-                << "\\pagenumbering{gobble}\n"
-                << "\\thispagestyle{fancy}\n"
-                << _dout.str() << "\n"
-                << "\\begin{textblock*}{0mm}(0mm,0mm)\n"
-                << "\\begin{tikzpicture}[x=1mm,y=1mm]\n"  // Scale always mm
-                << _tout.str()   // Output all drawing commands here (includes outer edge box from ctor)
-                << "\\end{tikzpicture}\n"
-                << "\\end{textblock*}\n"
-                << "\\end{document}\n";
+                << "\\pagenumbering{gobble}\n";
+            for ( const Page &page : _pages)
+                _writePage( fout, page, &page == &_pages.front());
+            _writePage( fout, _curPage(), _pages.empty());
+            fout << "\\end{document}\n";
 
             fout.close();
-
-            success = r3dio::PDFGenerator( false)( texfile.string());
-            if ( success)
-                outfile = texfile.replace_extension("pdf").string();
-            else
-                std::cerr << "[ERROR] r3dio::LatexWriter: Failed to generate PDF from '" << texfile << "'" << std::endl;
         }   // end try
         catch (...)
         {
             std::cerr << "[ERROR] r3dio::LatexWriter: Unable to open/write file stream!" << std::endl;
-            success = false;
+            return "";
         }   // end catch
+        return texfile.string();
+    }   // end writeTex
+
+
+    std::string makePDF() const
+    {
+        if ( _nativeOk && (_useNative || _cfg->resolvedPDFLatex().empty()))
+        {
+            const BFS::path pdffile = _workdir / "scene.pdf";
+            _native.setBaseDirectory( _workdir.string()); // Files copied in are referenced relative to here
+            const bool saved = _native.save( pdffile.string());
+            _doDelete &= saved;
+            return saved ? pdffile.string() : "";
+        }   // end if
+
+        std::string fmtfile;
+        const std::string texfile = writeTex( fmtfile);
+        bool success = false;
+        if ( !texfile.empty())
+        {
+            r3dio::PDFGenerator pdfgen( false, _cfg);
+            pdfgen.setFormat( fmtfile);
+            success = pdfgen( texfile);
+            if ( !success)
+                std::cerr << "[ERROR] r3dio::LatexWriter: Failed to generate PDF from '" << texfile << "'" << std::endl;
+        }   // end if
 
         _doDelete &= success;
-        return success ? outfile : "";
+        return success ? BFS::path(texfile).replace_extension("pdf").string() : "";
     }   // end makePDF
 
 
     std::string workingDirectory() const { return _workdir.string();}
+    const Config::Ptr &config() const { return _cfg;}
 
-    void addHeader( const std::string &tex) { _hout << tex;}
+    void newPage( float wmm, float hmm)
+    {
+        endLayer();
+        _native.newPage( wmm, hmm);
+        _pages.push_back( _curPage());
+        if ( wmm > 0 && hmm > 0)
+        {
+            _wmm = wmm;
+            _hmm = hmm;
+        }   // end if
+        _dout.str("");
+        _tout.str("");
+        _layers.clear();
+        drawRectangle( Box(0,0,_wmm,_hmm), Colour::white());
+    }   // end newPage
+
+    void beginLayer()
+    {
+        endLayer();
+        _inLayer = true;
+        _lout.str("");
+        _lcols.clear();
+    }   // end beginLayer
+
+    void endLayer()
+    {
+        if ( !_inLayer)
+            return;
+        _inLayer = false;
+
+        // Standalone page sized document of just the layer's drawing commands
+        std::ostringstream oss;
+        oss << "\\documentclass[border=0pt]{standalone}\n"
+            << "\\usepackage{xcolor}\n"
+            << "\\usepackage{tikz}\n";
+        for ( const auto &p : _lcols)
+        {
+            const Colour &col = p.first;
+            oss << "\\definecolor{" << p.second << "}{RGB}{" << col.ired() << "," << col.igreen() << "," << col.iblue() << "}\n";
+        }   // end for
+        oss << "\\begin{document}\n"
+            << "\\begin{tikzpicture}[x=1mm,y=1mm]\n"
+            << "\\useasboundingbox (0,0) rectangle (" << _wmm << "," << _hmm << ");\n"
+            << _lout.str()
+            << "\\end{tikzpicture}\n"
+            << "\\end{document}\n";
+        _layers.push_back( Layer{ oss.str(), _lout.str()});
+    }   // end endLayer
+
+    size_t numPages() const { return _pages.size() + 1;}
+
+    void addHeader( const std::string &tex)
+    {
+        _hout << tex;
+        _nativeOk = false;
+    }   // end addHeader
+
+    void setUseNative( bool v) { _useNative = v;}
 
     void addRaw( const Box &box, const std::string &tex, bool centre)
     {
+        _nativeOk = false;  // Raw LaTeX needs pdflatex
         _startBlock( box);
         if ( centre)
             _dout << "\\centering\n";
@@ -315,6 +533,7 @@ struct LatexWriter::Pimpl
 
     void addText( const Box &box, const std::string &txt, bool centre)
     {
+        _native.addText( box, txt, centre);
         _startBlock( box);
         if ( centre)
             _dout << "\\centering\n";
@@ -324,25 +543,35 @@ struct LatexWriter::Pimpl
 
     void fillRectangle( const Box &box, const Colour &col)
     {
+        _native.fillRectangle( box, col);
         const std::string &dcol = _getDefinedColourName( col);
-        _tout << "\\filldraw[" << dcol << "," << dcol << "]";
+        _tikz() << "\\filldraw[" << dcol << "," << dcol << "]";
         _writeRectangleDims( box);
     }   // end fillRectangle
 
     void drawRectangle( const Box &box, const Colour &col)
     {
-        _tout << "\\draw[" << _getDefinedColourName(col) << "]";
+        _native.drawRectangle( box, col);
+        _tikz() << "\\draw[" << _getDefinedColourName(col) << "]";
         _writeRectangleDims( box);
     }   // end drawRectangle
 
     void drawLine( const Point &p, const Point &q, const Colour &col)
     {
-        _tout << "\\draw[" << _getDefinedColourName(col) << "]";
-        _tout << "(" << p[0] << "," << (_hmm - p[1]) << ") -- (" << q[0] << "," << (_hmm - q[1]) << ");\n";
+        _native.drawLine( p, q, col);
+        _tikz() << "\\draw[" << _getDefinedColourName(col) << "]";
+        _tikz() << "(" << p[0] << "," << (_hmm - p[1]) << ") -- (" << q[0] << "," << (_hmm - q[1]) << ");\n";
     }   // end drawRectangle
 
-    void addImage( const Box &box, const std::string &imgpath, const std::string &caption)
+    void addImage( const Box &box, const std::string &srcpath, const std::string &caption)
     {
+        std::string imgpath = srcpath;
+        if ( _cfg->imageDPI() > 0)
+        {
+            const std::string &cdir = _cfg->imageCacheDirectory();
+            imgpath = prepareImage( *_ctx, srcpath, box[2], box[3], _cfg->imageDPI(), cdir.empty() ? _workdir : BFS::path(cdir));
+        }   // end if
+        _native.addImage( box, imgpath, caption);
         _startBlock(box);
         _dout << "\\begin{figure}\n";
         _dout << "\\includegraphics[width=" << box[2] << "mm,height=" << box[3] << "mm]{" << BFS::path(imgpath) << "}";
@@ -352,8 +581,27 @@ struct LatexWriter::Pimpl
         _endBlock();
     }   // end addImage
 
+    void addMesh( const Box &box, const std::string &u3d, const Cam &cam, const r3d::Mesh &mesh, const std::string &caption, float dpi)
+    {
+        const int wpx = std::max( 1, int( box[2] / 25.4f * dpi + 0.5f));
+        const int hpx = std::max( 1, int( box[3] / 25.4f * dpi + 0.5f));
+        r3dio::MeshRasterizer rast( wpx, hpx);
+        rast.setSupersampling( 2);
+        rast.setContext( _ctx);
+        const cv::Mat img = rast.render( mesh, cam);
+        const std::string bgimg = (_workdir / BFS::unique_path( "%%%%-%%%%-%%%%-%%%%.png")).string();
+        if ( cv::imwrite( bgimg, img))
+            addMesh( box, u3d, cam, bgimg, caption);
+        else
+        {
+            std::cerr << "[ERROR] r3dio::LatexWriter::addMesh: Unable to write rendered background image!" << std::endl;
+            addMesh( box, u3d, cam, "", caption);
+        }   // end else
+    }   // end addMesh
+
     void addMesh( const Box &box, const std::string &u3d, const Cam &cam, const std::string &bgimg, const std::string &caption)
     {
+        _native.addMesh( box, u3d, cam, bgimg, caption);
         const BFS::path vwsfile = BFS::unique_path( "%%%%-%%%%-%%%%-%%%%.vws");
         const BFS::path axsfile = BFS::unique_path( "%%%%-%%%%-%%%%-%%%%.js");
         const float w = box[2];
@@ -386,9 +634,160 @@ struct LatexWriter::Pimpl
     }   // end addMesh
 
 private:
+    struct Layer
+    {
+        std::string doc;    // Standalone document of the layer
+        std::string ttex;   // TIKZ content (used directly if the layer can't be compiled)
+    };  // end struct
+
+    struct Page
+    {
+        float wmm, hmm;
+        std::string dtex;   // Document tex
+        std::string ttex;   // TIKZ content
+        std::vector<Layer> layers;
+    };  // end struct
+
+    Page _curPage() const { return Page{ _wmm, _hmm, _dout.str(), _tout.str(), _layers};}
+
+    std::ostringstream &_tikz() { return _inLayer ? _lout : _tout;}
+
+    // Returns the compiled PDF of the given layer (compiling it first if not already cached)
+    // or an empty string if the layer couldn't be compiled.
+    std::string _layerFile( const Layer &layer) const
+    {
+        const std::string &cdir = _cfg->layerCacheDirectory();
+        const BFS::path dir = cdir.empty() ? _workdir : BFS::path(cdir);
+        std::ostringstream oss;
+        oss << "layer-" << std::hex << std::setw(16) << std::setfill('0') << fnv1a( layer.doc) << ".pdf";
+        const BFS::path fpath = dir / oss.str();
+        boost::system::error_code ec;
+        if ( BFS::exists( fpath, ec))
+            return fpath.string();
+
+        // Compile in a unique directory and move into place so concurrent writers don't clash.
+        const BFS::path tdir = dir / BFS::unique_path( "%%%%-%%%%-%%%%-%%%%");
+        if ( !BFS::create_directories( tdir, ec))
+            return "";
+        const BFS::path texfile = tdir / "layer.tex";
+        std::ofstream ofs( texfile.string());
+        ofs << layer.doc;
+        ofs.close();
+        if ( ofs && r3dio::PDFGenerator( true, _cfg)( texfile.string()))
+            BFS::rename( BFS::path(texfile).replace_extension("pdf"), fpath, ec);
+        BFS::remove_all( tdir, ec);
+        return BFS::exists( fpath, ec) ? fpath.string() : "";
+    }   // end _layerFile
+
+    // Pages after the first may differ in size so set the size of the page
+    // that is shipped out next before writing any of its content.
+    void _writePage( std::ostream &fout, const Page &page, bool first) const
+    {
+        if ( !first)
+        {
+            fout << "\\newpage\n"
+                 << "\\pdfpagewidth=" << page.wmm << "mm\\pdfpageheight=" << page.hmm << "mm\n"
+                 << "\\paperwidth=" << page.wmm << "mm\\paperheight=" << page.hmm << "mm\n"
+                 << "\\null\n";  // So the page is output even if it has only absolutely positioned content
+        }   // end if
+        fout << "\\thispagestyle{fancy}\n";
+
+        // Layers are drawn first (under everything else) from their compiled PDFs.
+        std::string ltex;
+        for ( const Layer &layer : page.layers)
+        {
+            const std::string lfile = _layerFile( layer);
+            if ( lfile.empty())
+                ltex += layer.ttex;
+            else
+            {
+                fout << "\\begin{textblock*}{" << page.wmm << "mm}(0mm,0mm)\n"
+                     << "\\includegraphics[width=" << page.wmm << "mm,height=" << page.hmm << "mm]{"
+                        << BFS::path(lfile).generic_string() << "}\n"
+                     << "\\end{textblock*}\n";
+            }   // end else
+        }   // end for
+
+        fout << page.dtex << "\n"
+             << "\\begin{textblock*}{0mm}(0mm,0mm)\n"
+             << "\\begin{tikzpicture}[x=1mm,y=1mm]\n"  // Scale always mm
+             << page.ttex   // Output all drawing commands here (includes outer edge box)
+             << ltex        // Layers that couldn't be compiled
+             << "\\end{tikzpicture}\n"
+             << "\\end{textblock*}\n";
+    }   // end _writePage
+
+    // Returns the geometry options for the given page.
+    static std::string _geometry( const Page &p)
+    {
+        std::ostringstream oss;
+        oss << "textwidth=" << p.wmm << "mm,textheight=" << p.hmm << "mm,"
+            << "paperwidth=" << p.wmm << "mm,paperheight=" << p.hmm << "mm";
+        return oss.str();
+    }   // end _geometry
+
+    // Returns the complete preamble (before the colour definitions) for first page p0, or if
+    // p0 is null, just its constant part to dump to a format file which leaves the geometry
+    // unsized and excludes media9 and hyperref since they can't be dumped.
+    std::string _preamble( const Page *p0) const
+    {
+        std::ostringstream oss;
+        oss << "\\documentclass{article}\n"
+            << "\\listfiles\n"; // So log shows packages used (useful for debugging)
+        if ( p0)
+            oss << "\\usepackage[" << _geometry( *p0) << "]{geometry}\n";
+        else
+            oss << "\\usepackage{geometry}\n";
+        oss << "\\usepackage[absolute]{textpos}\n" // Absolute positioning
+            << "\\usepackage{graphicx}\n"
+            << "\\usepackage{verbatim}\n"
+            << "\\usepackage{xcolor}\n"
+            << "\\usepackage{float}\n"
+            << "\\usepackage[justification=centering]{caption}\n"
+            << "\\usepackage{tikz}\n";
+        if ( p0)
+            oss << "\\usepackage{media9}\n";
+        oss << "\\usepackage{amsmath}\n"
+            << "\\usepackage[parfill]{parskip}\n";
+        if ( p0)
+            oss << "\\usepackage[colorlinks=true,urlcolor=blue]{hyperref}\n";
+        oss << "\\DeclareGraphicsExtensions{.png,.jpg,.pdf,.eps}\n"
+            << "\\setlength{\\TPHorizModule}{1mm}\n"
+            << "\\setlength{\\TPVertModule}{\\TPHorizModule}\n"
+            << "\\setlength{\\parindent}{0pt}\n"
+            << _hout.str() << "\n";
+        return oss.str();
+    }   // end _preamble
+
+    // Returns the cached format file for the given preamble (making it first if necessary),
+    // or an empty string if format caching isn't enabled or the format couldn't be made.
+    std::string _formatFile( const std::string &preamble) const
+    {
+        const std::string &cdir = _cfg->formatCacheDirectory();
+        if ( cdir.empty())
+            return "";
+
+        std::ostringstream oss;
+        oss << "r3dio-" << std::hex << std::setw(16) << std::setfill('0')
+            << fnv1a( _cfg->pdflatex() + "\n" + preamble) << ".fmt";
+        const BFS::path fpath = BFS::path(cdir) / oss.str();
+        boost::system::error_code ec;
+        if ( BFS::exists( fpath, ec))
+            return fpath.string();
+
+        BFS::create_directories( cdir, ec);
+        const BFS::path ptex = _workdir / "preamble.tex";
+        std::ofstream ofs( ptex.string());
+        ofs << preamble << "\\endofdump\n\\begin{document}\n\\end{document}\n";
+        ofs.close();
+        if ( !ofs || !r3dio::PDFGenerator::makeFormat( ptex.string(), fpath.string(), _cfg))
+            return "";
+        return fpath.string();
+    }   // end _formatFile
+
     void _writeRectangleDims( const Box &box)
     {
-        _tout << "(" << box[0] << "," << (_hmm - box[1]) << ")"  // One corner
+        _tikz() << "(" << box[0] << "," << (_hmm - box[1]) << ")"  // One corner
              << "rectangle(" << (box[0] + box[2]) << "," << (_hmm - box[1] - box[3]) << ");\n";    // Opposite corner
     }   // end _writeRectangleDims
 
@@ -401,6 +800,12 @@ private:
 
     const std::string &_getDefinedColourName( const Colour &col)
     {
+        if ( _inLayer && _lcols.count(col) == 0)
+        {
+            std::ostringstream oss;
+            oss << "rgb-" << col.ired() << "-" << col.igreen() << "-" << col.iblue();
+            _lcols[col] = oss.str();
+        }   // end if
         if ( _dcols.count(col) == 0)
         {
             std::ostringstream oss;
@@ -410,19 +815,30 @@ private:
         return _dcols.at(col);
     }   // end _getDefinedColourName
 
-    float _wmm, _hmm;
+    const Config::Ptr _cfg;
+    const Context::Ptr _ctx;
+    float _wmm, _hmm;           // Current page size
+    std::vector<Page> _pages;   // Completed pages (before the current one)
     mutable bool _doDelete;
+    mutable r3dio::PDFWriter _native;   // Used instead of pdflatex if possible
+    bool _nativeOk;             // False once content needing pdflatex is added
+    bool _useNative;
     BFS::path _workdir;
     std::unordered_map<Colour, std::string, rimg::HashColour> _dcols;    // Defined colours go at end of header
     std::ostringstream _hout;   // Header tex
-    std::ostringstream _dout;   // Document tex
-    std::ostringstream _tout;   // TIKZ content
+    std::ostringstream _dout;   // Document tex of current page
+    std::ostringstream _tout;   // TIKZ content of current page
+    bool _inLayer;
+    std::ostringstream _lout;   // TIKZ content of open layer
+    std::unordered_map<Colour, std::string, rimg::HashColour> _lcols;    // Colours used by open layer
+    std::vector<Layer> _layers; // Closed layers of current page
 };  // end struct
 
 
 /********************** INTERFACE FOLLOWS *************************/
 
-LatexWriter::LatexWriter( float w, float h, bool doDelete) : _pimpl(new Pimpl( w, h, doDelete)) {}
+LatexWriter::LatexWriter( float w, float h, bool doDelete, const Config::Ptr &cfg, const Context::Ptr &ctx)
+    : _pimpl(new Pimpl( w, h, doDelete, cfg, ctx)) {}
 
 LatexWriter::~LatexWriter() { delete _pimpl;}
 
@@ -433,8 +849,18 @@ bool LatexWriter::copyInFile( const std::string &fpath, const std::string &fname
 
 std::string LatexWriter::workingDirectory() const { return _pimpl->workingDirectory();}
 
+Config::Ptr LatexWriter::config() const { return _pimpl->config();}
+
 std::string LatexWriter::makePDF() const { return _pimpl->makePDF();}
 
+std::string LatexWriter::writeTex( std::string &fmtfile) const { return _pimpl->writeTex( fmtfile);}
+
+void LatexWriter::newPage( float w, float h) { _pimpl->newPage( w, h);}
+void LatexWriter::beginLayer() { _pimpl->beginLayer();}
+void LatexWriter::endLayer() { _pimpl->endLayer();}
+size_t LatexWriter::numPages() const { return _pimpl->numPages();}
+
+void LatexWriter::setUseNative( bool v) { _pimpl->setUseNative(v);}
 void LatexWriter::addHeader( const std::string &tx) { _pimpl->addHeader(tx);}
 LatexWriter& LatexWriter::operator<<( const std::string &tx) { addHeader(tx); return *this;}
 void LatexWriter::addRaw( const Box &box, const std::string &tx, bool cntr) { _pimpl->addRaw( box, tx, cntr);}
@@ -452,3 +878,8 @@ void LatexWriter::addMesh( const Box &box, const std::string &u3d, const Cam &ca
 {
     _pimpl->addMesh( box, u3d, cam, bgimg, caption);
 }   // end addMesh
+
+void LatexWriter::addMesh( const Box &box, const std::string &u3d, const Cam &cam, const r3d::Mesh &mesh, const std::string &caption, float dpi)
+{
+    _pimpl->addMesh( box, u3d, cam, mesh, caption, dpi);
+}   // end addMesh
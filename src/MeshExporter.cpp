@@ -16,6 +16,8 @@
  ************************************************************************/
 
 #include <MeshExporter.h>
+#include <Trace.h>
+#include <boost/filesystem/operations.hpp>
 using r3dio::MeshExporter;
 
 MeshExporter::MeshExporter() : r3dio::IOFormats() { }   // end ctor
@@ -23,6 +25,13 @@ MeshExporter::MeshExporter() : r3dio::IOFormats() { }   // end ctor
 
 bool MeshExporter::save( const r3d::Mesh& mesh, const std::string& fname)
 {
+    IOStats &st = editStats();
+    st.reset();
+    const IOStats::Timer timer( st.totalSeconds);
+    st.vertices = mesh.numVtxs();
+    st.faces = mesh.numFaces();
+    st.materials = mesh.numMats();
+
     if ( fname.empty())
     {
         setErr( "Empty filename passed to RModelIO::MeshExporter::save!");
@@ -36,5 +45,37 @@ bool MeshExporter::save( const r3d::Mesh& mesh, const std::string& fname)
         return false;
     }   // end if
 
-    return doSave( mesh, fname);    // virtual
+    if ( !progress( 0, "Saving"))
+        return false;
+    bool saved;
+    {
+        R3DIO_TRACE( "MeshExporter::doSave");
+        saved = doSave( mesh, fname);    // virtual
+    }
+    if ( saved)
+    {
+        boost::system::error_code ec;
+        const boost::uintmax_t nbytes = boost::filesystem::file_size( fname, ec);
+        st.bytesWritten += ec ? 0 : size_t(nbytes);
+        if ( control().progress)
+            control().progress( 1, "Saved");
+    }   // end if
+    return saved;
 }   // end save
+
+
+std::future<bool> MeshExporter::saveAsync( const r3d::Mesh& mesh, const std::string& fname, const IOControl &ctrl)
+{
+    return context()->submit( [this, &mesh, fname, ctrl]()
+    {
+        const ScopedControl sc( *this, ctrl);
+        return save( mesh, fname);
+    });
+}   // end saveAsync
+
+
+// protected
+r3dio::MeshLayout::Ptr MeshExporter::layout( const r3d::Mesh &mesh) const
+{
+    return _layout ? _layout : MeshLayout::create( mesh);
+}   // end layout
@@ -16,6 +16,8 @@
  ************************************************************************/
 
 #include <MeshImporter.h>
+#include <Trace.h>
+#include <boost/filesystem/operations.hpp>
 using r3dio::MeshImporter;
 
 
@@ -24,6 +26,9 @@ MeshImporter::MeshImporter() : r3dio::IOFormats() {}
 
 r3d::Mesh::Ptr MeshImporter::load( const std::string& fname)
 {
+    IOStats &st = editStats();
+    st.reset();
+    const IOStats::Timer timer( st.totalSeconds);
     setErr(""); // Clear error
     if ( !isSupported( fname))
     {
@@ -31,5 +36,34 @@ r3d::Mesh::Ptr MeshImporter::load( const std::string& fname)
         return r3d::Mesh::Ptr();
     }   // end if
 
-    return doLoad( fname);  // virtual
+    if ( !progress( 0, "Loading"))
+        return r3d::Mesh::Ptr();
+
+    r3d::Mesh::Ptr mesh;
+    {
+        R3DIO_TRACE( "MeshImporter::doLoad");
+        mesh = doLoad( fname);  // virtual
+    }
+    if ( mesh)
+    {
+        boost::system::error_code ec;
+        const boost::uintmax_t nbytes = boost::filesystem::file_size( fname, ec);
+        st.bytesRead += ec ? 0 : size_t(nbytes);
+        st.vertices = mesh->numVtxs();
+        st.faces = mesh->numFaces();
+        st.materials = mesh->numMats();
+        if ( control().progress)
+            control().progress( 1, "Loaded");
+    }   // end if
+    return mesh;
 }   // end load
+
+
+std::future<r3d::Mesh::Ptr> MeshImporter::loadAsync( const std::string& fname, const IOControl &ctrl)
+{
+    return context()->submit( [this, fname, ctrl]()
+    {
+        const ScopedControl sc( *this, ctrl);
+        return load( fname);
+    });
+}   // end loadAsync
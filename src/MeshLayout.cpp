@@ -0,0 +1,106 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <MeshLayout.h>
+#include <Trace.h>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+using r3dio::MeshLayout;
+namespace BFS = boost::filesystem;
+
+
+// public static
+MeshLayout::Ptr MeshLayout::create( const r3d::Mesh &mesh) { return Ptr( new MeshLayout( mesh));}
+
+
+// private
+MeshLayout::MeshLayout( const r3d::Mesh &mesh)
+    : _mesh(mesh),
+      _vids( mesh.vtxIds().begin(), mesh.vtxIds().end()),
+      _fids( mesh.faces().begin(), mesh.faces().end()),
+      _mids( mesh.materialIds().begin(), mesh.materialIds().end())
+{
+    std::sort( _vids.begin(), _vids.end());
+    std::sort( _fids.begin(), _fids.end());
+    std::sort( _mids.begin(), _mids.end());
+    _vidx.reserve( _vids.size());
+    for ( size_t i = 0; i < _vids.size(); ++i)
+        _vidx[_vids[i]] = int(i);
+}   // end ctor
+
+
+bool MeshLayout::writeTexture( int matId, const std::string &fname) const
+{
+    R3DIO_TRACE( "MeshLayout::writeTexture");
+    const std::string ext = boost::algorithm::to_lower_copy( BFS::path(fname).extension().string());
+    std::ostringstream key;
+    key << matId << ext;
+
+    // The lock is only held to find or add the entry for the key. The first thread to ask
+    // for a texture encodes it (outside of the lock) and concurrent requests for the same
+    // texture wait on its future rather than encode it again.
+    std::shared_future<Encoded> fut;
+    std::promise<Encoded> prom;
+    bool encoder = false;
+    {
+        std::lock_guard<std::mutex> lock( _mutex);
+        auto it = _encoded.find( key.str());
+        if ( it == _encoded.end())
+        {
+            it = _encoded.emplace( key.str(), prom.get_future().share()).first;
+            encoder = true;
+        }   // end if
+        fut = it->second;
+    }
+
+    if ( encoder)
+    {
+        std::shared_ptr<std::vector<uchar> > enc = std::make_shared<std::vector<uchar> >();
+        const cv::Mat tx = _mesh.texture( matId);
+        bool encoded = false;
+        try
+        {
+            encoded = !tx.empty() && !ext.empty() && cv::imencode( ext, tx, *enc);
+        }   // end try
+        catch ( const std::exception&) {}   // Waiters must always get a value
+        if ( !encoded)
+            enc.reset();
+        prom.set_value( enc);
+    }   // end if
+
+    const Encoded bytes = fut.get();
+    if ( !bytes)
+        return false;
+
+    const BFS::path fpath( fname);
+    const BFS::path tpath = fpath.parent_path() / BFS::unique_path( "%%%%-%%%%-%%%%-%%%%" + ext);
+    std::ofstream ofs( tpath.string(), std::ios::binary);
+    ofs.write( reinterpret_cast<const char*>( bytes->data()), std::streamsize( bytes->size()));
+    ofs.close();
+    boost::system::error_code ec;
+    if ( ofs)
+        BFS::rename( tpath, fpath, ec);
+    if ( !ofs || ec)
+    {
+        BFS::remove( tpath, ec);
+        return false;
+    }   // end if
+    return true;
+}   // end writeTexture
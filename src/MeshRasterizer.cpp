@@ -0,0 +1,362 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <MeshRasterizer.h>
+#include <Trace.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+using r3dio::MeshRasterizer;
+using r3d::Vec2f;
+using r3d::Vec3f;
+
+
+namespace {
+
+static const int TILE = 32;  // Tile width and height in pixels
+
+// A triangle in screen space ready for rasterizing.
+struct Tri
+{
+    float x[3], y[3];   // Pixel coordinates (y down)
+    float d[3];         // Depth value (larger is nearer); 1/z for perspective, -z for parallel
+    float iw[3];        // Perspective correction factor (1/z for perspective, 1 for parallel)
+    float u[3], v[3];   // Texture coordinates (in pixels of the texture)
+    const cv::Mat *tx;  // Texture (null if untextured)
+    float shade;        // Lighting multiplier
+};  // end struct
+
+
+// Projects vertices to screen space.
+class Projector
+{
+public:
+    Projector( const r3d::CameraParams &cam, int w, int h)
+        : _pos( cam.pos()), _persp( !cam.isParallel()), _cx( 0.5f*w), _cy( 0.5f*h)
+    {
+        _f = (cam.focus() - cam.pos()).normalized();
+        _r = _f.cross( cam.up()).normalized();
+        _u = _r.cross( _f);
+        if ( _persp)
+        {
+            static const float D2R = float(EIGEN_PI/180);
+            _s = 0.5f * h / tanf( 0.5f * cam.fov() * D2R);
+        }   // end if
+        else
+            _s = 0.5f * h / cam.parallelScale();    // Parallel scale is half the height of the view
+        _near = 1e-3f * std::max( cam.distance(), 1e-6f);
+    }   // end ctor
+
+    bool isPerspective() const { return _persp;}
+
+    const Vec3f &viewDirection() const { return _f;}
+
+    // Returns false if v is behind the near plane.
+    bool operator()( const Vec3f &v, float &x, float &y, float &d, float &iw) const
+    {
+        const Vec3f p = v - _pos;
+        const float z = p.dot(_f);
+        if ( _persp)
+        {
+            if ( z < _near)
+                return false;
+            iw = 1.0f / z;
+            x = _cx + _s * p.dot(_r) * iw;
+            y = _cy - _s * p.dot(_u) * iw;
+            d = iw;
+        }   // end if
+        else
+        {
+            iw = 1.0f;
+            x = _cx + _s * p.dot(_r);
+            y = _cy - _s * p.dot(_u);
+            d = -z;
+        }   // end else
+        return true;
+    }   // end operator()
+
+private:
+    Vec3f _pos, _f, _r, _u;
+    bool _persp;
+    float _cx, _cy, _s, _near;
+};  // end class
+
+
+// Returns the texture as 8 bit, 3 channel BGR.
+cv::Mat toBGR( const cv::Mat &m)
+{
+    cv::Mat img = m;
+    if ( img.depth() == CV_16U)
+        img.convertTo( img, CV_8U, 1.0/256);
+    if ( img.channels() == 1)
+        cv::cvtColor( img, img, cv::COLOR_GRAY2BGR);
+    else if ( img.channels() == 4)
+        cv::cvtColor( img, img, cv::COLOR_BGRA2BGR);
+    return img;
+}   // end toBGR
+
+
+// Rasterize the triangles in the given tile into img using the tile local depth buffer dbuf.
+void rasterizeTile( const std::vector<Tri> &tris, const std::vector<int> &bin,
+                    int tx0, int ty0, int tx1, int ty1,
+                    bool persp, const cv::Vec3b &ucol, std::vector<float> &dbuf, cv::Mat &img)
+{
+    const int tw = tx1 - tx0;
+    std::fill( dbuf.begin(), dbuf.end(), -std::numeric_limits<float>::max());
+
+    for ( int ti : bin)
+    {
+        const Tri &t = tris[ti];
+        const int minx = std::max( tx0, int( std::floor( std::min( {t.x[0], t.x[1], t.x[2]}))));
+        const int maxx = std::min( tx1-1, int( std::ceil( std::max( {t.x[0], t.x[1], t.x[2]}))));
+        const int miny = std::max( ty0, int( std::floor( std::min( {t.y[0], t.y[1], t.y[2]}))));
+        const int maxy = std::min( ty1-1, int( std::ceil( std::max( {t.y[0], t.y[1], t.y[2]}))));
+        if ( minx > maxx || miny > maxy)
+            continue;
+
+        // Edge functions e_i(x,y) = A_i*x + B_i*y + C_i for the edge opposite vertex i
+        // (vertices are ordered so the area is positive).
+        float A[3], B[3], C[3];
+        for ( int i = 0; i < 3; ++i)
+        {
+            const int j = (i+1) % 3;
+            const int k = (i+2) % 3;
+            A[i] = t.y[j] - t.y[k];
+            B[i] = t.x[k] - t.x[j];
+            C[i] = t.x[j]*t.y[k] - t.x[k]*t.y[j];
+        }   // end for
+        const float iarea = 1.0f / (A[0]*t.x[0] + B[0]*t.y[0] + C[0]);
+
+        // Attributes divided by w so they can be interpolated linearly in screen space.
+        float uw[3], vw[3];
+        for ( int i = 0; i < 3; ++i)
+        {
+            uw[i] = t.u[i] * t.iw[i];
+            vw[i] = t.v[i] * t.iw[i];
+        }   // end for
+
+        const cv::Vec3b flat( cv::saturate_cast<uchar>( ucol[0] * t.shade),
+                              cv::saturate_cast<uchar>( ucol[1] * t.shade),
+                              cv::saturate_cast<uchar>( ucol[2] * t.shade));
+
+        for ( int y = miny; y <= maxy; ++y)
+        {
+            const float py = y + 0.5f;
+            const float px0 = minx + 0.5f;
+            float e0 = A[0]*px0 + B[0]*py + C[0];
+            float e1 = A[1]*px0 + B[1]*py + C[1];
+            float e2 = A[2]*px0 + B[2]*py + C[2];
+            float *drow = &dbuf[(y - ty0)*tw - tx0];
+            cv::Vec3b *irow = img.ptr<cv::Vec3b>(y);
+            for ( int x = minx; x <= maxx; ++x, e0 += A[0], e1 += A[1], e2 += A[2])
+            {
+                if ( e0 < 0 || e1 < 0 || e2 < 0)
+                    continue;
+                const float b0 = e0 * iarea;
+                const float b1 = e1 * iarea;
+                const float b2 = e2 * iarea;
+                const float d = b0*t.d[0] + b1*t.d[1] + b2*t.d[2];
+                if ( d <= drow[x])
+                    continue;
+                drow[x] = d;
+
+                if ( !t.tx)
+                {
+                    irow[x] = flat;
+                    continue;
+                }   // end if
+
+                float u, v;
+                if ( persp)
+                {
+                    const float w = 1.0f / (b0*t.iw[0] + b1*t.iw[1] + b2*t.iw[2]);
+                    u = (b0*uw[0] + b1*uw[1] + b2*uw[2]) * w;
+                    v = (b0*vw[0] + b1*vw[1] + b2*vw[2]) * w;
+                }   // end if
+                else
+                {
+                    u = b0*t.u[0] + b1*t.u[1] + b2*t.u[2];
+                    v = b0*t.v[0] + b1*t.v[1] + b2*t.v[2];
+                }   // end else
+
+                const int c = std::min( t.tx->cols-1, std::max( 0, int(u)));
+                const int r = std::min( t.tx->rows-1, std::max( 0, int(v)));
+                const cv::Vec3b &s = t.tx->ptr<cv::Vec3b>(r)[c];
+                irow[x] = cv::Vec3b( cv::saturate_cast<uchar>( s[0] * t.shade),
+                                     cv::saturate_cast<uchar>( s[1] * t.shade),
+                                     cv::saturate_cast<uchar>( s[2] * t.shade));
+            }   // end for
+        }   // end for
+    }   // end for
+}   // end rasterizeTile
+
+}   // end namespace
+
+
+MeshRasterizer::MeshRasterizer( int w, int h, int nthreads)
+    : _w( std::max(1,w)), _h( std::max(1,h)), _nthreads( std::max(0,nthreads)), _ss(1), _shade(true),
+      _bg( rimg::Colour::white()), _ucol( 217, 217, 217)
+{}   // end ctor
+
+
+cv::Mat MeshRasterizer::render( const r3d::Mesh &mesh, const r3d::CameraParams &cam, int w, int h)
+{
+    return MeshRasterizer( w, h).render( mesh, cam);
+}   // end render
+
+
+cv::Mat MeshRasterizer::render( const r3d::Mesh &mesh, const r3d::CameraParams &cam) const
+{
+    R3DIO_TRACE( "MeshRasterizer::render");
+    const int W = _w * _ss;
+    const int H = _h * _ss;
+    const Projector proj( cam, W, H);
+
+    // Textures as BGR
+    std::unordered_map<int, cv::Mat> txs;
+    for ( int mid : mesh.materialIds())
+    {
+        const cv::Mat tx = mesh.texture( mid);
+        if ( !tx.empty())
+            txs[mid] = toBGR( tx);
+    }   // end for
+
+    // Project the vertices once
+    std::unordered_map<int, int> vmap;    // Vertex ID to index into projected arrays
+    std::vector<float> vx, vy, vd, viw;
+    std::vector<bool> vok;
+    vmap.reserve( mesh.numVtxs());
+    for ( int vid : mesh.vtxIds())
+    {
+        float x=0, y=0, d=0, iw=0;
+        vok.push_back( proj( mesh.vtx(vid), x, y, d, iw));
+        vmap[vid] = int(vx.size());
+        vx.push_back(x);
+        vy.push_back(y);
+        vd.push_back(d);
+        viw.push_back(iw);
+    }   // end for
+
+    // Set up the triangles and bin them by tile
+    const int ntx = (W + TILE - 1) / TILE;
+    const int nty = (H + TILE - 1) / TILE;
+    std::vector<std::vector<int> > bins( ntx * nty);
+    std::vector<Tri> tris;
+    tris.reserve( mesh.numFaces());
+    for ( int fid : mesh.faces())
+    {
+        const int *fvidxs = mesh.fvidxs( fid);
+        int k[3];
+        bool ok = true;
+        for ( int i = 0; i < 3; ++i)
+        {
+            k[i] = vmap.at( fvidxs[i]);
+            ok = ok && vok[k[i]];
+        }   // end for
+        if ( !ok)   // Crosses the near plane
+            continue;
+
+        Tri t;
+        for ( int i = 0; i < 3; ++i)
+        {
+            t.x[i] = vx[k[i]];
+            t.y[i] = vy[k[i]];
+            t.d[i] = vd[k[i]];
+            t.iw[i] = viw[k[i]];
+            t.u[i] = t.v[i] = 0;
+        }   // end for
+
+        // Orient so the signed area is positive (faces are drawn from both sides)
+        const float area = (t.x[1] - t.x[0])*(t.y[2] - t.y[0]) - (t.x[2] - t.x[0])*(t.y[1] - t.y[0]);
+        if ( fabsf(area) < 1e-12f)
+            continue;
+        int order[3] = {0,1,2};
+        if ( area < 0)
+        {
+            std::swap( order[1], order[2]);
+            std::swap( t.x[1], t.x[2]);
+            std::swap( t.y[1], t.y[2]);
+            std::swap( t.d[1], t.d[2]);
+            std::swap( t.iw[1], t.iw[2]);
+        }   // end if
+
+        t.tx = nullptr;
+        const int mid = mesh.faceMaterialId( fid);
+        const auto it = txs.find( mid);
+        if ( it != txs.end())
+        {
+            t.tx = &it->second;
+            const int *uvids = mesh.faceUVs( fid);
+            for ( int i = 0; i < 3; ++i)
+            {
+                const Vec2f &uv = mesh.uv( mid, uvids[order[i]]);
+                t.u[i] = uv[0] * t.tx->cols;
+                t.v[i] = (1.0f - uv[1]) * t.tx->rows;   // Texture origin is bottom left
+            }   // end for
+        }   // end if
+
+        t.shade = 1.0f;
+        if ( _shade)
+        {
+            const Vec3f &v0 = mesh.vtx( fvidxs[0]);
+            const Vec3f &v1 = mesh.vtx( fvidxs[1]);
+            const Vec3f &v2 = mesh.vtx( fvidxs[2]);
+            const Vec3f n = (v1 - v0).cross( v2 - v0).normalized();
+            t.shade = 0.3f + 0.7f * fabsf( n.dot( proj.viewDirection()));  // Directional light from camera
+        }   // end if
+
+        const int bx0 = std::max( 0, int( std::floor( std::min( {t.x[0], t.x[1], t.x[2]}))) / TILE);
+        const int bx1 = std::min( ntx-1, int( std::ceil( std::max( {t.x[0], t.x[1], t.x[2]}))) / TILE);
+        const int by0 = std::max( 0, int( std::floor( std::min( {t.y[0], t.y[1], t.y[2]}))) / TILE);
+        const int by1 = std::min( nty-1, int( std::ceil( std::max( {t.y[0], t.y[1], t.y[2]}))) / TILE);
+        if ( bx0 > bx1 || by0 > by1)    // Off screen
+            continue;
+
+        const int ti = int(tris.size());
+        tris.push_back(t);
+        for ( int by = by0; by <= by1; ++by)
+            for ( int bx = bx0; bx <= bx1; ++bx)
+                bins[by*ntx + bx].push_back(ti);
+    }   // end for
+
+    const r3dio::Context::Ptr ctx = _ctx ? _ctx : r3dio::Context::global();
+    const r3dio::Context::MemoryReservation mem( *ctx, size_t(W) * H * 3);
+    cv::Mat img( H, W, CV_8UC3, cv::Scalar( _bg.iblue(), _bg.igreen(), _bg.ired()));
+
+    // Tiles are rasterized independently by the context's threads
+    const bool persp = proj.isPerspective();
+    ctx->parallelFor( bins.size(), [&]( size_t b)
+    {
+        if ( bins[b].empty())
+            return;
+        thread_local std::vector<float> dbuf;
+        dbuf.resize( TILE*TILE);
+        const int tx0 = int(b % ntx) * TILE;
+        const int ty0 = int(b / ntx) * TILE;
+        rasterizeTile( tris, bins[b], tx0, ty0, std::min( W, tx0 + TILE), std::min( H, ty0 + TILE),
+                       persp, _ucol, dbuf, img);
+    }, size_t(_nthreads));
+
+    if ( _ss > 1)
+    {
+        cv::Mat dimg;
+        cv::resize( img, dimg, cv::Size( _w, _h), 0, 0, cv::INTER_AREA);
+        img = dimg;
+    }   // end if
+    return img;
+}   // end render
@@ -16,8 +16,10 @@
  ************************************************************************/
 
 #include <OBJExporter.h>
+#include <Trace.h>
 #include <boost/filesystem/operations.hpp>
 #include <fstream>
+#include <functional>
 using r3dio::OBJExporter;
 using r3d::Mesh;
 using r3d::Vec3f;
@@ -41,8 +43,9 @@ std::string getMaterialName( const std::string& fname, int midx)
 
 
 // Write out the .mtl file - returning any error string.
-std::string writeMaterialFile( const Mesh &mesh, const std::string& fname, bool asPNG)
+std::string writeMaterialFile( const r3dio::MeshLayout &lay, const std::string& fname, bool asPNG, r3dio::IOStats &st)
 {
+    const Mesh &mesh = lay.mesh();
     const boost::filesystem::path ppath = boost::filesystem::path(fname).parent_path();
     std::string err;
     std::ofstream ofs;
@@ -54,22 +57,27 @@ std::string writeMaterialFile( const Mesh &mesh, const std::string& fname, bool
 
         int pmid = 0;   // Will be set to the 'pseudo' material ID in the event nfaces < total mesh faces.
         int nfaces = 0;
-        const IntSet& mids = mesh.materialIds();
 
         const std::string IMG_EXT = asPNG ? ".png" : ".jpg";
-        for ( int mid : mids)
+        for ( int mid : lay.materialIds())
         {
             nfaces += int(mesh.materialFaceIds(mid).size());
             const std::string matname = getMaterialName( fname, mid);
             ofs << "newmtl " << matname << std::endl;
-            const cv::Mat tx = mesh.texture(mid);
-            if ( !tx.empty())
+            if ( !mesh.texture(mid).empty())
             {
                 std::ostringstream oss;
                 oss << matname << IMG_EXT;
                 ofs << "map_Kd " << oss.str() << std::endl;
                 const std::string imgfile = (ppath / oss.str()).string();
-                cv::imwrite( imgfile, tx);
+                const r3dio::IOStats::Timer timer( st.textureSeconds);
+                if ( lay.writeTexture( mid, imgfile))
+                {
+                    boost::system::error_code ec;
+                    const boost::uintmax_t nbytes = boost::filesystem::file_size( imgfile, ec);
+                    st.bytesWritten += ec ? 0 : size_t(nbytes);
+                    st.textures++;
+                }   // end if
             }   // end if
 
             ofs << std::endl;
@@ -94,20 +102,35 @@ std::string writeMaterialFile( const Mesh &mesh, const std::string& fname, bool
 
 using IIMap = std::unordered_map<int,int>;
 
-void writeVertices( std::ostream& os, const Mesh &mesh, IIMap& vvmap)
+// Called for each vertex/face written with the name of the stage returning false to stop.
+// Only every 4096th call (as for IOFormats::progress) goes through to report progress.
+class StepFn
 {
-    const IntSet& vidSet = mesh.vtxIds();
-    // Ensure always sorted into ascending order for write consistency
-    std::vector<int> vids( vidSet.begin(), vidSet.end());
-    std::sort( vids.begin(), vids.end());
+public:
+    StepFn( size_t n, const std::function<bool( size_t, size_t, const char*)> &report) : _n(n), _done(0), _report(report) {}
 
-    int i = 0;
-    for ( int vid : vids)
+    bool operator()( const char *stage) const
     {
-        vvmap[vid] = ++i;   // Preincrement because vertex indices start at one for OBJ
-        const Vec3f& v = mesh.vtx(vid);
+        const size_t i = _done++;
+        return (i & 0xfff) != 0 || _report( i, _n, stage);
+    }   // end operator()
+
+private:
+    const size_t _n;
+    mutable size_t _done;   // Vertices and faces written
+    const std::function<bool( size_t, size_t, const char*)> _report;
+};  // end class
+
+bool writeVertices( std::ostream& os, const r3dio::MeshLayout &lay, const StepFn &step)
+{
+    for ( int vid : lay.vertexIds())    // Ascending order for write consistency
+    {
+        if ( !step( "Writing vertices"))
+            return false;
+        const Vec3f& v = lay.mesh().vtx(vid);
         os << "v\t" << v[0] << " " << v[1] << " " << v[2] << std::endl;
     }   // end for
+    return true;
 }   // end writeVertices
 
 
@@ -129,22 +152,30 @@ void writeMaterialUVs( std::ostream& os, const Mesh &mesh, int midx, IIMap& uvma
 }   // end writeMaterialUVs
 
 
-void writeMaterialFaces( std::ostream& os, const Mesh &mesh, int midx, const IIMap& vvmap, const IIMap& uvmap, IntSet& rfids)
+// Returns the index of the given vertex in the .obj vertex list (which starts at one).
+int objIndex( const r3dio::MeshLayout &lay, int vid) { return lay.vertexIndex(vid) + 1;}
+
+
+bool writeMaterialFaces( std::ostream& os, const r3dio::MeshLayout &lay, int midx, const IIMap& uvmap, IntSet& rfids,
+                         const StepFn &step)
 {
-    // Vertex indices are +1 because .obj vertex list starts at 1.
+    const Mesh &mesh = lay.mesh();
     const IntSet& mfidSet = mesh.materialFaceIds( midx);
     std::vector<int> mfids( mfidSet.begin(), mfidSet.end());
     std::sort( mfids.begin(), mfids.end());
 
     for ( int fid : mfids)
     {
+        if ( !step( "Writing faces"))
+            return false;
         rfids.erase(fid);
         const int* vidxs = mesh.fvidxs(fid);
         const int* fuvs = mesh.faceUVs(fid);
-        os << "f\t" << vvmap.at(vidxs[0]) << "/" << uvmap.at(fuvs[0]) << " "
-                    << vvmap.at(vidxs[1]) << "/" << uvmap.at(fuvs[1]) << " "
-                    << vvmap.at(vidxs[2]) << "/" << uvmap.at(fuvs[2]) << std::endl;
+        os << "f\t" << objIndex( lay, vidxs[0]) << "/" << uvmap.at(fuvs[0]) << " "
+                    << objIndex( lay, vidxs[1]) << "/" << uvmap.at(fuvs[1]) << " "
+                    << objIndex( lay, vidxs[2]) << "/" << uvmap.at(fuvs[2]) << std::endl;
     }   // end for
+    return true;
 }   // end writeMaterialFaces
 
 }   // end namespace
@@ -155,12 +186,26 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
 {
     std::string err = "";
 
+    r3dio::IOStats &st = editStats();
+    r3dio::MeshLayout::Ptr lay;
+    {
+        const r3dio::IOStats::Timer timer( st.convertSeconds);
+        lay = layout( mesh);
+    }
+
+    // Writing the material file (and textures) is counted as the first tenth.
+    if ( !progress( 0.0f, "Writing materials"))
+        return false;
+    const StepFn step( mesh.numVtxs() + mesh.numFaces(),
+                       [this]( size_t i, size_t n, const char *stage){ return progress( i, n, 0.1f, 1.0f, stage);});
+    bool stopped = false;
+
     // Only need to write out the material file if have materials
     std::string matfile = "";
     if ( mesh.numMats() > 0)
     {
         matfile = boost::filesystem::path(fname).replace_extension("mtl").string();
-        err = writeMaterialFile( mesh, matfile, _asPNG);
+        err = writeMaterialFile( *lay, matfile, _asPNG, st);
         if ( !err.empty())
         {
             setErr( "Unable to write OBJ .mtl file! " + err);
@@ -171,6 +216,8 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
     std::ofstream ofs;
     try
     {
+        R3DIO_TRACE( "OBJExporter: write");
+        const r3dio::IOStats::Timer timer( st.writeSeconds);
         ofs.open( fname.c_str(), std::ios::out);
         ofs << "# Wavefront OBJ file produced by r3dio (https://github.com/richeytastic/r3dio)" << std::endl;
         ofs << std::endl;
@@ -183,8 +230,7 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
 
         ofs << "# Mesh has " << mesh.numVtxs() << " vertices" << std::endl;
 
-        IIMap vvmap;
-        writeVertices( ofs, mesh, vvmap);
+        stopped = !writeVertices( ofs, *lay, step);
 
         ofs << std::endl;
 
@@ -194,9 +240,10 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
             remfids.insert(fid);
 
         int pmid = 0;   // Pseudo material ID if required.
-        const IntSet& mids = mesh.materialIds();
-        for ( int mid : mids)
+        for ( int mid : lay->materialIds())
         {
+            if ( stopped)
+                break;
             const std::string mname = getMaterialName( fname, mid);
             ofs << "# " << mesh.uvs(mid).size() << " UV coordinates on material '" << mname << "'" << std::endl;
             IIMap uvmap;
@@ -204,13 +251,13 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
             ofs << std::endl;
             ofs << "# Mesh '" << mname << "' with " << mesh.materialFaceIds(mid).size() << " faces" << std::endl;
             ofs << "usemtl " << mname << std::endl;
-            writeMaterialFaces( ofs, mesh, mid, vvmap, uvmap, remfids);
+            stopped = !writeMaterialFaces( ofs, *lay, mid, uvmap, remfids, step);
             pmid = mid+1;
         }   // end for
 
         ofs << std::endl;
         // Not all faces accounted for in materials, so write out the remainder without texture coordinates.
-        if ( !remfids.empty())
+        if ( !remfids.empty() && !stopped)
         {
             if ( pmid > 0)
                 pmid--;
@@ -221,8 +268,13 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
             std::sort( rfids.begin(), rfids.end()); // Sort into ascending order for file output consistency
             for ( int fid : rfids)
             {
+                if ( !step( "Writing faces"))
+                {
+                    stopped = true;
+                    break;
+                }   // end if
                 const int* vidxs = mesh.fvidxs(fid);
-                ofs << "f\t" << vvmap.at(vidxs[0]) << " " << vvmap.at(vidxs[1]) << " " << vvmap.at(vidxs[2]) << std::endl;
+                ofs << "f\t" << objIndex( *lay, vidxs[0]) << " " << objIndex( *lay, vidxs[1]) << " " << objIndex( *lay, vidxs[2]) << std::endl;
             }   // end for
         }   // end if
 
@@ -240,6 +292,20 @@ bool OBJExporter::doSave( const Mesh& mesh, const std::string& fname)
         setErr( "Unable to write OBJ file! : " + err);
         success = false;
     }   // end if
+    else if ( stopped)  // Error already set; don't leave partially written files
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove( fname, ec);
+        if ( !matfile.empty())
+            boost::filesystem::remove( matfile, ec);
+        success = false;
+    }   // end else if
+    else if ( !matfile.empty())
+    {
+        boost::system::error_code ec;
+        const boost::uintmax_t nbytes = boost::filesystem::file_size( matfile, ec);
+        st.bytesWritten += ec ? 0 : size_t(nbytes);
+    }   // end else if
     return success;
 }   // end doSave
 
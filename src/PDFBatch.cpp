@@ -0,0 +1,145 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <PDFBatch.h>
+#include <PDFGenerator.h>
+#include <boost/filesystem/path.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+using r3dio::PDFBatch;
+using r3dio::PDFGenerator;
+using r3dio::LatexWriter;
+
+
+// public
+PDFBatch::PDFBatch( size_t nworkers, bool remGen) : _remGen(remGen), _pending(0), _quit(false)
+{
+    if ( nworkers == 0)
+        nworkers = std::max( 1u, std::thread::hardware_concurrency());
+    PDFGenerator::resolvedProgramPath();   // Search the PATH once up front
+    for ( size_t i = 0; i < nworkers; ++i)
+        _threads.emplace_back( &PDFBatch::_run, this);
+}   // end ctor
+
+
+// public
+PDFBatch::~PDFBatch()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex);
+        _quit = true;
+    }
+    _cv.notify_all();
+    for ( std::thread &t : _threads)
+        t.join();
+}   // end dtor
+
+
+namespace {
+
+PDFBatch::Result generate( const std::string &texfile, const std::string &fmtfile, bool remGen, const r3dio::Config::Ptr &cfg)
+{
+    using Clock = std::chrono::steady_clock;
+    PDFBatch::Result res;
+    PDFGenerator pdfgen( remGen, cfg);
+    pdfgen.setFormat( fmtfile);
+    const Clock::time_point t0 = Clock::now();
+    res.success = pdfgen( texfile);
+    res.seconds = std::chrono::duration<double>( Clock::now() - t0).count();
+    res.exitCode = pdfgen.exitCode();
+    if ( res.success)
+        res.pdffile = boost::filesystem::path( texfile).replace_extension("pdf").string();
+    return res;
+}   // end generate
+
+}   // end namespace
+
+
+// public
+std::future<PDFBatch::Result> PDFBatch::add( const std::string &texfile, const std::string &fmtfile)
+{
+    return add( texfile, fmtfile, r3dio::Config::current());    // As at the time of adding
+}   // end add
+
+
+// public
+std::future<PDFBatch::Result> PDFBatch::add( const std::string &texfile, const std::string &fmtfile, const r3dio::Config::Ptr &c)
+{
+    const bool remGen = _remGen;
+    const r3dio::Config::Ptr cfg = c ? c : r3dio::Config::current();
+    return _add( std::packaged_task<Result()>( [=](){ return generate( texfile, fmtfile, remGen, cfg);}));
+}   // end add
+
+
+// public
+std::future<PDFBatch::Result> PDFBatch::add( const LatexWriter &writer)
+{
+    std::string fmtfile;
+    const std::string texfile = writer.writeTex( fmtfile);
+    if ( texfile.empty())
+    {
+        std::cerr << "[ERROR] r3dio::PDFBatch::add: Unable to write tex file!" << std::endl;
+        std::promise<Result> failed;
+        failed.set_value( Result{ "", -1, 0, false});
+        return failed.get_future();
+    }   // end if
+    return add( texfile, fmtfile, writer.config());
+}   // end add
+
+
+// public
+void PDFBatch::wait()
+{
+    std::unique_lock<std::mutex> lock( _mutex);
+    _cv.wait( lock, [this](){ return _pending == 0;});
+}   // end wait
+
+
+// private
+std::future<PDFBatch::Result> PDFBatch::_add( std::packaged_task<Result()> &&task)
+{
+    std::future<Result> fut = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock( _mutex);
+        _queue.push_back( std::move(task));
+        _pending++;
+    }
+    _cv.notify_all();
+    return fut;
+}   // end _add
+
+
+// private
+void PDFBatch::_run()
+{
+    std::unique_lock<std::mutex> lock( _mutex);
+    while ( true)
+    {
+        _cv.wait( lock, [this](){ return _quit || !_queue.empty();});
+        if ( _queue.empty())
+            break;  // Only quit once the queue is empty
+
+        std::packaged_task<Result()> task = std::move( _queue.front());
+        _queue.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        _pending--;
+        _cv.notify_all();
+    }   // end while
+}   // end _run
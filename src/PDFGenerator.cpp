@@ -16,6 +16,7 @@
  ************************************************************************/
 
 #include <PDFGenerator.h>
+#include <Trace.h>
 #include <U3DExporter.h>
 #include <boost/filesystem/operations.hpp>
 #include <boost/algorithm/string.hpp>
@@ -30,45 +31,43 @@
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+using r3dio::Config;
 using r3dio::PDFGenerator;
 using r3dio::U3DExporter;
 using r3d::Mesh;
 namespace BP = boost::process;
 namespace BFS = boost::filesystem;
 
-std::string PDFGenerator::s_pdflatex( "");  // private static
-const std::string& PDFGenerator::programPath() { return s_pdflatex;}   // public static
+// public static
+std::string PDFGenerator::programPath() { return r3dio::Config::current()->pdflatex();}
+
 
 // public static
 bool PDFGenerator::setProgramPath( const std::string &pprog)
 {
-    s_pdflatex = BFS::path( pprog).string();    // Ensure conversion to path
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setPDFLatex( pprog);});
     return isAvailable();
 }   // end setProgramPath
 
 
 // public static
-bool PDFGenerator::isAvailable()
-{
-    const std::string &pprog = programPath();
-    if ( BFS::exists( pprog))
-        return true;
-    const BFS::path genpath = BP::search_path(pprog);
-    return !genpath.empty();
-}   // end isAvailable
+bool PDFGenerator::isAvailable() { return !resolvedProgramPath().empty();}
+
+
+// public static
+std::string PDFGenerator::resolvedProgramPath() { return r3dio::Config::current()->resolvedPDFLatex();}
 
 
 // public
-PDFGenerator::PDFGenerator( bool remGen) : _remGen(remGen)
-{
-    if ( programPath().empty())
-        setProgramPath( "pdflatex");
-}   // end ctor
+PDFGenerator::PDFGenerator( bool remGen, const Config::Ptr &cfg)
+    : _remGen(remGen), _exitCode(-1), _cfg( cfg ? cfg : Config::current()) {}
 
 
 namespace {
-bool runcmd( const std::string &cmd, const std::string &ppath)
+// Run the command in directory ppath returning its exit code.
+int runcmd( const std::string &cmd, const std::string &ppath)
 {
+    R3DIO_TRACE( "pdflatex");
     BP::ipstream out;
 #ifdef _WIN32
     BP::child c( cmd, BP::std_out > out, BP::windows::hide, BP::start_dir=ppath);
@@ -76,33 +75,104 @@ bool runcmd( const std::string &cmd, const std::string &ppath)
     BP::child c( cmd, BP::std_out > out, BP::start_dir=ppath);
 #endif
     c.wait();
-    return c.exit_code() == 0;
+    return c.exit_code();
 }   // end runcmd
+
+
+// Returns true iff the pdflatex log file asks for another pass to be run
+// (e.g. because cross references, labels or page counts have changed).
+bool logRequestsRerun( const BFS::path &logfile)
+{
+    std::ifstream ifs( logfile.string());
+    std::string ln;
+    while ( std::getline( ifs, ln))
+    {
+        if ( ln.find("Rerun") != std::string::npos
+          || ln.find("Label(s) may have changed") != std::string::npos
+          || ln.find("There were undefined references") != std::string::npos)
+            return true;
+    }   // end while
+    return false;
+}   // end logRequestsRerun
 }   // end namespace
 
 
+// public static
+bool PDFGenerator::makeFormat( const std::string &texfile, const std::string &fmtfile, const Config::Ptr &cfg)
+{
+    const std::string pdflatex = cfg ? cfg->resolvedPDFLatex() : resolvedProgramPath();
+    if ( pdflatex.empty())
+        return false;
+
+    // Dump into a unique directory first so concurrent makers of the same format
+    // never leave a partially written format file in the given location.
+    const BFS::path fpath = fmtfile;
+    const BFS::path tdir = fpath.parent_path() / BFS::unique_path( "%%%%-%%%%-%%%%-%%%%");
+    boost::system::error_code ec;
+    if ( !BFS::create_directories( tdir, ec))
+        return false;
+
+    const std::string jobname = fpath.stem().string();
+    const std::string cmd = "\"" + pdflatex + "\" -ini -interaction batchmode -jobname=\"" + jobname
+                          + "\" \"&pdflatex\" mylatexformat.ltx \"" + texfile + "\"";
+    bool success = false;
+    try
+    {
+        success = runcmd( cmd, tdir.string()) == 0;
+    }   // end try
+    catch ( const std::exception& e)
+    {
+        std::cerr << "[EXCEPTION!] r3dio::PDFGenerator::makeFormat: " << e.what() << std::endl;
+        success = false;
+    }   // end catch
+
+    const BFS::path tfile = tdir / (jobname + ".fmt");
+    if ( success && BFS::exists( tfile, ec))
+    {
+        BFS::rename( tfile, fpath, ec);
+        success = !ec;
+    }   // end if
+    else
+        success = false;
+
+    if ( !success)
+        std::cerr << "[WARNING] r3dio::PDFGenerator::makeFormat: Unable to make format '" << fmtfile << "'" << std::endl;
+    BFS::remove_all( tdir, ec);
+    return success;
+}   // end makeFormat
+
+
 // public
 bool PDFGenerator::operator()( const std::string& texfile, bool remtexfile)
 {
-    if ( !isAvailable())
+    const std::string pdflatex = _cfg->resolvedPDFLatex();
+    if ( pdflatex.empty())
     {
         std::cerr << "[WARNING] r3dio::PDFGenerator: pdflatex not available! PDF generation disabled." << std::endl;
         return false;
     }   // end if
 
+    _exitCode = -1;
     BFS::path tpath = texfile;
     bool success = false;
     std::ostringstream errMsg;
 
     // Get the parent path of the texfile to run pdflatex in.
     const std::string ppath = tpath.parent_path().string();
-    const std::string &pdflatex = programPath();
-    const std::string cmd = "\"" + pdflatex + "\" --shell-escape -interaction batchmode -output-directory \"" + ppath + "\" \"" + texfile + "\"";
+    std::string cmd = "\"" + pdflatex + "\" --shell-escape -interaction batchmode -output-directory \"" + ppath + "\" ";
+    if ( !_fmt.empty())
+        cmd += "-fmt \"" + _fmt + "\" ";
+    cmd += "\"" + texfile + "\"";
     try
     {
-        success = runcmd( cmd, ppath);
-        if ( success)   // Run twice because of the annoyances of pdflatex not being able to work out numbers of pages...
-            success = runcmd( cmd, ppath);
+        // Only run again if the log says it's needed. The first pass can't be run with -draftmode
+        // since that produces no PDF which would then need a further pass when no rerun is asked for.
+        static const int MAX_PASSES = 3;
+        const BFS::path logfile = BFS::path(tpath).replace_extension("log");
+        _exitCode = runcmd( cmd, ppath);
+        for ( int i = 1; _exitCode == 0 && i < MAX_PASSES && logRequestsRerun( logfile); ++i)
+            _exitCode = runcmd( cmd, ppath);
+        success = _exitCode == 0;
     }   // end try
     catch ( const std::exception& e)
     {
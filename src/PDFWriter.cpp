@@ -0,0 +1,623 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <PDFWriter.h>
+#include <Trace.h>
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+using r3dio::PDFWriter;
+using r3dio::Box;
+using r3dio::Point;
+using r3d::Vec3f;
+using Colour = rimg::Colour;
+using Cam = r3d::CameraParams;
+namespace BFS = boost::filesystem;
+
+
+namespace {
+
+const double MM2PT = 72.0 / 25.4;
+const double FONT_SIZE = 10;    // Points (the LaTeX default)
+const double LEADING = 12;      // Distance between baselines
+const double LINE_WIDTH = 0.4;  // As for TikZ
+const double CAPTION_SKIP = 10; // Space between figure and caption
+
+// Widths of Helvetica glyphs for characters 32 to 126 in thousandths of the font size.
+const short HELVETICA[95] = {
+    278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278, 278,
+    556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584, 584, 556,
+   1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833, 722, 778,
+    667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278, 278, 278, 469, 556,
+    333, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833, 556, 556,
+    556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500, 334, 260, 334, 584};
+
+
+// Format a number compactly for PDF content.
+std::string num( double v)
+{
+    char buf[32];
+    std::snprintf( buf, sizeof(buf), "%.3f", v);
+    std::string s = buf;
+    s.erase( s.find_last_not_of('0') + 1);
+    if ( s.back() == '.')
+        s.pop_back();
+    return s == "-0" ? "0" : s;
+}   // end num
+
+
+std::string colour( const Colour &c, const char *op)
+{
+    return num( c.ired()/255.0) + " " + num( c.igreen()/255.0) + " " + num( c.iblue()/255.0) + " " + op + "\n";
+}   // end colour
+
+
+// Convert UTF-8 to WinAnsi (same as Latin-1 above 159) replacing unsupported characters with '?'.
+std::string toWinAnsi( const std::string &s)
+{
+    std::string out;
+    for ( size_t i = 0; i < s.size(); )
+    {
+        const unsigned char c = s[i];
+        unsigned cp = c;
+        size_t n = 1;
+        if ( c >= 0xC0 && c < 0xE0 && i + 1 < s.size())
+        {
+            cp = ((c & 0x1F) << 6) | (s[i+1] & 0x3F);
+            n = 2;
+        }   // end if
+        else if ( c >= 0xE0)
+        {
+            cp = '?';
+            n = c >= 0xF0 ? 4 : 3;
+        }   // end else if
+        out += (cp < 32 && cp != '\n') || (cp > 126 && cp < 160) || cp > 255 ? '?' : char(cp);
+        i += n;
+    }   // end for
+    return out;
+}   // end toWinAnsi
+
+
+double textWidth( const std::string &s)
+{
+    double w = 0;
+    for ( unsigned char c : s)
+        w += c >= 32 && c <= 126 ? HELVETICA[c-32] : 556;
+    return w * FONT_SIZE / 1000;
+}   // end textWidth
+
+
+// Break text (already in WinAnsi) into lines no wider than maxw points (unless single words are wider).
+std::vector<std::string> wrapLines( const std::string &txt, double maxw)
+{
+    std::vector<std::string> lines;
+    std::istringstream paras( txt);
+    std::string para;
+    while ( std::getline( paras, para))
+    {
+        std::istringstream words( para);
+        std::string word, line;
+        while ( words >> word)
+        {
+            const std::string cand = line.empty() ? word : line + " " + word;
+            if ( !line.empty() && textWidth( cand) > maxw)
+            {
+                lines.push_back( line);
+                line = word;
+            }   // end if
+            else
+                line = cand;
+        }   // end while
+        lines.push_back( line);
+    }   // end while
+    return lines;
+}   // end wrapLines
+
+
+std::string escape( const std::string &s)
+{
+    std::string out;
+    for ( char c : s)
+    {
+        if ( c == '(' || c == ')' || c == '\\')
+            out += '\\';
+        out += c;
+    }   // end for
+    return out;
+}   // end escape
+
+
+bool deflate( const std::string &in, std::string &out)
+{
+    uLongf n = compressBound( uLong( in.size()));
+    out.resize( n);
+    if ( compress2( reinterpret_cast<Bytef*>(&out[0]), &n, reinterpret_cast<const Bytef*>(in.data()), uLong( in.size()), 6) != Z_OK)
+        return false;
+    out.resize( n);
+    return true;
+}   // end deflate
+
+
+bool readFile( const std::string &fname, std::string &data)
+{
+    std::ifstream ifs( fname, std::ios::in | std::ios::binary);
+    if ( !ifs)
+        return false;
+    data.assign( std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return !ifs.bad();
+}   // end readFile
+
+
+// An image XObject's data and the dictionary entries describing it.
+struct Image
+{
+    int width, height;
+    std::string dict;   // Colour space, filter etc.
+    std::string data;
+    std::string alpha;  // Compressed soft mask data (if any)
+};  // end struct
+
+
+// Embed JPEG data as is after reading its dimensions and components from the frame header.
+bool readJPEG( const std::string &data, Image &img)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>( data.data());
+    const size_t n = data.size();
+    if ( n < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return false;
+    size_t i = 2;
+    while ( i + 9 < n)
+    {
+        if ( p[i] != 0xFF)
+            return false;
+        const unsigned char m = p[i+1];
+        const size_t len = (size_t(p[i+2]) << 8) | p[i+3];
+        // Start of frame markers (excluding DHT, JPG and DAC which share the range)
+        if ( m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC)
+        {
+            img.height = (p[i+5] << 8) | p[i+6];
+            img.width = (p[i+7] << 8) | p[i+8];
+            const int nc = p[i+9];
+            if ( nc == 1)
+                img.dict = "/ColorSpace /DeviceGray";
+            else if ( nc == 3)
+                img.dict = "/ColorSpace /DeviceRGB";
+            else if ( nc == 4)  // Adobe CMYK JPEGs are stored inverted
+                img.dict = "/ColorSpace /DeviceCMYK /Decode [1 0 1 0 1 0 1 0]";
+            else
+                return false;
+            img.dict += " /BitsPerComponent 8 /Filter /DCTDecode";
+            img.data = data;
+            return true;
+        }   // end if
+        i += 2 + len;
+    }   // end while
+    return false;
+}   // end readJPEG
+
+
+// Load any other image format and embed it compressed losslessly.
+bool readImage( const std::string &fname, Image &img)
+{
+    cv::Mat m = cv::imread( fname, cv::IMREAD_UNCHANGED);
+    if ( m.empty())
+        return false;
+    if ( m.depth() != CV_8U)
+        m.convertTo( m, CV_8U, m.depth() == CV_16U ? 1.0/257 : 1.0);
+
+    cv::Mat alpha;
+    if ( m.channels() == 4)
+    {
+        cv::extractChannel( m, alpha, 3);
+        cv::cvtColor( m, m, cv::COLOR_BGRA2RGB);
+    }   // end if
+    else if ( m.channels() == 3)
+        cv::cvtColor( m, m, cv::COLOR_BGR2RGB);
+    else if ( m.channels() != 1)
+        return false;
+
+    img.width = m.cols;
+    img.height = m.rows;
+    img.dict = std::string("/ColorSpace ") + (m.channels() == 1 ? "/DeviceGray" : "/DeviceRGB")
+             + " /BitsPerComponent 8 /Filter /FlateDecode";
+    if ( !m.isContinuous())
+        m = m.clone();
+    if ( !deflate( std::string( reinterpret_cast<const char*>(m.data), m.total() * m.elemSize()), img.data))
+        return false;
+    if ( !alpha.empty())
+    {
+        if ( !alpha.isContinuous())
+            alpha = alpha.clone();
+        return deflate( std::string( reinterpret_cast<const char*>(alpha.data), alpha.total()), img.alpha);
+    }   // end if
+    return true;
+}   // end readImage
+
+
+// Accumulates numbered objects recording their offsets for the cross reference table.
+class Objects
+{
+public:
+    Objects() { _out = "%PDF-1.6\n%\xE2\xE3\xCF\xD3\n";}
+
+    // Reserve an object number for an object to be written later.
+    int reserve()
+    {
+        _offsets.push_back(0);
+        return int(_offsets.size());
+    }   // end reserve
+
+    int object( const std::string &body) { return object( reserve(), body);}
+    int object( int id, const std::string &body)
+    {
+        _begin( id);
+        _out += body;
+        _out += "\nendobj\n";
+        return id;
+    }   // end object
+
+    int stream( const std::string &dict, const std::string &data) { return stream( reserve(), dict, data);}
+    int stream( int id, const std::string &dict, const std::string &data)
+    {
+        _begin( id);
+        _out += "<< " + dict + " /Length " + std::to_string( data.size()) + " >>\nstream\n";
+        _out += data;
+        _out += "\nendstream\nendobj\n";
+        return id;
+    }   // end stream
+
+    static std::string ref( int id) { return std::to_string(id) + " 0 R";}
+
+    // Finish with the cross reference table and trailer and return the document.
+    const std::string &finish( int root)
+    {
+        const size_t xref = _out.size();
+        _out += "xref\n0 " + std::to_string( _offsets.size() + 1) + "\n0000000000 65535 f \n";
+        char buf[24];
+        for ( size_t off : _offsets)
+        {
+            std::snprintf( buf, sizeof(buf), "%010lu 00000 n \n", static_cast<unsigned long>(off));
+            _out += buf;
+        }   // end for
+        _out += "trailer\n<< /Size " + std::to_string( _offsets.size() + 1) + " /Root " + ref(root) + " >>\n";
+        _out += "startxref\n" + std::to_string( xref) + "\n%%EOF\n";
+        return _out;
+    }   // end finish
+
+private:
+    std::string _out;
+    std::vector<size_t> _offsets;
+
+    void _begin( int id)
+    {
+        _offsets[size_t(id-1)] = _out.size();
+        _out += std::to_string(id) + " 0 obj\n";
+    }   // end _begin
+};  // end class
+
+
+// Camera to world matrix (column major 3x4) of a camera at distance roo from the origin
+// in direction c2c looking at the origin with world up being +Z (as media9 does it).
+std::string c2w( const Vec3f &c2c, float roo)
+{
+    const Vec3f z = -c2c.normalized();  // View direction
+    Vec3f x = z.cross( Vec3f(0,0,1));
+    x = x.norm() < 1e-6f ? Vec3f(1,0,0) : x.normalized();
+    const Vec3f y = z.cross( x);        // Downwards on the screen
+    const Vec3f p = c2c.normalized() * roo;
+    std::ostringstream oss;
+    oss << "[";
+    const Vec3f *cols[4] = { &x, &y, &z, &p};
+    for ( const Vec3f *v : cols)
+        oss << num((*v)[0]) << " " << num((*v)[1]) << " " << num((*v)[2]) << " ";
+    oss << "]";
+    return oss.str();
+}   // end c2w
+
+
+// The views of a 3D annotation as given to media9 by LatexWriter.
+std::string views( float w, float h, const Cam &cam)
+{
+    std::ostringstream proj;
+    if ( cam.isParallel())
+    {
+        float ps = 0.5f / cam.parallelScale();  // Height viewport in world-coordinate units
+        if (w < h)
+            ps *= h/w;
+        proj << "<< /Subtype /O /OS " << num(ps) << " /OB /Min >>";
+    }   // end if
+    else
+    {
+        float aac = cam.fov();  // Vertical FoV
+        if (w < h)  // FoV in the narrowest aspect of the viewport
+        {
+            static const float D2R = float(EIGEN_PI/180);
+            aac = 2*atanf( w/h * tanf(aac/2 * D2R)) / D2R;
+        }   // end if
+        proj << "<< /Subtype /P /FOV " << num(aac) << " /PS /Min >>";
+    }   // end else
+
+    const float roo = cam.distance();
+    const std::pair<const char*, Vec3f> vws[3] = { {"Front", Vec3f( 0,-1, 0)},
+                                                    {"Right", Vec3f(-1, 0, 0)},
+                                                    {"Left",  Vec3f( 1, 0, 0)}};
+    std::string va = "[";
+    for ( const auto &v : vws)
+    {
+        va += std::string("<< /Type /3DView /XN (") + v.first + ") /IN (" + v.first + ") /MS /M"
+            + " /C2W " + c2w( v.second, roo) + " /CO " + num(roo) + " /P " + proj.str()
+            + " /BG << /Type /3DBG /C [1 1 1] >> /LS << /Type /3DLightingScheme /Subtype /None >> >> ";
+    }   // end for
+    return va + "]";
+}   // end views
+
+}   // end namespace
+
+
+struct PDFWriter::Pimpl
+{
+    struct Mesh3D
+    {
+        Box box;
+        std::string u3d;
+        Cam cam;
+        std::string bgname;    // Name of background image XObject (if any)
+    };  // end struct
+
+    struct Page
+    {
+        float wmm, hmm;
+        std::string ops;    // Content stream operators
+        std::vector<Mesh3D> meshes;
+    };  // end struct
+
+    std::vector<Page> pages;
+    std::vector<std::string> imgPaths;  // Image paths in order of their XObject names
+    std::unordered_map<std::string, std::string> imgNames;
+    BFS::path basedir;
+    std::string err;
+
+    Pimpl( float wmm, float hmm) { newPage( wmm, hmm);}
+
+    void newPage( float wmm, float hmm)
+    {
+        if ( !pages.empty() && (wmm <= 0 || hmm <= 0))
+        {
+            wmm = pages.back().wmm;
+            hmm = pages.back().hmm;
+        }   // end if
+        pages.push_back( Page{ wmm, hmm, "", {}});
+    }   // end newPage
+
+    // Convert from millimetres from top left of current page to points from bottom left.
+    double x( float xmm) const { return xmm * MM2PT;}
+    double y( float ymm) const { return (pages.back().hmm - ymm) * MM2PT;}
+
+    // Add text returning its height in points.
+    double addText( const Box &box, const std::string &txt, bool centre, double yoffset=0)
+    {
+        const double bw = box[2] * MM2PT;
+        const std::vector<std::string> lines = wrapLines( toWinAnsi( txt), bw);
+        std::string &ops = pages.back().ops;
+        double base = y( box[1]) - yoffset - FONT_SIZE;
+        for ( const std::string &ln : lines)
+        {
+            const double lx = x( box[0]) + (centre ? std::max( 0.0, (bw - textWidth(ln))/2) : 0);
+            ops += "BT /F1 " + num(FONT_SIZE) + " Tf 0 g " + num(lx) + " " + num(base) + " Td (" + escape(ln) + ") Tj ET\n";
+            base -= LEADING;
+        }   // end for
+        return lines.empty() ? 0 : FONT_SIZE + LEADING * (lines.size() - 1);
+    }   // end addText
+
+    void rectangle( const Box &box, const Colour &col, bool fill)
+    {
+        const std::string rect = num( x(box[0])) + " " + num( y(box[1] + box[3])) + " "
+                               + num( box[2] * MM2PT) + " " + num( box[3] * MM2PT) + " re ";
+        if ( fill)
+            pages.back().ops += "q " + colour( col, "rg") + rect + "f Q\n";
+        else
+            pages.back().ops += "q " + colour( col, "RG") + num(LINE_WIDTH) + " w " + rect + "S Q\n";
+    }   // end rectangle
+
+    void drawLine( const Point &p, const Point &q, const Colour &col)
+    {
+        pages.back().ops += "q " + colour( col, "RG") + num(LINE_WIDTH) + " w "
+                          + num( x(p[0])) + " " + num( y(p[1])) + " m "
+                          + num( x(q[0])) + " " + num( y(q[1])) + " l S Q\n";
+    }   // end drawLine
+
+    const std::string &imageName( const std::string &path)
+    {
+        if ( imgNames.count(path) == 0)
+        {
+            imgNames[path] = "Im" + std::to_string( imgPaths.size());
+            imgPaths.push_back( path);
+        }   // end if
+        return imgNames.at(path);
+    }   // end imageName
+
+    void addImage( const Box &box, const std::string &path, const std::string &caption)
+    {
+        pages.back().ops += "q " + num( box[2] * MM2PT) + " 0 0 " + num( box[3] * MM2PT) + " "
+                          + num( x(box[0])) + " " + num( y(box[1] + box[3])) + " cm /" + imageName(path) + " Do Q\n";
+        if ( !caption.empty())
+            addText( box, caption, true, box[3] * MM2PT + CAPTION_SKIP);
+    }   // end addImage
+
+    void addMesh( const Box &box, const std::string &u3d, const Cam &cam, const std::string &bgimg, const std::string &caption)
+    {
+        pages.back().meshes.push_back( Mesh3D{ box, u3d, cam, bgimg.empty() ? "" : imageName(bgimg)});
+        if ( !caption.empty())
+            addText( box, caption, true, box[3] * MM2PT + CAPTION_SKIP);
+    }   // end addMesh
+
+    std::string resolve( const std::string &path) const
+    {
+        const BFS::path p( path);
+        return p.is_absolute() || basedir.empty() ? path : (basedir / p).string();
+    }   // end resolve
+
+    // Returns the document contents or sets err and returns an empty string.
+    std::string write()
+    {
+        Objects objs;
+        const int catalog = objs.reserve();
+        const int pagesId = objs.reserve();
+        const int font = objs.object( "<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica /Encoding /WinAnsiEncoding >>");
+
+        // Images
+        std::string xobjs;
+        for ( const std::string &path : imgPaths)
+        {
+            const std::string rpath = resolve( path);
+            std::string data;
+            Image img;
+            if ( !readFile( rpath, data) || !(readJPEG( data, img) || readImage( rpath, img)))
+            {
+                err = "Unable to read image '" + rpath + "'";
+                return "";
+            }   // end if
+            std::string dict = "/Type /XObject /Subtype /Image /Width " + std::to_string( img.width)
+                             + " /Height " + std::to_string( img.height) + " " + img.dict;
+            if ( !img.alpha.empty())
+            {
+                const int smask = objs.stream( "/Type /XObject /Subtype /Image /Width " + std::to_string( img.width)
+                                             + " /Height " + std::to_string( img.height)
+                                             + " /ColorSpace /DeviceGray /BitsPerComponent 8 /Filter /FlateDecode", img.alpha);
+                dict += " /SMask " + Objects::ref( smask);
+            }   // end if
+            xobjs += "/" + imgNames.at(path) + " " + Objects::ref( objs.stream( dict, img.data)) + " ";
+        }   // end for
+        const int res = objs.object( "<< /ProcSet [/PDF /Text /ImageB /ImageC] /Font << /F1 " + Objects::ref(font)
+                                   + " >> /XObject << " + xobjs + ">> >>");
+
+        const int js = objs.stream( "", "scene.showOrientationAxes = false;");  // Hide orientation axes
+
+        std::string kids;
+        for ( const Page &page : pages)
+        {
+            const double pw = page.wmm * MM2PT;
+            const double ph = page.hmm * MM2PT;
+
+            std::string annots;
+            for ( const Mesh3D &m : page.meshes)
+            {
+                std::string u3d, zu3d;
+                const std::string rpath = resolve( m.u3d);
+                if ( !readFile( rpath, u3d) || !deflate( u3d, zu3d))
+                {
+                    err = "Unable to read U3D model '" + rpath + "'";
+                    return "";
+                }   // end if
+                const int model = objs.stream( "/Type /3D /Subtype /U3D /Filter /FlateDecode /DV 0 /OnInstantiate "
+                                             + Objects::ref(js) + " /VA " + views( m.box[2], m.box[3], m.cam), zu3d);
+
+                const double w = m.box[2] * MM2PT;
+                const double h = m.box[3] * MM2PT;
+                const std::string bbox = "[0 0 " + num(w) + " " + num(h) + "]";
+                const std::string ap = m.bgname.empty() ? "1 g 0 0 " + num(w) + " " + num(h) + " re f\n"
+                                     : "q " + num(w) + " 0 0 " + num(h) + " 0 0 cm /" + m.bgname + " Do Q\n";
+                const int apId = objs.stream( "/Type /XObject /Subtype /Form /BBox " + bbox + " /Resources " + Objects::ref(res), ap);
+
+                const double x0 = m.box[0] * MM2PT;
+                const double y0 = ph - (m.box[1] + m.box[3]) * MM2PT;
+                annots += Objects::ref( objs.object( "<< /Type /Annot /Subtype /3D /F 4 /Contents (3D model) /Rect ["
+                         + num(x0) + " " + num(y0) + " " + num(x0 + w) + " " + num(y0 + h) + "] /3DD " + Objects::ref(model)
+                         + " /3DV 0 /3DA << /A /PO /D /PC /DIS /I /TB true >> /AP << /N " + Objects::ref(apId) + " >> >>")) + " ";
+            }   // end for
+
+            std::string zops;
+            if ( !deflate( page.ops, zops))
+            {
+                err = "Unable to compress page content";
+                return "";
+            }   // end if
+            const int content = objs.stream( "/Filter /FlateDecode", zops);
+            kids += Objects::ref( objs.object( "<< /Type /Page /Parent " + Objects::ref(pagesId)
+                        + " /MediaBox [0 0 " + num(pw) + " " + num(ph) + "] /Resources " + Objects::ref(res)
+                        + " /Contents " + Objects::ref(content) + (annots.empty() ? "" : " /Annots [" + annots + "]") + " >>")) + " ";
+        }   // end for
+
+        objs.object( pagesId, "<< /Type /Pages /Kids [" + kids + "] /Count " + std::to_string( pages.size()) + " >>");
+        objs.object( catalog, "<< /Type /Catalog /Pages " + Objects::ref(pagesId) + " >>");
+        return objs.finish( catalog);
+    }   // end write
+};  // end struct
+
+
+/********************** INTERFACE FOLLOWS *************************/
+
+PDFWriter::PDFWriter( float w, float h) : _pimpl( new Pimpl( w, h)) {}
+
+PDFWriter::~PDFWriter() { delete _pimpl;}
+
+void PDFWriter::newPage( float w, float h) { _pimpl->newPage( w, h);}
+size_t PDFWriter::numPages() const { return _pimpl->pages.size();}
+void PDFWriter::setBaseDirectory( const std::string &dir) { _pimpl->basedir = dir;}
+void PDFWriter::addText( const Box &box, const std::string &txt, bool cntr) { _pimpl->addText( box, txt, cntr);}
+void PDFWriter::fillRectangle( const Box &box, const Colour &col) { _pimpl->rectangle( box, col, true);}
+void PDFWriter::drawRectangle( const Box &box, const Colour &col) { _pimpl->rectangle( box, col, false);}
+void PDFWriter::drawLine( const Point &p, const Point &q, const Colour &col) { _pimpl->drawLine( p, q, col);}
+const std::string &PDFWriter::err() const { return _pimpl->err;}
+
+void PDFWriter::addImage( const Box &box, const std::string &imgpath, const std::string &caption)
+{
+    _pimpl->addImage( box, imgpath, caption);
+}   // end addImage
+
+void PDFWriter::addMesh( const Box &box, const std::string &u3d, const Cam &cam, const std::string &bgimg, const std::string &caption)
+{
+    _pimpl->addMesh( box, u3d, cam, bgimg, caption);
+}   // end addMesh
+
+
+bool PDFWriter::save( const std::string &pdffile) const
+{
+    _pimpl->err.clear();
+    std::string doc;
+    {
+        R3DIO_TRACE( "PDFWriter: build document");
+        doc = _pimpl->write();
+    }
+    if ( doc.empty())
+    {
+        std::cerr << "[ERROR] r3dio::PDFWriter::save: " << _pimpl->err << std::endl;
+        return false;
+    }   // end if
+
+    std::ofstream ofs;
+    {
+        R3DIO_TRACE( "PDFWriter: write");
+        ofs.open( pdffile, std::ios::out | std::ios::binary);
+        ofs.write( doc.data(), std::streamsize( doc.size()));
+        ofs.close();
+    }
+    if ( !ofs)
+    {
+        _pimpl->err = "Unable to write '" + pdffile + "'";
+        std::cerr << "[ERROR] r3dio::PDFWriter::save: " << _pimpl->err << std::endl;
+        return false;
+    }   // end if
+    return true;
+}   // end save
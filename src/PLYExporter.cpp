@@ -16,6 +16,8 @@
  ************************************************************************/
 
 #include <PLYExporter.h>
+#include <Trace.h>
+#include <boost/filesystem/operations.hpp>
 #include <fstream>
 #include <cassert>
 using r3dio::PLYExporter;
@@ -32,6 +34,7 @@ PLYExporter::PLYExporter() : r3dio::MeshExporter()
 bool PLYExporter::doSave( const Mesh& m, const std::string& fname)
 {
     std::string err;
+    bool stopped = false;
     std::ofstream ofs;
     try
     {
@@ -50,28 +53,30 @@ bool PLYExporter::doSave( const Mesh& m, const std::string& fname)
         ofs << "property list uchar int vertex_index" << std::endl;
         ofs << "end_header" << std::endl;
 
-        const IntSet& vidSet = m.vtxIds();
-        std::vector<int> vids( vidSet.begin(), vidSet.end());
-        std::sort( vids.begin(), vids.end());   // Sort into ascending order for write consistency
-        std::unordered_map<int,int> vvmap;
-        const size_t N = vids.size();
-        for ( size_t i = 0; i < N; ++i)
+        r3dio::IOStats &st = editStats();
+        r3dio::MeshLayout::Ptr lay;
         {
-            const int vid = vids[i];
-            const r3d::Vec3f &v = m.vtx(vid);
+            const r3dio::IOStats::Timer timer( st.convertSeconds);
+            lay = layout( m);
+        }
+        R3DIO_TRACE( "PLYExporter: write");
+        const r3dio::IOStats::Timer timer( st.writeSeconds);
+        const std::vector<int> &vids = lay->vertexIds();
+        const std::vector<int> &fids = lay->faceIds();
+        const size_t N = vids.size() + fids.size();
+        size_t i = 0;
+        for ( ; i < vids.size() && progress( i, N, 0, 1, "Writing vertices"); ++i)
+        {
+            const r3d::Vec3f &v = m.vtx(vids[i]);
             ofs << v[0] << " " << v[1] << " " << v[2] << std::endl;
-            vvmap[vid] = int(i);
         }   // end for
 
-        const IntSet& fidSet = m.faces();
-        std::vector<int> fids( fidSet.begin(), fidSet.end());
-        std::sort( fids.begin(), fids.end());   // Sort into ascending order for write consistency
-        const size_t M = fids.size();
-        for ( size_t i = 0; i < M; ++i)
+        for ( ; i >= vids.size() && i < N && progress( i, N, 0, 1, "Writing faces"); ++i)
         {
-            const int *f = m.fvidxs(fids[i]);
-            ofs << "3 " << vvmap.at(f[0]) << " " << vvmap.at(f[1]) << " " << vvmap.at(f[2]) << std::endl;
+            const int *f = m.fvidxs(fids[i - vids.size()]);
+            ofs << "3 " << lay->vertexIndex(f[0]) << " " << lay->vertexIndex(f[1]) << " " << lay->vertexIndex(f[2]) << std::endl;
         }   // end for
+        stopped = i < N;    // Error already set
 
         ofs.close();
     }   // end try
@@ -83,6 +88,12 @@ bool PLYExporter::doSave( const Mesh& m, const std::string& fname)
     if ( !err.empty())
         setErr( "Unable to write PLY file! : " + err);
 
-    return err.empty();
+    if ( stopped)   // Don't leave a partially written file
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove( fname, ec);
+    }   // end if
+
+    return err.empty() && !stopped;
 }   // end doSave
 
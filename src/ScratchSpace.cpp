@@ -0,0 +1,172 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <ScratchSpace.h>
+#include <boost/filesystem.hpp>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+using r3dio::ScratchSpace;
+namespace BFS = boost::filesystem;
+
+namespace {
+
+std::mutex s_dirMutex;
+std::string s_dir;  // Empty for system temporary directory
+
+
+// Removes files and directories in the order given on a single worker thread
+// that is started on first use and joined (after finishing its queue) on exit.
+class Remover
+{
+public:
+    Remover() : _pending(0), _quit(false) {}
+
+    ~Remover()
+    {
+        {
+            std::lock_guard<std::mutex> lock( _mutex);
+            _quit = true;
+        }
+        _cv.notify_all();
+        if ( _thread.joinable())
+            _thread.join();
+    }   // end dtor
+
+    void add( const std::string &path)
+    {
+        {
+            std::lock_guard<std::mutex> lock( _mutex);
+            if ( !_thread.joinable())
+                _thread = std::thread( &Remover::_run, this);
+            _queue.push( path);
+            _pending++;
+        }
+        _cv.notify_all();
+    }   // end add
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock( _mutex);
+        _cv.wait( lock, [this](){ return _pending == 0;});
+    }   // end wait
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::queue<std::string> _queue;
+    size_t _pending;    // Queued or in progress
+    bool _quit;
+    std::thread _thread;
+
+    void _run()
+    {
+        std::unique_lock<std::mutex> lock( _mutex);
+        while ( true)
+        {
+            _cv.wait( lock, [this](){ return _quit || !_queue.empty();});
+            if ( _queue.empty())
+                break;  // Only quit once the queue is empty
+
+            const std::string path = _queue.front();
+            _queue.pop();
+            lock.unlock();
+            boost::system::error_code ec;
+            BFS::remove_all( path, ec);
+            if ( ec)
+                std::cerr << "[WARNING] r3dio::ScratchSpace::remove: Unable to remove '" << path << "': " << ec.message() << std::endl;
+            lock.lock();
+            _pending--;
+            _cv.notify_all();
+        }   // end while
+    }   // end _run
+};  // end class
+
+
+Remover &remover()
+{
+    static Remover r;
+    return r;
+}   // end remover
+
+}   // end namespace
+
+
+// public static
+void ScratchSpace::setDirectory( const std::string &dir)
+{
+    std::lock_guard<std::mutex> lock( s_dirMutex);
+    s_dir = dir;
+}   // end setDirectory
+
+
+// public static
+bool ScratchSpace::useRAM()
+{
+    boost::system::error_code ec;
+    if ( !BFS::is_directory( "/dev/shm", ec))
+        return false;
+    setDirectory( "/dev/shm");
+    return true;
+}   // end useRAM
+
+
+// public static
+std::string ScratchSpace::directory()
+{
+    {
+        std::lock_guard<std::mutex> lock( s_dirMutex);
+        if ( !s_dir.empty())
+            return s_dir;
+    }
+    return BFS::temp_directory_path().string();
+}   // end directory
+
+
+// public static
+std::string ScratchSpace::makeDirectory()
+{
+    const BFS::path dir = BFS::path( directory()) / BFS::unique_path( "r3dio-%%%%-%%%%-%%%%-%%%%");
+    boost::system::error_code ec;
+    if ( !BFS::create_directories( dir, ec))
+    {
+        std::cerr << "[ERROR] r3dio::ScratchSpace::makeDirectory: Unable to create '" << dir.string() << "'!" << std::endl;
+        return "";
+    }   // end if
+    return dir.string();
+}   // end makeDirectory
+
+
+// public static
+void ScratchSpace::remove( const std::string &path)
+{
+    boost::system::error_code ec;
+    if ( path.empty() || !BFS::exists( path, ec))
+        return;
+    // Rename first (cheap) so the path can be reused immediately without the
+    // pending removal deleting whatever is written there next.
+    BFS::path dpath = path;
+    dpath += BFS::unique_path( ".%%%%-%%%%-%%%%.del");
+    BFS::rename( path, dpath, ec);
+    remover().add( ec ? path : dpath.string());
+}   // end remove
+
+
+// public static
+void ScratchSpace::wait() { remover().wait();}
@@ -17,9 +17,17 @@
 
 #include <TGAImage.h>
 #include <iostream>
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cstdio>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 typedef unsigned char byte;
 
 
@@ -56,15 +64,16 @@ struct TGAHeader
         std::memcpy( &colourmapdepth, &barray[7], 1);
         std::memcpy( &x_origin, &barray[8], 2);
         std::memcpy( &y_origin, &barray[10], 2);
-        std::memcpy( &width, &barray[12], 2);
-        std::memcpy( &height, &barray[14], 2);
+        width = short( barray[12] | (barray[13] << 8));     // TGA is little endian
+        height = short( barray[14] | (barray[15] << 8));
         std::memcpy( &bitsperpixel, &barray[16], 1);
         std::memcpy( &imagedescriptor, &barray[17], 1);
     }   // end setFromArray
 
 
-    TGAHeader( const cv::Mat& m)
-        : idlength(0), colourmaptype(0), datatypecode(m.channels() >= 3 ? 2 : 3),// 2: uncompressed True-color, 3: uncompressed b&w
+    // 2: uncompressed True-color, 3: uncompressed b&w, 10 and 11 for the run length encoded versions.
+    TGAHeader( const cv::Mat& m, bool rle)
+        : idlength(0), colourmaptype(0), datatypecode( byte((m.channels() >= 3 ? 2 : 3) + (rle ? 8 : 0))),
           colourmaporigin(0), colourmaplength(0), colourmapdepth(0),
           x_origin(0), y_origin(0), width(m.cols), height(m.rows),
           bitsperpixel( m.channels() * 8), imagedescriptor(0)
@@ -86,10 +95,189 @@ struct TGAHeader
     TGAHeader() {}
 };  // end struct
 
+
+// Run length encode the row of n pixels each of nc bytes appending to out.
+// Packets never cross rows. Runs of two or more identical pixels are encoded
+// as run packets and everything else as raw packets of up to 128 pixels.
+void encodeRow( const byte* row, int n, int nc, std::vector<byte>& out)
+{
+    int i = 0;
+    while ( i < n)
+    {
+        // Length of run of identical pixels starting at i
+        int j = i + 1;
+        while ( j < n && j - i < 128 && std::memcmp( row + j*nc, row + i*nc, nc) == 0)
+            ++j;
+
+        if ( j - i >= 2)
+        {
+            out.push_back( byte(0x80 | (j - i - 1)));
+            out.insert( out.end(), row + i*nc, row + (i+1)*nc);
+            i = j;
+            continue;
+        }   // end if
+
+        // Raw packet up to the start of the next run
+        j = i + 1;
+        while ( j < n && j - i < 128 && !(j + 1 < n && std::memcmp( row + j*nc, row + (j+1)*nc, nc) == 0))
+            ++j;
+        out.push_back( byte(j - i - 1));
+        out.insert( out.end(), row + i*nc, row + j*nc);
+        i = j;
+    }   // end while
+}   // end encodeRow
+
+
+// Run length encode rows [r0,r1) of m in TGA (bottom to top) order.
+void encodeRows( const cv::Mat& m, int r0, int r1, std::vector<byte>& out)
+{
+    const int nc = m.channels();
+    out.reserve( size_t(r1 - r0) * (m.cols * nc + m.cols / 128 + 1));
+    for ( int r = r0; r < r1; ++r)
+        encodeRow( m.ptr( m.rows - 1 - r), m.cols, nc, out);
+}   // end encodeRows
+
+
+// Run length encode the image in blocks of rows using at most nthreads threads of the context.
+std::vector<std::vector<byte> > encodeRLE( const cv::Mat& m, int nthreads, r3dio::Context &ctx)
+{
+    if ( nthreads <= 0)
+        nthreads = int( ctx.threads());
+    nthreads = std::max( 1, std::min( nthreads, m.rows));
+    std::vector<std::vector<byte> > chunks( nthreads);
+    const int rowsPerThread = (m.rows + nthreads - 1) / nthreads;
+    if ( nthreads == 1)
+        encodeRows( m, 0, m.rows, chunks[0]);
+    else
+    {
+        ctx.parallelFor( size_t(nthreads), [&]( size_t t)
+        {
+            const int r0 = std::min( m.rows, int(t) * rowsPerThread);
+            const int r1 = std::min( m.rows, r0 + rowsPerThread);
+            encodeRows( m, r0, r1, chunks[t]);
+        }, size_t(nthreads));
+    }   // end else
+    return chunks;
+}   // end encodeRLE
+
+
+// The contents of a file either memory mapped or read into a buffer.
+class FileBytes
+{
+public:
+    explicit FileBytes( const std::string& fname) : _data(nullptr), _size(0), _mapped(false)
+    {
+#ifndef _WIN32
+        const int fd = ::open( fname.c_str(), O_RDONLY);
+        if ( fd < 0)
+            return;
+        struct stat st;
+        if ( ::fstat( fd, &st) == 0 && st.st_size > 0)
+        {
+            void* addr = ::mmap( nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if ( addr != MAP_FAILED)
+            {
+                ::madvise( addr, size_t(st.st_size), MADV_SEQUENTIAL);
+                _data = static_cast<const byte*>(addr);
+                _size = size_t(st.st_size);
+                _mapped = true;
+            }   // end if
+        }   // end if
+        ::close( fd);
+        if ( _mapped)
+            return;
+#endif
+        FILE *bstream = std::fopen( fname.c_str(), "rb");
+        if ( !bstream)
+            return;
+        if ( std::fseek( bstream, 0, SEEK_END) == 0)
+        {
+            const long n = std::ftell( bstream);
+            if ( n > 0 && std::fseek( bstream, 0, SEEK_SET) == 0)
+            {
+                _buf.resize( size_t(n));
+                if ( std::fread( _buf.data(), 1, _buf.size(), bstream) == _buf.size())
+                {
+                    _data = _buf.data();
+                    _size = _buf.size();
+                }   // end if
+            }   // end if
+        }   // end if
+        std::fclose( bstream);
+    }   // end ctor
+
+    ~FileBytes()
+    {
+#ifndef _WIN32
+        if ( _mapped)
+            ::munmap( const_cast<byte*>(_data), _size);
+#endif
+    }   // end dtor
+
+    const byte* data() const { return _data;}
+    size_t size() const { return _size;}
+
+private:
+    const byte* _data;
+    size_t _size;
+    bool _mapped;
+    std::vector<byte> _buf;
+    FileBytes( const FileBytes&) = delete;
+    void operator=( const FileBytes&) = delete;
+};  // end class
+
+
+// Decode run length encoded pixels from [p,end) into m in the given row order.
+// Packets are allowed to cross rows. Returns false if the data are truncated.
+bool decodeRLE( const byte* p, const byte* end, cv::Mat& m, bool bottomUp)
+{
+    const int nc = m.channels();
+    const size_t rowBytes = size_t(m.cols) * nc;
+    int row = 0;
+    byte* dst = m.ptr( bottomUp ? m.rows - 1 : 0);
+    size_t left = rowBytes;    // Bytes left in current row
+
+    auto putPixel = [&]( const byte* px)
+    {
+        std::memcpy( dst, px, nc);
+        dst += nc;
+        left -= nc;
+        if ( left == 0 && ++row < m.rows)
+        {
+            dst = m.ptr( bottomUp ? m.rows - 1 - row : row);
+            left = rowBytes;
+        }   // end if
+    };  // end putPixel
+
+    while ( row < m.rows)
+    {
+        if ( p >= end)
+            return false;
+        const byte hdr = *p++;
+        const int count = (hdr & 0x7f) + 1;
+        if ( hdr & 0x80)    // Run packet
+        {
+            if ( end - p < nc)
+                return false;
+            for ( int i = 0; i < count && row < m.rows; ++i)
+                putPixel( p);
+            p += nc;
+        }   // end if
+        else    // Raw packet
+        {
+            if ( end - p < ptrdiff_t(count) * nc)
+                return false;
+            for ( int i = 0; i < count && row < m.rows; ++i, p += nc)
+                putPixel( p);
+        }   // end else
+    }   // end while
+    return true;
+}   // end decodeRLE
+
 }   // end namespace
 
 
-bool r3dio::saveTGA( const cv::Mat& m, const std::string& fname)
+bool r3dio::saveTGA( const cv::Mat& m, const std::string& fname, bool rle, int nthreads, Context *ctx)
 {
     if ( m.depth() != CV_8U)
     {
@@ -111,63 +299,103 @@ bool r3dio::saveTGA( const cv::Mat& m, const std::string& fname)
     }   // end if
 
     // Write the header
-    TGAHeader tga(m);
+    TGAHeader tga( m, rle);
     if ( std::fwrite( tga.barray, 1, 18, bstream) != 18)
     {
         std::cerr << "[ERROR] r3dio::saveTGA: Failed to write TGA header!" << std::endl;
+        std::fclose(bstream);
         return false;
     }   // end if
 
-    // Write the image bytes row by row (BGA order)
-    int bwrote = 0;
-    const int nc = m.cols * m.channels();
-    for ( int i = int(m.rows-1); i >= 0; --i)    // Write bottom to top
-        bwrote += (int)std::fwrite( (void*)m.ptr(i), 1, nc, bstream);
+    size_t bwrote = 0;
+    size_t btotal = 0;
+    if ( rle)
+    {
+        for ( const std::vector<byte>& chunk : encodeRLE( m, nthreads, ctx ? *ctx : *r3dio::Context::global()))
+        {
+            bwrote += std::fwrite( chunk.data(), 1, chunk.size(), bstream);
+            btotal += chunk.size();
+        }   // end for
+    }   // end if
+    else
+    {
+        // Write the image bytes row by row (BGA order)
+        const size_t nc = size_t(m.cols) * m.channels();
+        for ( int i = int(m.rows-1); i >= 0; --i)    // Write bottom to top
+            bwrote += std::fwrite( (void*)m.ptr(i), 1, nc, bstream);
+        btotal = nc * m.rows;
+    }   // end else
 
     // Check all bytes written okay
-    if ( bwrote != int(nc * m.rows))
+    if ( std::fclose(bstream) != 0 || bwrote != btotal)    // flush & close
     {
-        std::cerr << "[ERROR] r3dio::saveTGA: Failed to write all " << (nc * m.rows) << " bytes of the image!" << std::endl;
+        std::cerr << "[ERROR] r3dio::saveTGA: Failed to write all " << btotal << " bytes of the image!" << std::endl;
         return false;
     }   // end if
 
-    std::fclose(bstream);    // flush & close
     return true;
 }   // end saveTGA
 
 
 cv::Mat r3dio::loadTGA( const std::string& fname)
 {
-    cv::Mat m;
-    FILE *bstream = std::fopen( fname.c_str(), "rb");
-    if ( !bstream)
+    const FileBytes fb( fname);
+    if ( !fb.data())
     {
         std::cerr << "[ERROR] r3dio::loadTGA(" << fname << "): Unable to open file for reading!" << std::endl;
-        return m;
+        return cv::Mat();
     }   // end if
 
     // Read the header
     TGAHeader tga;
-    if ( std::fread( tga.barray, 1, 18, bstream) != 18)
+    if ( fb.size() < 18)
     {
         std::cerr << "[ERROR] r3dio::loadTGA: Failed to read TGA header!" << std::endl;
-        return m;
+        return cv::Mat();
     }   // end if
+    std::memcpy( tga.barray, fb.data(), 18);
     tga.setFromArray();
 
-    // Read the image bytes row by row (BGA order)
-    int bread = 0;
-    m = cv::Mat( tga.height, tga.width, CV_8UC(tga.bitsperpixel/8));
-    const int nc = m.cols * m.channels();
-    for ( int i = int(m.rows-1); i >= 0; --i)   // Read bottom to top
-        bread += (int)std::fread( (void*)m.ptr(i), 1, nc, bstream);
+    const int nc = tga.bitsperpixel / 8;
+    const bool isRLE = tga.datatypecode == 10 || tga.datatypecode == 11;
+    const bool isRaw = tga.datatypecode == 2 || tga.datatypecode == 3;
+    if ( tga.colourmaptype != 0 || (!isRLE && !isRaw) || (nc != 1 && nc != 3 && nc != 4))
+    {
+        std::cerr << "[ERROR] r3dio::loadTGA: Unsupported TGA image type!" << std::endl;
+        return cv::Mat();
+    }   // end if
+
+    const int width = tga.width & 0xffff;
+    const int height = tga.height & 0xffff;
+    if ( width == 0 || height == 0)
+    {
+        std::cerr << "[ERROR] r3dio::loadTGA: Image has zero width or height!" << std::endl;
+        return cv::Mat();
+    }   // end if
+    const bool bottomUp = (tga.imagedescriptor & 0x20) == 0;
+    const byte* p = fb.data() + 18 + tga.idlength;
+    const byte* end = fb.data() + fb.size();
+    cv::Mat m( height, width, CV_8UC(nc));
+
+    if ( isRLE)
+    {
+        if ( p > end || !decodeRLE( p, end, m, bottomUp))
+        {
+            std::cerr << "[ERROR] r3dio::loadTGA: Run length encoded image data are truncated!" << std::endl;
+            return cv::Mat();
+        }   // end if
+        return m;
+    }   // end if
 
-    if ( bread != int(nc * m.rows))
+    // Copy the image bytes row by row (BGA order)
+    const size_t rowBytes = size_t(width) * nc;
+    if ( p > end || size_t(end - p) < rowBytes * height)
     {
-        std::cerr << "[ERROR] r3dio::loadTGA: Failed to read all " << (nc * m.rows) << " bytes of the image!" << std::endl;
+        std::cerr << "[ERROR] r3dio::loadTGA: Failed to read all " << (rowBytes * height) << " bytes of the image!" << std::endl;
         return cv::Mat();
     }   // end if
 
-    std::fclose(bstream);
+    for ( int i = 0; i < height; ++i, p += rowBytes)
+        std::memcpy( m.ptr( bottomUp ? height - 1 - i : i), p, rowBytes);
     return m;
 }   // end loadTGA
@@ -0,0 +1,203 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <Trace.h>
+using r3dio::Trace;
+
+#ifdef R3DIO_ENABLE_TRACE
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Event
+{
+    const char *name;
+    Clock::time_point t0, t1;
+};  // end struct
+
+
+// Fixed size block of events. Only the owning thread writes events and it publishes
+// each by incrementing size afterwards so readers never see partially written events.
+struct Chunk
+{
+    static const size_t CAPACITY = 4096;
+    Chunk() : size(0), next(nullptr) {}
+    Event events[CAPACITY];
+    std::atomic<size_t> size;
+    std::atomic<Chunk*> next;
+};  // end struct
+
+
+class ThreadBuffer
+{
+public:
+    explicit ThreadBuffer( int tid) : _tid(tid), _head( new Chunk), _tail(_head) {}
+
+    ~ThreadBuffer()
+    {
+        for ( Chunk *c = _head; c; )
+        {
+            Chunk *n = c->next.load();
+            delete c;
+            c = n;
+        }   // end for
+    }   // end dtor
+
+    int tid() const { return _tid;}
+
+    // Only called by the owning thread.
+    void add( const Event &e)
+    {
+        size_t n = _tail->size.load( std::memory_order_relaxed);
+        if ( n == Chunk::CAPACITY)
+        {
+            Chunk *c = new Chunk;
+            _tail->next.store( c, std::memory_order_release);
+            _tail = c;
+            n = 0;
+        }   // end if
+        _tail->events[n] = e;
+        _tail->size.store( n+1, std::memory_order_release);
+    }   // end add
+
+    // May be called from any thread.
+    template <typename F>
+    void forEach( F &&f) const
+    {
+        for ( const Chunk *c = _head; c; c = c->next.load( std::memory_order_acquire))
+        {
+            const size_t n = c->size.load( std::memory_order_acquire);
+            for ( size_t i = 0; i < n; ++i)
+                f( c->events[i]);
+        }   // end for
+    }   // end forEach
+
+private:
+    const int _tid;
+    Chunk *const _head;
+    Chunk *_tail;
+};  // end class
+
+
+struct Registry
+{
+    std::mutex mutex;   // Guards buffers (but not their contents)
+    std::vector<std::shared_ptr<ThreadBuffer> > buffers;
+};  // end struct
+
+const Clock::time_point s_epoch = Clock::now();    // Span times are written relative to this
+
+Registry &registry()
+{
+    static Registry reg;
+    return reg;
+}   // end registry
+
+
+// Returns the calling thread's buffer, registering it the first time (the only time a lock is taken).
+ThreadBuffer &threadBuffer()
+{
+    thread_local std::shared_ptr<ThreadBuffer> buf;
+    if ( !buf)
+    {
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> lock( reg.mutex);
+        buf = std::make_shared<ThreadBuffer>( int(reg.buffers.size()) + 1);
+        reg.buffers.push_back( buf);
+    }   // end if
+    return *buf;
+}   // end threadBuffer
+
+
+std::vector<std::shared_ptr<ThreadBuffer> > allBuffers()
+{
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock( reg.mutex);
+    return reg.buffers;
+}   // end allBuffers
+
+
+void writeEscaped( std::ostream &os, const char *s)
+{
+    for ( ; *s; ++s)
+    {
+        if ( *s == '"' || *s == '\\')
+            os << '\\';
+        os << *s;
+    }   // end for
+}   // end writeEscaped
+
+}   // end namespace
+
+
+Trace::Span::~Span() { threadBuffer().add( Event{ _name, _t0, Clock::now()});}
+
+
+bool Trace::enabled() { return true;}
+
+
+size_t Trace::numSpans()
+{
+    size_t n = 0;
+    for ( const std::shared_ptr<ThreadBuffer> &buf : allBuffers())
+        buf->forEach( [&n]( const Event&){ n++;});
+    return n;
+}   // end numSpans
+
+
+bool Trace::writeJSON( const std::string &fname)
+{
+    const auto micros = []( const Clock::time_point &t)
+    {
+        return std::chrono::duration<double, std::micro>( t - s_epoch).count();
+    };  // end micros
+
+    std::ofstream ofs( fname);
+    ofs << std::fixed << std::setprecision(3);
+    ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for ( const std::shared_ptr<ThreadBuffer> &buf : allBuffers())
+    {
+        const int tid = buf->tid();
+        buf->forEach( [&]( const Event &e)
+        {
+            ofs << (first ? "\n" : ",\n") << "{\"name\":\"";
+            writeEscaped( ofs, e.name);
+            ofs << "\",\"cat\":\"r3dio\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << micros( e.t0) << ",\"dur\":" << micros( e.t1) - micros( e.t0) << "}";
+            first = false;
+        });
+    }   // end for
+    ofs << "\n]}" << std::endl;
+    ofs.close();
+    return bool(ofs);
+}   // end writeJSON
+
+#else
+
+bool Trace::enabled() { return false;}
+size_t Trace::numSpans() { return 0;}
+bool Trace::writeJSON( const std::string&) { return false;}
+
+#endif
@@ -17,9 +17,18 @@
 
 #include <U3DExporter.h>
 #include <IDTFExporter.h>
+#include <U3DWriter.h>
+#include <ScratchSpace.h>
+#include <Trace.h>
+#include <IOHelpers.h>
+#include <algorithm>
+#include <chrono>
 #include <cassert>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
 #include <cstdlib>
 #include <cstdio>
 #include <boost/filesystem/operations.hpp>
@@ -29,65 +38,92 @@
 #include <boost/process.hpp>    // Requires at least boost 1.64+
 using r3dio::IDTFExporter;
 using r3dio::U3DExporter;
+using r3dio::U3DWriter;
+using r3dio::ScratchSpace;
+using r3dio::U3DQuality;
 using r3d::Mesh;
 using Colour = rimg::Colour;
 namespace bp = boost::process;
 
 
-std::string U3DExporter::IDTFConverter( "IDTFConverter"); // public static
+// public static
+void U3DExporter::setIDTFConverter( const std::string &p)
+{
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setIDTFConverter( p);});
+}   // end setIDTFConverter
+
+
+// public static
+std::string U3DExporter::idtfConverter() { return r3dio::Config::current()->idtfConverter();}
+
+
+// public static
+bool U3DExporter::isAvailable() { return !r3dio::Config::current()->resolvedIDTFConverter().empty();}
 
 
 // public static
-bool U3DExporter::isAvailable()
+void U3DExporter::setCacheDirectory( const std::string &dir)
 {
-    if ( boost::filesystem::exists( IDTFConverter))
-        return true;
-    const boost::filesystem::path exepath = bp::search_path( IDTFConverter);
-    return !exepath.empty();
-}   // end isAvailable
+    r3dio::Config::update( [&]( r3dio::Config &cfg){ cfg.setU3DCacheDirectory( dir);});
+}   // end setCacheDirectory
+
+
+// public static
+std::string U3DExporter::cacheDirectory() { return r3dio::Config::current()->u3dCacheDirectory();}
 
 
 // public
-U3DExporter::U3DExporter( bool delOnDestroy, bool m9, const Colour &ems)
-    : r3dio::MeshExporter(), _delOnDestroy(delOnDestroy), _media9(m9), _ems(ems)
+U3DExporter::U3DExporter( bool delOnDestroy, bool m9, const Colour &ems, const r3dio::Config::Ptr &cfg)
+    : r3dio::MeshExporter(), _delOnDestroy(delOnDestroy), _media9(m9), _ems(ems), _useNative(false),
+      _cfg( cfg ? cfg : r3dio::Config::current())
 {
-    if ( IDTFConverter.empty())
-        IDTFConverter = "IDTFConverter";
-
-    if ( isAvailable())
-        addSupported( "u3d", "Universal 3D");
-    else
-        std::cerr << "[WARNING] r3dio::U3DExporter: U3D export disabled; IDTFConverter not found on PATH!" << std::endl;
+    addSupported( "u3d", "Universal 3D");
+#ifndef NDEBUG
+    if ( _cfg->resolvedIDTFConverter().empty())
+        std::cerr << "[INFO] r3dio::U3DExporter: IDTFConverter not found on PATH; using native U3D writer." << std::endl;
+#endif
 }   // end ctor
 
 
 namespace {
 
-bool runcmd( const std::string &cmd)
+// Run the given command polling ctrl so that the process can be killed if stopped.
+bool runcmd( const std::string &cmd, const r3dio::IOControl &ctrl)
 {
+    R3DIO_TRACE( "IDTFConverter");
     bp::ipstream out;
 #ifdef _WIN32
     bp::child c( cmd, bp::std_out > out, bp::windows::hide);
 #else
     bp::child c( cmd, bp::std_out > out);
 #endif
-    c.wait();
+    while ( !c.wait_for( std::chrono::milliseconds(100)))
+    {
+        if ( ctrl.stopped())
+        {
+            c.terminate();
+            return false;
+        }   // end if
+    }   // end while
     return c.exit_code() == 0;
 }   // end runcmd
 
 
-bool convertIDTF2U3D( const std::string& idtffile, const std::string& u3dfile)
+// The time spent waiting on IDTFConverter is added to the process time of st.
+bool convertIDTF2U3D( const std::string &prog, const std::string& idtffile, const std::string& u3dfile, const U3DQuality &q,
+                      const r3dio::IOControl &ctrl, r3dio::IOStats &st)
 {
     // -debuglevel 0    No debug dump
-    // -pq 1000         Position quality MAX
-    // -tcq 1000        Texture coordinates quality MAX
-    // -gq 1000         Geometry quality MAX
-    // -tq 100          Texture quality MAX
+    // -pq              Position quality [0,1000]
+    // -tcq             Texture coordinates quality [0,1000]
+    // -gq              Geometry quality [0,1000]
+    // -tq              Texture quality [0,100]
     // -en 1            Enable normals exclusion 
     // -eo 65535        Export everything
-    static const std::string PARAMS = " -debuglevel 0 -pq 1000 -tcq 1000 -gq 1000 -tq 100 -en 1 -eo 65535 ";
     std::ostringstream cmd;
-    cmd << "\"" << U3DExporter::IDTFConverter << "\"" << PARAMS
+    cmd << "\"" << prog << "\" -debuglevel 0"
+        << " -pq " << q.position << " -tcq " << q.texCoord << " -gq " << q.geometry << " -tq " << q.texture
+        << " -en 1 -eo 65535 "
         << "-input \"" << idtffile << "\" -output \"" << u3dfile << "\"";
     /*
 #ifdef _WIN32
@@ -100,7 +136,8 @@ bool convertIDTF2U3D( const std::string& idtffile, const std::string& u3dfile)
     bool success = false;
     try
     {
-        success = runcmd( cmd.str());
+        const r3dio::IOStats::Timer timer( st.processSeconds);
+        success = runcmd( cmd.str(), ctrl);
         //success = std::system( pexe.c_str()) == 0;
     }   // end try
     catch ( const std::exception& e)
@@ -112,30 +149,233 @@ bool convertIDTF2U3D( const std::string& idtffile, const std::string& u3dfile)
 
     return success;
 }   // end convertIDTF2U3D
+
+
+// 64 bit hashing taking in eight bytes at a time. Each word is put through the MurmurHash3
+// finalizer before being combined so that every input bit affects every bit of the hash
+// (combining raw words FNV style leaves the top bit of each word only ever reaching the top
+// bit of the hash, so e.g. meshes mirrored in a coordinate plane could collide).
+class Hasher
+{
+public:
+    Hasher() : _h(14695981039346656037ULL), _n(0) {}
+
+    void bytes( const void *data, size_t n)
+    {
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        uint64_t w;
+        for ( ; n >= 8; n -= 8, p += 8)
+        {
+            std::memcpy( &w, p, 8);
+            _mix(w);
+        }   // end for
+        if ( n > 0)
+        {
+            w = 0;
+            std::memcpy( &w, p, n);
+            _mix( w ^ (uint64_t(n) << 56));    // Tail length distinguishes zero padding
+        }   // end if
+    }   // end bytes
+
+    template <typename T> void value( const T &v) { bytes( &v, sizeof(T));}
+
+    uint64_t hash() const { return fmix( _h ^ _n);}
+
+private:
+    uint64_t _h;
+    uint64_t _n;    // Number of words mixed in
+
+    static uint64_t fmix( uint64_t k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }   // end fmix
+
+    void _mix( uint64_t w)
+    {
+        _h = (_h ^ fmix(w)) * 1099511628211ULL;
+        _h = (_h << 31) | (_h >> 33);   // Rotate so the high bits feed the next multiply
+        _n++;
+    }   // end _mix
+};  // end class
+
+
+void hashTexture( Hasher &h, const cv::Mat &img)
+{
+    h.value( img.rows);
+    h.value( img.cols);
+    h.value( img.type());
+    const size_t rowBytes = img.cols * img.elemSize();
+    for ( int i = 0; i < img.rows; ++i)
+        h.bytes( img.ptr(i), rowBytes);
+}   // end hashTexture
+
+
+// Hash the mesh content (independent of the IDs used) and the export parameters.
+uint64_t hashContent( const Mesh &mesh, bool media9, const Colour &ems, const U3DQuality &q, bool native)
+{
+    Hasher h;
+    h.value( media9);
+    h.value( native);
+    for ( int i = 0; i < 3; ++i)
+        h.value( ems[i]);
+    h.value( q.position);
+    h.value( q.texCoord);
+    h.value( q.geometry);
+    h.value( q.texture);
+    h.value( q.maxBytes);
+
+    // Materials by ascending ID and the position of each material in this order.
+    std::vector<int> mids( mesh.materialIds().begin(), mesh.materialIds().end());
+    std::sort( mids.begin(), mids.end());
+    std::unordered_map<int,int> mpos;
+    h.value( mids.size());
+    for ( size_t k = 0; k < mids.size(); ++k)
+    {
+        mpos[mids[k]] = int(k);
+        hashTexture( h, mesh.texture( mids[k]));
+    }   // end for
+
+    std::vector<int> fids( mesh.faces().begin(), mesh.faces().end());
+    std::sort( fids.begin(), fids.end());
+    h.value( fids.size());
+    for ( int fid : fids)
+    {
+        const int* vidxs = mesh.fvidxs(fid);
+        for ( int i = 0; i < 3; ++i)
+            h.bytes( mesh.vtx(vidxs[i]).data(), 3*sizeof(float));
+        const int mid = mesh.faceMaterialId(fid);
+        h.value( mid >= 0 ? mpos.at(mid) : -1);
+        if ( mid >= 0)
+        {
+            const int* uvids = mesh.faceUVs(fid);
+            for ( int i = 0; i < 3; ++i)
+                h.bytes( mesh.uv( mid, uvids[i]).data(), 2*sizeof(float));
+        }   // end if
+    }   // end for
+
+    return h.hash();
+}   // end hashContent
+
+
+// Clone (or copy if unable to) src to dst replacing dst if it exists. Never hard linked since
+// the output and the cache entry must not share an inode; rewriting the output in place (as
+// U3DWriter and IDTFConverter do) would otherwise also change the cached file.
+bool cloneOrCopy( const boost::filesystem::path &src, const boost::filesystem::path &dst)
+{
+    boost::system::error_code ec;
+    boost::filesystem::remove( dst, ec);
+    return r3dio::copyFile( src.string(), dst.string());
+}   // end cloneOrCopy
+
 }   // end namespace
 
 
 // protected
 bool U3DExporter::doSave( const Mesh& mesh, const std::string& filename)
 {
-    static const std::string istr = "[INFO] r3dio::U3DExporter::doSave: ";
-    static const std::string wstr = "[WARNING] r3dio::U3DExporter::doSave: ";
+    using Path = boost::filesystem::path;
+    const std::string &cdir = _cfg->u3dCacheDirectory();
+    if ( cdir.empty())
+        return _save( mesh, filename);
+
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0')
+        << hashContent( mesh, _media9, _ems, _quality, useNative()) << ".u3d";
+    const Path cpath = Path(cdir) / oss.str();
+
+    boost::system::error_code ec;
+    if ( boost::filesystem::exists( cpath, ec) && cloneOrCopy( cpath, filename))
+        return true;
+
+    if ( !_save( mesh, filename))
+        return false;
+
+    // Copy to a temporary name in the cache directory first so other processes
+    // sharing the cache never see a partially written file.
+    boost::filesystem::create_directories( cdir, ec);
+    const Path tpath = Path(cdir) / boost::filesystem::unique_path( "%%%%-%%%%-%%%%-%%%%.tmp");
+    if ( r3dio::copyFile( filename, tpath.string()))
+        boost::filesystem::rename( tpath, cpath, ec);
+    else
+        ec = boost::system::errc::make_error_code( boost::system::errc::io_error);
+    if ( ec)
+    {
+        boost::filesystem::remove( tpath, ec);
+        std::cerr << "[WARNING] r3dio::U3DExporter::doSave: Unable to cache " << filename << std::endl;
+    }   // end if
+    return true;
+}   // end doSave
+
+
+// private
+bool U3DExporter::_save( const Mesh& mesh, const std::string& filename)
+{
+    static const std::string istr = "[INFO] r3dio::U3DExporter::_save: ";
+    static const std::string wstr = "[WARNING] r3dio::U3DExporter::_save: ";
     bool savedOkay = true;
 
-    // First save to intermediate IDTF format.
-    IDTFExporter idtfExporter( _delOnDestroy, _media9, _ems);
-    const std::string idtffile = boost::filesystem::path(filename).replace_extension("idtf").string();
-    if ( !idtfExporter.save( mesh, idtffile))
+    if ( useNative())
+    {
+        U3DWriter writer( _media9, _ems, _quality);
+        writer.setContext( context());
+        writer.setControl( control());
+        savedOkay = writer.save( mesh, filename);
+        editStats().addTimes( writer.stats());
+        editStats().textures += writer.stats().textures;
+        if ( !savedOkay)
+        {
+            setErr( writer.err());
+            std::cerr << wstr << err() << std::endl;
+        }   // end if
+        return savedOkay;
+    }   // end if
+
+    // First save to intermediate IDTF format. If the intermediates are to be deleted, they
+    // are written to scratch space, otherwise they are retained alongside the U3D file.
+    using Path = boost::filesystem::path;
+    std::string sdir;
+    if ( _delOnDestroy)
+        sdir = context()->makeScratchDirectory();
+    Path ipath = Path(filename).replace_extension("idtf");
+    if ( !sdir.empty())
+        ipath = Path(sdir) / ipath.filename();
+    const std::string idtffile = ipath.string();
+
+    IDTFExporter idtfExporter( _delOnDestroy && sdir.empty(), _media9, _ems);
+    idtfExporter.setWriteNormals( false);   // IDTFConverter is run with normals exclusion
+    idtfExporter.setTextureScale( u3dTextureScale( mesh, _quality));
+    idtfExporter.setContext( context());
+    IOControl ictrl = control();   // Writing the IDTF is the first half
+    const IOControl &ctrl = control();
+    ictrl.progress = [&ctrl]( float f, const std::string &stage){ if ( ctrl.progress) ctrl.progress( 0.5f*f, stage);};
+    idtfExporter.setControl( ictrl);
+    const bool idtfSaved = idtfExporter.save( mesh, idtffile);
+    IOStats &st = editStats();
+    st.addTimes( idtfExporter.stats());
+    st.textures += idtfExporter.stats().textures;
+    if ( !idtfSaved)
     {   
         setErr( idtfExporter.err());
         savedOkay = false;
     }   // end if
-    else if ( !convertIDTF2U3D( idtffile, filename))
+    else if ( !progress( 0.5f, "Converting IDTF to U3D"))
+        savedOkay = false;
+    else if ( !convertIDTF2U3D( _cfg->resolvedIDTFConverter(), idtffile, filename, _quality, ctrl, st))
     {
-        setErr("Unable to convert from IDTF format to U3D format!");
+        if ( ctrl.stopped())
+            setErr("Stopped while converting from IDTF format to U3D format!");
+        else
+            setErr("Unable to convert from IDTF format to U3D format!");
         savedOkay = false;
     }   // end if
 
+    ScratchSpace::remove( sdir);
+
     if ( !savedOkay)
         std::cerr << wstr << err() << std::endl;
 #ifndef NDEBUG
@@ -144,4 +384,4 @@ bool U3DExporter::doSave( const Mesh& mesh, const std::string& filename)
 #endif
 
     return savedOkay;
-}   // end doSave
+}   // end _save
@@ -0,0 +1,718 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+#include <U3DWriter.h>
+#include <Trace.h>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+using r3dio::U3DWriter;
+using r3dio::U3DQuality;
+using r3d::Mesh;
+using r3d::Vec3f;
+using r3d::Vec2f;
+using rimg::Colour;
+
+
+// public
+U3DWriter::U3DWriter( bool m9, const Colour &ems, const U3DQuality &q)
+    : r3dio::MeshExporter(), _media9(m9), _ems(ems), _quality(q)
+{
+    addSupported( "u3d", "Universal 3D");
+}   // end ctor
+
+
+namespace {
+
+using byte = unsigned char;
+
+// Block types (ECMA-363)
+const uint32_t FILE_HEADER                  = 0x00443355;
+const uint32_t MODIFIER_CHAIN               = 0xFFFFFF14;
+const uint32_t MODEL_NODE                   = 0xFFFFFF22;
+const uint32_t CLOD_MESH_DECLARATION        = 0xFFFFFF31;
+const uint32_t CLOD_BASE_MESH_CONTINUATION  = 0xFFFFFF3B;
+const uint32_t SHADING_MODIFIER             = 0xFFFFFF45;
+const uint32_t LIT_TEXTURE_SHADER           = 0xFFFFFF53;
+const uint32_t MATERIAL_RESOURCE            = 0xFFFFFF54;
+const uint32_t TEXTURE_DECLARATION          = 0xFFFFFF55;
+const uint32_t TEXTURE_CONTINUATION         = 0xFFFFFF5C;
+
+// Modifier chain types
+const uint32_t NODE_CHAIN                   = 0;
+const uint32_t MODEL_RESOURCE_CHAIN         = 1;
+const uint32_t TEXTURE_RESOURCE_CHAIN       = 2;
+
+// In no compression mode, the compressed read/write functions are replaced with their
+// uncompressed equivalents so all values are stored as plain little endian bytes.
+const uint32_t PROFILE_NO_COMPRESSION       = 0x00000004;
+const uint32_t CHARSET_UTF8                 = 106;
+
+const uint32_t EXCLUDE_NORMALS              = 0x00000001;
+const uint32_t SHADING_MESH                 = 0x00000001;
+const uint32_t LIGHTING_ENABLED             = 0x00000001;
+const uint32_t ALPHA_TEST_ALWAYS            = 0x00000617;
+const uint32_t FB_ALPHA_BLEND               = 0x00000606;
+const uint32_t ALL_MATERIAL_ATTRIBUTES      = 0x0000003F;
+const uint32_t VISIBLE_FRONT_AND_BACK       = 0x00000003;
+
+
+class Block
+{
+public:
+    explicit Block( uint32_t type) : _type(type) {}
+
+    void u8( byte v) { _data.push_back(v);}
+
+    void u16( uint16_t v)
+    {
+        _data.push_back( byte(v & 0xff));
+        _data.push_back( byte(v >> 8));
+    }   // end u16
+
+    void u32( uint32_t v)
+    {
+        for ( int i = 0; i < 4; ++i, v >>= 8)
+            _data.push_back( byte(v & 0xff));
+    }   // end u32
+
+    void u64( uint64_t v)
+    {
+        for ( int i = 0; i < 8; ++i, v >>= 8)
+            _data.push_back( byte(v & 0xff));
+    }   // end u64
+
+    void f32( float v)
+    {
+        uint32_t b;
+        std::memcpy( &b, &v, 4);
+        u32(b);
+    }   // end f32
+
+    void str( const std::string &s)
+    {
+        u16( uint16_t(s.size()));
+        bytes( s.data(), s.size());
+    }   // end str
+
+    void bytes( const void *p, size_t n)
+    {
+        const byte *b = static_cast<const byte*>(p);
+        _data.insert( _data.end(), b, b + n);
+    }   // end bytes
+
+    // Write the 4x4 identity matrix.
+    void identity()
+    {
+        for ( int i = 0; i < 16; ++i)
+            f32( i % 5 == 0 ? 1.0f : 0.0f);
+    }   // end identity
+
+    // Pad the data to the next four byte boundary.
+    void align()
+    {
+        while ( _data.size() % 4 != 0)
+            _data.push_back(0);
+    }   // end align
+
+    // Nest a complete block inside this one (for modifier chains).
+    void block( const Block &b) { b.appendTo( _data);}
+
+    // Size in bytes of the complete block (header, padded data, and empty meta data).
+    size_t size() const { return 12 + ((_data.size() + 3) & ~size_t(3));}
+
+    // Append the complete block to out.
+    void appendTo( std::vector<byte> &out) const
+    {
+        Block hdr(0);
+        hdr.u32( _type);
+        hdr.u32( uint32_t(_data.size()));
+        hdr.u32( 0);    // No meta data
+        out.insert( out.end(), hdr._data.begin(), hdr._data.end());
+        out.insert( out.end(), _data.begin(), _data.end());
+        out.resize( out.size() + (size() - 12 - _data.size()), 0);
+    }   // end appendTo
+
+private:
+    uint32_t _type;
+    std::vector<byte> _data;
+};  // end class
+
+
+Block modifierChain( const std::string &name, uint32_t chainType, const std::vector<const Block*> &mods)
+{
+    Block b( MODIFIER_CHAIN);
+    b.str( name);
+    b.u32( chainType);
+    b.u32( 0);  // No bounding sphere or bounding box
+    b.align();
+    b.u32( uint32_t(mods.size()));
+    for ( const Block *m : mods)
+        b.block( *m);
+    return b;
+}   // end modifierChain
+
+
+// Returns the quantization step for values spanning extent at the given quality in [0,1000].
+float quantStep( int quality, int minBits, int maxBits, float extent)
+{
+    quality = std::max( 0, std::min( 1000, quality));
+    const int bits = minBits + (maxBits - minBits) * quality / 1000;
+    return extent / float(1 << bits);
+}   // end quantStep
+
+
+inline float quantize( float v, float step) { return std::round( v / step) * step;}
+
+
+// Returns the seconds since t and sets t to now.
+double lapSeconds( r3dio::IOStats::Clock::time_point &t)
+{
+    const r3dio::IOStats::Clock::time_point now = r3dio::IOStats::Clock::now();
+    const double secs = std::chrono::duration<double>( now - t).count();
+    t = now;
+    return secs;
+}   // end lapSeconds
+
+
+// Repeatable ordering of the mesh faces, positions, and texture coordinates for writing.
+// There is one shading per material (in ascending order of material ID) followed by an
+// untextured shading for faces not associated with any material (if there are any).
+struct U3DLayout
+{
+    explicit U3DLayout( const Mesh &mesh) : untextured(false)
+    {
+        const IntSet &mids = mesh.materialIds();
+        matIds.assign( mids.begin(), mids.end());
+        std::sort( matIds.begin(), matIds.end());
+        for ( size_t s = 0; s < matIds.size(); ++s)
+        {
+            const int mid = matIds[s];
+            const IntSet &mfids = mesh.materialFaceIds( mid);
+            const size_t i0 = fids.size();
+            fids.insert( fids.end(), mfids.begin(), mfids.end());
+            std::sort( fids.begin() + i0, fids.end());
+            shadings.resize( fids.size(), uint32_t(s));
+        }   // end for
+
+        std::vector<int> rfids;
+        for ( int fid : mesh.faces())
+            if ( mesh.faceMaterialId(fid) < 0)
+                rfids.push_back(fid);
+        if ( !rfids.empty())
+        {
+            untextured = true;
+            std::sort( rfids.begin(), rfids.end());
+            fids.insert( fids.end(), rfids.begin(), rfids.end());
+            shadings.resize( fids.size(), uint32_t(matIds.size()));
+        }   // end if
+
+        for ( size_t i = 0; i < fids.size(); ++i)
+        {
+            const int fid = fids[i];
+            const int *fvids = mesh.fvidxs(fid);
+            for ( int k = 0; k < 3; ++k)
+            {
+                if ( vmap.count( fvids[k]) == 0)
+                {
+                    vmap[fvids[k]] = uint32_t(vids.size());
+                    vids.push_back( fvids[k]);
+                }   // end if
+            }   // end for
+
+            const int mid = mesh.faceMaterialId(fid);
+            if ( mid < 0)
+                continue;
+
+            const int *uvids = mesh.faceUVs(fid);
+            for ( int k = 0; k < 3; ++k)
+            {
+                const uint64_t key = uvKey( mid, uvids[k]);
+                if ( uvmap.count( key) == 0)
+                {
+                    uvmap[key] = uint32_t(uvs.size());
+                    uvs.push_back( &mesh.uv( mid, uvids[k]));
+                }   // end if
+            }   // end for
+        }   // end for
+    }   // end ctor
+
+    static uint64_t uvKey( int mid, int uvid) { return (uint64_t(uint32_t(mid)) << 32) | uint32_t(uvid);}
+
+    size_t numShadings() const { return matIds.size() + (untextured ? 1 : 0);}
+
+    std::vector<int> matIds;                        // Material for each textured shading
+    bool untextured;                                // True iff there's a final untextured shading
+    std::vector<int> fids;                          // Face IDs ordered by shading
+    std::vector<uint32_t> shadings;                 // Shading ID of each face in fids
+    std::vector<int> vids;                          // Vertex IDs in position list order
+    std::unordered_map<int, uint32_t> vmap;         // Vertex ID --> position list index
+    std::vector<const Vec2f*> uvs;                  // Texture coordinates in list order
+    std::unordered_map<uint64_t, uint32_t> uvmap;   // uvKey --> texture coordinate list index
+};  // end struct
+
+
+std::string shaderName( size_t i)
+{
+    std::ostringstream oss;
+    oss << "Shader" << i;
+    return oss.str();
+}   // end shaderName
+
+
+std::string textureName( size_t i)
+{
+    std::ostringstream oss;
+    oss << "Texture" << i;
+    return oss.str();
+}   // end textureName
+
+
+Block modelNode( const std::string &name)
+{
+    Block b( MODEL_NODE);
+    b.str( name);
+    b.u32( 1);      // Parent count
+    b.str( "");     // World is the parent
+    b.identity();   // Parent transform
+    b.str( name);   // Model resource name
+    b.u32( VISIBLE_FRONT_AND_BACK);
+    return b;
+}   // end modelNode
+
+
+Block shadingModifier( const std::string &name, size_t nShadings)
+{
+    Block b( SHADING_MODIFIER);
+    b.str( name);
+    b.u32( 1);  // Chain index (follows the model node)
+    b.u32( SHADING_MESH);
+    b.u32( uint32_t(nShadings));
+    for ( size_t i = 0; i < nShadings; ++i)
+    {
+        b.u32( 1);  // Shader count
+        b.str( shaderName(i));
+    }   // end for
+    return b;
+}   // end shadingModifier
+
+
+Block meshDeclaration( const std::string &name, const U3DLayout &ml, const U3DQuality &q, const float iq[3])
+{
+    Block b( CLOD_MESH_DECLARATION);
+    b.str( name);
+    b.u32( 0);  // Chain index
+    // Max mesh description
+    b.u32( EXCLUDE_NORMALS);
+    b.u32( uint32_t(ml.fids.size()));
+    b.u32( uint32_t(ml.vids.size()));
+    b.u32( 0);  // Normal count
+    b.u32( 0);  // Diffuse colour count
+    b.u32( 0);  // Specular colour count
+    b.u32( uint32_t(ml.uvs.size()));
+    b.u32( uint32_t(ml.numShadings()));
+    for ( size_t i = 0; i < ml.numShadings(); ++i)
+    {
+        b.u32( 0);  // Shading attributes (no vertex colours)
+        if ( i < ml.matIds.size())
+        {
+            b.u32( 1);  // Texture layer count
+            b.u32( 2);  // Texture coordinate dimensions
+        }   // end if
+        else
+            b.u32( 0);  // Untextured
+        b.u32( uint32_t(i));    // Original shading ID
+    }   // end for
+    // CLOD description (everything is in the base mesh)
+    b.u32( uint32_t(ml.vids.size()));
+    b.u32( uint32_t(ml.vids.size()));
+    // Resource description
+    b.u32( uint32_t(q.position));
+    b.u32( uint32_t(q.geometry));
+    b.u32( uint32_t(q.texCoord));
+    b.f32( iq[0]);  // Position inverse quant
+    b.f32( iq[1]);  // Normal inverse quant
+    b.f32( iq[2]);  // Texture coordinate inverse quant
+    b.f32( 1.0f);   // Diffuse colour inverse quant
+    b.f32( 1.0f);   // Specular colour inverse quant
+    b.f32( 0.9f);   // Normal crease parameter
+    b.f32( 0.5f);   // Normal update parameter
+    b.f32( 0.985f); // Normal tolerance parameter
+    b.u32( 0);      // Bone count
+    return b;
+}   // end meshDeclaration
+
+
+Block baseMesh( const std::string &name, const Mesh &mesh, const U3DLayout &ml, bool media9, const U3DQuality &q, const float iq[3])
+{
+    Block b( CLOD_BASE_MESH_CONTINUATION);
+    b.str( name);
+    b.u32( 0);  // Chain index
+    b.u32( uint32_t(ml.fids.size()));
+    b.u32( uint32_t(ml.vids.size()));
+    b.u32( 0);  // Normal count
+    b.u32( 0);  // Diffuse colour count
+    b.u32( 0);  // Specular colour count
+    b.u32( uint32_t(ml.uvs.size()));
+
+    const bool qpos = q.position < 1000;
+    for ( int vid : ml.vids)
+    {
+        Vec3f v = mesh.vtx(vid);
+        if ( media9)
+            v = Vec3f( v[0], -v[2], v[1]);
+        for ( int i = 0; i < 3; ++i)
+            b.f32( qpos ? quantize( v[i], iq[0]) : v[i]);
+    }   // end for
+
+    const bool quv = q.texCoord < 1000;
+    for ( const Vec2f *uv : ml.uvs)
+    {
+        b.f32( quv ? quantize( (*uv)[0], iq[2]) : (*uv)[0]);
+        b.f32( quv ? quantize( (*uv)[1], iq[2]) : (*uv)[1]);
+        b.f32( 0);
+        b.f32( 0);
+    }   // end for
+
+    for ( size_t i = 0; i < ml.fids.size(); ++i)
+    {
+        const int fid = ml.fids[i];
+        b.u32( ml.shadings[i]);
+        const int *fvids = mesh.fvidxs(fid);
+        const int mid = mesh.faceMaterialId(fid);
+        const int *uvids = mid >= 0 ? mesh.faceUVs(fid) : nullptr;
+        for ( int k = 0; k < 3; ++k)
+        {
+            b.u32( ml.vmap.at( fvids[k]));
+            if ( uvids)
+                b.u32( ml.uvmap.at( U3DLayout::uvKey( mid, uvids[k])));
+        }   // end for
+    }   // end for
+    return b;
+}   // end baseMesh
+
+
+Block litTextureShader( size_t i, bool hasTX)
+{
+    Block b( LIT_TEXTURE_SHADER);
+    b.str( shaderName(i));
+    b.u32( LIGHTING_ENABLED);
+    b.f32( 0);  // Alpha test reference
+    b.u32( ALPHA_TEST_ALWAYS);
+    b.u32( FB_ALPHA_BLEND);
+    b.u32( 1);  // Render pass enabled flags
+    b.u32( hasTX ? 1 : 0);  // Shader channels
+    b.u32( 0);  // Alpha texture channels
+    b.str( "Material0");    // All shaders reference the same material
+    if ( hasTX)
+    {
+        b.str( textureName(i));
+        b.f32( 1);      // Texture intensity
+        b.u8( 0);       // Blend function (multiply)
+        b.u8( 1);       // Blend source (blending constant)
+        b.f32( 1);      // Blend constant
+        b.u8( 0);       // Texture mode (use texture coordinates)
+        b.identity();   // Texture transform
+        b.identity();   // Texture wrap transform
+        b.u8( 3);       // Repeat in both directions
+    }   // end if
+    return b;
+}   // end litTextureShader
+
+
+Block materialResource( const Colour &ems)
+{
+    Block b( MATERIAL_RESOURCE);
+    b.str( "Material0");
+    b.u32( ALL_MATERIAL_ATTRIBUTES);
+    for ( int i = 0; i < 9; ++i)
+        b.f32( 0);  // Ambient, diffuse, and specular are black for a completely flat colour
+    b.f32( float(ems[0]));
+    b.f32( float(ems[1]));
+    b.f32( float(ems[2]));
+    b.f32( 0);  // Reflectivity
+    b.f32( 1);  // Opacity
+    return b;
+}   // end materialResource
+
+
+// Encode the texture returning false if not possible.
+bool encodeTexture( const cv::Mat &tx, int quality, byte &imgType, byte &compression, std::vector<byte> &buf)
+{
+    const int nc = tx.channels();
+    if ( tx.depth() != CV_8U || (nc != 1 && nc != 3 && nc != 4))
+        return false;
+
+    imgType = nc == 1 ? 0x10 : (nc == 3 ? 0x0E : 0x0F);    // Luminance, RGB, RGBA
+    if ( quality < 100 && nc != 4)
+    {
+        compression = nc == 1 ? 0x03 : 0x01;    // JPEG-8 or JPEG-24
+        const std::vector<int> params = { cv::IMWRITE_JPEG_QUALITY, std::max( 0, quality)};
+        return cv::imencode( ".jpg", tx, buf, params);
+    }   // end if
+
+    compression = 0x02; // PNG
+    return cv::imencode( ".png", tx, buf);
+}   // end encodeTexture
+
+
+void textureBlocks( size_t i, const cv::Mat &tx, byte imgType, byte compression, const std::vector<byte> &buf,
+                    Block &decl, Block &cont)
+{
+    const std::string tname = textureName(i);
+    decl.str( tname);
+    decl.u32( uint32_t(tx.rows));
+    decl.u32( uint32_t(tx.cols));
+    decl.u8( imgType);
+    decl.u32( 1);           // Continuation image count
+    decl.u8( compression);
+    decl.u8( imgType);      // Image channels have the same bit flags as the image type
+    decl.u16( 0);           // Image is in a continuation block (not external)
+    decl.u32( uint32_t(buf.size()));
+
+    cont.str( tname);
+    cont.u32( 0);   // Continuation image index
+    cont.bytes( buf.data(), buf.size());
+}   // end textureBlocks
+
+
+
+// Get the largest extent of the given vertices along any axis (1 if they have no extent).
+float positionExtent( const Mesh &mesh, const std::vector<int> &vids)
+{
+    if ( vids.empty())
+        return 1;
+    Vec3f minv = mesh.vtx( vids.front());
+    Vec3f maxv = minv;
+    for ( int vid : vids)
+    {
+        minv = minv.cwiseMin( mesh.vtx(vid));
+        maxv = maxv.cwiseMax( mesh.vtx(vid));
+    }   // end for
+    const float extent = (maxv - minv).maxCoeff();
+    return extent > 0 ? extent : 1;
+}   // end positionExtent
+
+
+// Approximate encoded bytes per pixel of a texture having the given number of channels
+// (PNG if quality is 100 or there's an alpha channel, otherwise JPEG at the given quality).
+double textureBytesPerPixel( int nc, int quality)
+{
+    if ( quality >= 100 || nc == 4)
+        return 0.5 * nc;
+    return nc * (0.05 + 0.25 * std::max( 0, quality) / 100.0);
+}   // end textureBytesPerPixel
+
+
+// Approximate bytes needed for everything other than the textures.
+double geometryBytes( const Mesh &mesh)
+{
+    size_t nuvs = 0;
+    for ( int mid : mesh.materialIds())
+        nuvs += mesh.uvs(mid).size();
+    return 4096.0 + 12.0 * mesh.numVtxs() + 16.0 * nuvs + 40.0 * mesh.numFaces();
+}   // end geometryBytes
+
+}   // end namespace
+
+
+// public static
+U3DQuality U3DQuality::preset( Preset p)
+{
+    switch ( p)
+    {
+        case DRAFT:
+            return U3DQuality( 300, 300, 300, 50);
+        case BALANCED:
+            return U3DQuality( 700, 700, 500, 80);
+        default:
+            break;
+    }   // end switch
+    return U3DQuality();
+}   // end preset
+
+
+double r3dio::u3dTextureScale( const Mesh &mesh, const U3DQuality &q)
+{
+    if ( q.maxBytes == 0)
+        return 1;
+
+    double txBytes = 0;
+    for ( int mid : mesh.materialIds())
+    {
+        const cv::Mat tx = mesh.texture(mid);
+        txBytes += double(tx.total()) * textureBytesPerPixel( tx.channels(), q.texture);
+    }   // end for
+    if ( txBytes <= 0)
+        return 1;
+
+    // Textures are scaled in both dimensions so bytes scale with the square of the factor.
+    static const double MIN_SCALE = 1.0/64;
+    const double avail = double(q.maxBytes) - geometryBytes( mesh);
+    if ( avail <= 0)
+        return MIN_SCALE;
+    return std::max( MIN_SCALE, std::min( 1.0, std::sqrt( avail / txBytes)));
+}   // end u3dTextureScale
+
+
+cv::Mat r3dio::scaleTexture( const cv::Mat &tx, double scale)
+{
+    if ( scale >= 1 || tx.empty())
+        return tx;
+    const cv::Size sz( std::max( 1, int( std::lround( tx.cols * scale))),
+                       std::max( 1, int( std::lround( tx.rows * scale))));
+    cv::Mat out;
+    cv::resize( tx, out, sz, 0, 0, cv::INTER_AREA);
+    return out;
+}   // end scaleTexture
+
+
+double r3dio::u3dPositionError( const Mesh &mesh, const U3DQuality &q)
+{
+    if ( q.position >= 1000)
+        return 0;
+    const std::vector<int> vids( mesh.vtxIds().begin(), mesh.vtxIds().end());
+    const float step = quantStep( q.position, 8, 24, positionExtent( mesh, vids));
+    return std::sqrt(3.0) * step / 2; // Up to half a step in each dimension
+}   // end u3dPositionError
+
+
+// protected
+bool U3DWriter::doSave( const Mesh &mesh, const std::string &filename)
+{
+    static const std::string meshName = "Mesh0";
+    r3dio::IOStats &st = editStats();
+    r3dio::IOStats::Clock::time_point t0 = r3dio::IOStats::Clock::now();
+    const U3DLayout ml( mesh);
+    if ( ml.fids.empty())
+    {
+        setErr( "[ERROR] r3dio::U3DWriter::doSave: Mesh has no faces!");
+        return false;
+    }   // end if
+
+    // Get the extent of the positions to set the position quantization step.
+    const float extent = positionExtent( mesh, ml.vids);
+
+    const float iq[3] = { quantStep( _quality.position, 8, 24, extent),
+                          quantStep( _quality.geometry, 4, 16, 2),
+                          quantStep( _quality.texCoord, 6, 20, 1)};
+
+    std::vector<Block> decl;    // Declaration blocks (after the file header)
+    std::vector<Block> cont;    // Continuation blocks
+
+    const Block mnode = modelNode( meshName);
+    const Block smod = shadingModifier( meshName, ml.numShadings());
+    decl.push_back( modifierChain( meshName, NODE_CHAIN, {&mnode, &smod}));
+
+    const Block mdecl = meshDeclaration( meshName, ml, _quality, iq);
+    decl.push_back( modifierChain( meshName, MODEL_RESOURCE_CHAIN, {&mdecl}));
+
+    for ( size_t i = 0; i < ml.numShadings(); ++i)
+        decl.push_back( litTextureShader( i, i < ml.matIds.size()));
+    decl.push_back( materialResource( _ems));
+
+    if ( !progress( 0.1f, "Encoding mesh"))
+        return false;
+    {
+        R3DIO_TRACE( "U3DWriter: encode mesh");
+        cont.push_back( baseMesh( meshName, mesh, ml, _media9, _quality, iq));
+    }
+
+    st.convertSeconds += lapSeconds( t0);
+    const double txScale = u3dTextureScale( mesh, _quality);
+    for ( size_t i = 0; i < ml.matIds.size(); ++i)
+    {
+        if ( !progress( 0.5f + 0.4f * float(i) / ml.matIds.size(), "Encoding textures"))
+            return false;
+        R3DIO_TRACE( "U3DWriter: encode texture");
+        const cv::Mat tx = scaleTexture( mesh.texture( ml.matIds[i]), txScale);
+        byte imgType, compression;
+        std::vector<byte> buf;
+        if ( tx.empty() || !encodeTexture( tx, _quality.texture, imgType, compression, buf))
+        {
+            std::ostringstream eoss;
+            eoss << "[ERROR] r3dio::U3DWriter::doSave: Unable to encode texture for material " << ml.matIds[i] << "!";
+            setErr( eoss.str());
+            return false;
+        }   // end if
+
+        Block tdecl( TEXTURE_DECLARATION);
+        Block tcont( TEXTURE_CONTINUATION);
+        textureBlocks( i, tx, imgType, compression, buf, tdecl, tcont);
+        decl.push_back( modifierChain( textureName(i), TEXTURE_RESOURCE_CHAIN, {&tdecl}));
+        cont.push_back( std::move(tcont));
+        st.textures++;
+    }   // end for
+    st.textureSeconds += lapSeconds( t0);
+
+    if ( !progress( 0.9f, "Writing file"))
+        return false;
+
+    // The file header needs the total size of the declaration blocks and of the file.
+    Block header( FILE_HEADER);
+    size_t declSize = 12 + 24;  // The file header block itself
+    for ( const Block &b : decl)
+        declSize += b.size();
+    size_t fileSize = declSize;
+    for ( const Block &b : cont)
+        fileSize += b.size();
+
+    header.u16( 256);   // Major version
+    header.u16( 0);     // Minor version
+    header.u32( PROFILE_NO_COMPRESSION);
+    header.u32( uint32_t(declSize));
+    header.u64( uint64_t(fileSize));
+    header.u32( CHARSET_UTF8);
+    assert( header.size() == 12 + 24);
+
+    std::vector<byte> out;
+    out.reserve( fileSize);
+    header.appendTo( out);
+    for ( const Block &b : decl)
+        b.appendTo( out);
+    for ( const Block &b : cont)
+        b.appendTo( out);
+    assert( out.size() == fileSize);
+
+    st.convertSeconds += lapSeconds( t0);   // Assembling the blocks
+
+    std::string errMsg;
+    std::ofstream ofs;
+    try
+    {
+        R3DIO_TRACE( "U3DWriter: write");
+        const r3dio::IOStats::Timer timer( st.writeSeconds);
+        ofs.open( filename.c_str(), std::ios::out | std::ios::binary);
+        ofs.write( reinterpret_cast<const char*>( out.data()), std::streamsize( out.size()));
+        ofs.close();
+        if ( !ofs)
+            errMsg = "Failed to write all bytes!";
+    }   // end try
+    catch ( const std::exception &e)
+    {
+        errMsg = e.what();
+    }   // end catch
+
+    if ( !errMsg.empty())
+        setErr( "Unable to write U3D file: " + errMsg);
+    return errMsg.empty();
+}   // end doSave
@@ -0,0 +1,132 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Checks that concurrent Config::update calls lose no modifications and that
+ * several threads can save (and reload) meshes into the same directory at once.
+ */
+
+#include <r3dio/IOHelpers.h>
+#include <r3dio/Config.h>
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace BFS = boost::filesystem;
+
+const int NTHREADS = 8;
+const int NUPDATES = 200;
+
+
+bool check( bool v, const char *msg)
+{
+    if ( !v)
+        std::cerr << "[FAIL] ConfigTest: " << msg << std::endl;
+    return v;
+}   // end check
+
+
+r3d::Mesh::Ptr makeMesh( float s)
+{
+    r3d::Mesh::Ptr mesh = r3d::Mesh::create();
+    const r3d::Vec3f v[5] = { r3d::Vec3f( 0, 0, 0), r3d::Vec3f( s, 0, 0), r3d::Vec3f( s, s, 0),
+                              r3d::Vec3f( 0, s, 0), r3d::Vec3f( s/2, s/2, s)};
+    for ( int i = 0; i < 4; ++i)
+        mesh->addFace( v[i], v[(i+1)%4], v[4]);
+    return mesh;
+}   // end makeMesh
+
+
+bool testUpdates()
+{
+    const r3dio::Config::Ptr orig = r3dio::Config::current();
+    r3dio::Config::update( []( r3dio::Config &cfg){ cfg.setImageDPI( 0);});
+
+    std::vector<std::thread> threads;
+    for ( int t = 0; t < NTHREADS; ++t)
+        threads.emplace_back( [](){
+            for ( int i = 0; i < NUPDATES; ++i)
+            {
+                r3dio::Config::update( []( r3dio::Config &cfg){ cfg.setImageDPI( cfg.imageDPI() + 1);});
+                r3dio::Config::current()->pdflatex();   // Read concurrently with updates
+            }   // end for
+        });
+    for ( std::thread &t : threads)
+        t.join();
+
+    const float dpi = r3dio::Config::current()->imageDPI();
+    r3dio::Config::setCurrent( orig);
+    return check( dpi == float( NTHREADS * NUPDATES), "Config::update lost modifications");
+}   // end testUpdates
+
+
+bool testExports( const BFS::path &dir)
+{
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    for ( int t = 0; t < NTHREADS; ++t)
+        threads.emplace_back( [&dir, &failed, t](){
+            const r3d::Mesh::Ptr mesh = makeMesh( float(t+1));
+            std::ostringstream oss;
+            oss << "mesh" << t;
+            const std::string base = (dir / oss.str()).string();
+            if ( !r3dio::saveAsPLY( *mesh, base + ".ply") || !r3dio::saveAsOBJ( *mesh, base + ".obj"))
+                failed++;
+        });
+    for ( std::thread &t : threads)
+        t.join();
+    if ( !check( failed == 0, "concurrent save failed"))
+        return false;
+
+    bool ok = true;
+    for ( int t = 0; ok && t < NTHREADS; ++t)
+    {
+        std::ostringstream oss;
+        oss << "mesh" << t;
+        for ( const char *ext : {".ply", ".obj"})
+        {
+            const r3d::Mesh::Ptr mesh = r3dio::loadMesh( (dir / (oss.str() + ext)).string());
+            ok = ok && check( mesh && mesh->numFaces() == 4, "saved mesh didn't reload");
+        }   // end for
+    }   // end for
+
+    // No other mesh files (e.g. from clashing intermediate names) may be left in the directory
+    size_t nfiles = 0;
+    for ( BFS::directory_iterator it( dir), end; it != end; ++it)
+        if ( it->path().extension() == ".ply" || it->path().extension() == ".obj")
+            nfiles++;
+    return ok && check( nfiles == size_t( 2*NTHREADS), "unexpected files in the output directory");
+}   // end testExports
+
+}   // end namespace
+
+
+int main()
+{
+    const BFS::path dir = BFS::temp_directory_path() / BFS::unique_path( "r3dio-config-%%%%-%%%%");
+    BFS::create_directories( dir);
+    const bool ok = testUpdates() && testExports( dir);
+    boost::system::error_code ec;
+    BFS::remove_all( dir, ec);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}   // end main
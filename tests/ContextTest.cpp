@@ -0,0 +1,51 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Checks that Context::parallelFor completes when called while holding a
+ * MemoryReservation that every worker is blocked waiting for.
+ */
+
+#include <r3dio/Context.h>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+int main()
+{
+    const r3dio::Context::Ptr ctx = r3dio::Context::create( 2, 100);
+    std::atomic<size_t> sum(0);
+    std::vector<std::future<void> > futs;
+    {
+        const r3dio::Context::MemoryReservation mem( *ctx, 100);
+        for ( int i = 0; i < 6; ++i)
+            futs.push_back( ctx->submit( [&](){ r3dio::Context::MemoryReservation m( *ctx, 60); sum += 1000;}));
+        std::this_thread::sleep_for( std::chrono::milliseconds(50));  // Workers now blocked acquiring
+        ctx->parallelFor( 1000, [&]( size_t i){ sum += i;});
+    }
+    for ( std::future<void> &f : futs)
+        ctx->get( f);
+
+    if ( sum != 999*1000/2 + 6000 || ctx->memoryUsed() != 0)
+    {
+        std::cerr << "[FAIL] ContextTest: Wrong sum or memory still acquired" << std::endl;
+        return EXIT_FAILURE;
+    }   // end if
+    return EXIT_SUCCESS;
+}   // end main
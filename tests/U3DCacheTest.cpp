@@ -0,0 +1,94 @@
+/************************************************************************
+ * Copyright (C) 2022 Richard Palmer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ************************************************************************/
+
+/**
+ * Checks that U3DExporter's cache distinguishes a mesh from its reflection
+ * in a coordinate plane and that saved files never share an inode with the
+ * cached copies they were made from.
+ */
+
+#include <r3dio/U3DExporter.h>
+#include <boost/filesystem.hpp>
+#include <cstdlib>
+#include <iostream>
+
+namespace {
+
+namespace BFS = boost::filesystem;
+
+// A small open box with a y coordinate scaled by ysign.
+r3d::Mesh::Ptr makeMesh( float ysign)
+{
+    r3d::Mesh::Ptr mesh = r3d::Mesh::create();
+    const r3d::Vec3f v[5] = { r3d::Vec3f( 0, ysign*1, 0), r3d::Vec3f( 1, ysign*2, 0),
+                              r3d::Vec3f( 1, ysign*3, 1), r3d::Vec3f( 0, ysign*4, 1),
+                              r3d::Vec3f( 0.5f, ysign*5, 2)};
+    for ( int i = 0; i < 4; ++i)
+        mesh->addFace( v[i], v[(i+1)%4], v[4]);
+    return mesh;
+}   // end makeMesh
+
+
+size_t countCached( const BFS::path &cdir)
+{
+    size_t n = 0;
+    for ( BFS::directory_iterator it( cdir), end; it != end; ++it)
+        if ( it->path().extension() == ".u3d")
+            n++;
+    return n;
+}   // end countCached
+
+
+bool check( bool v, const char *msg)
+{
+    if ( !v)
+        std::cerr << "[FAIL] U3DCacheTest: " << msg << std::endl;
+    return v;
+}   // end check
+
+}   // end namespace
+
+
+int main()
+{
+    const BFS::path dir = BFS::temp_directory_path() / BFS::unique_path( "r3dio-u3dcache-%%%%-%%%%");
+    const BFS::path cdir = dir / "cache";
+    BFS::create_directories( dir);
+
+    std::shared_ptr<r3dio::Config> cfg = std::make_shared<r3dio::Config>( *r3dio::Config::current());
+    cfg->setU3DCacheDirectory( cdir.string());
+
+    r3dio::U3DExporter exporter( true, false, rimg::Colour::white(), cfg);
+    exporter.setUseNative( true);
+
+    const BFS::path f0 = dir / "mesh.u3d";
+    const BFS::path f1 = dir / "mirrored.u3d";
+    const BFS::path f2 = dir / "again.u3d";
+    bool ok = check( exporter.save( *makeMesh( 1), f0.string()), "saving mesh")
+           && check( exporter.save( *makeMesh( -1), f1.string()), "saving mirrored mesh")
+           && check( countCached( cdir) == 2, "mirrored mesh has the same cache key")
+           && check( exporter.save( *makeMesh( 1), f2.string()), "saving mesh from cache")
+           && check( countCached( cdir) == 2, "unchanged mesh has a different cache key");
+
+    for ( BFS::directory_iterator it( cdir), end; ok && it != end; ++it)
+        for ( const BFS::path &f : {f0, f1, f2})
+            ok = check( !BFS::equivalent( f, it->path()), "saved file shares an inode with the cache");
+
+    boost::system::error_code ec;
+    BFS::remove_all( dir, ec);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}   // end main